@@ -31,9 +31,18 @@
 
 uint32_t beep_delay;
 uint32_t beep_count;
+event_handle_t beep_handle = EVENT_HANDLE_NONE;
 
 void EVENT_beep_done();
 
+#ifdef EVENTS_DEFERRED
+// EVENT_beep_done() usually computes the next note, which is too slow for
+// the ISR.
+void beep_done_event(void* param) {
+  EVENT_beep_done();
+}
+#endif
+
 void beep_event(void* param) {
   BEEP_PORT_PIN = 1 << BEEP_PIN;
 
@@ -43,11 +52,15 @@ void beep_event(void* param) {
   if (i > 0) {
     i--;
     beep_count = i;
-    enqueue_event_rel(beep_delay,&beep_event,NULL);//(void*)i);
   } else {
+    stop_periodic(&beep_handle);
     BEEP_PORT_DDR &= ~(1 << BEEP_PIN);
     BEEP_PORT_PORT |= 1 << BEEP_PIN;
+#ifdef EVENTS_DEFERRED
+    beep_handle = enqueue_event_rel(0,&beep_done_event,NULL);
+#else
     EVENT_beep_done();
+#endif
   }
 }
 
@@ -58,7 +71,7 @@ void EVENT_beep_done() {
 */
 
 void beep_stop() {
-  dequeue_events(&beep_event);
+  event_cancel(beep_handle);
   beep_delay = 0;
   beep_count = 0;
   BEEP_PORT_DDR &= ~(1 << BEEP_PIN);
@@ -73,9 +86,8 @@ void hw_beep(uint32_t delay, uint32_t count) {
   //uint16_t count = count;
   BEEP_PORT_PORT &= ~(1 << BEEP_PIN);
   BEEP_PORT_DDR |= 1 << BEEP_PIN;
-  dequeue_events(&beep_event);
-  enqueue_event_rel(1,&beep_event,NULL); //(void*)count);
-  // FIXME: is it really necessary to queue it rather than just calling it?
+  stop_periodic(&beep_handle);
+  beep_handle = enqueue_periodic_flags(delay,&beep_event,NULL,EVENT_FLAG_ISR);
 }
 
 // takes frequency in Hz and duration in msec.
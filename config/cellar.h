@@ -17,4 +17,7 @@
 #define MOTOR_DRIVER_HR8833_L 2
 #define MOTOR_DRIVER_HR8833_R 3
 
+// the address on a shared serial line, see USART_BUS in main.c.
+//#define USART_BUS_ADDRESS 1
+
 #endif // CONFIG_CELLAR_H
\ No newline at end of file
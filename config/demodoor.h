@@ -29,5 +29,8 @@
 //#define PINPAD_LINEAR
 #define DEBUG_BACKDOOR
 
+// the address on a shared serial line, see USART_BUS in main.c.
+//#define USART_BUS_ADDRESS 3
+
 
 #endif /* CONFIG_OBEN_H */
\ No newline at end of file
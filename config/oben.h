@@ -18,6 +18,9 @@
 
 #define PINPAD_MATRIX
 
+// the address on a shared serial line, see USART_BUS in main.c.
+//#define USART_BUS_ADDRESS 2
+
 
 
 #endif /* CONFIG_OBEN_H */
\ No newline at end of file
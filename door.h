@@ -82,7 +82,21 @@
 // grep -a "^ *[0-9]\+$" stalling.txt | sort -n | uniq -c
 #define DOOR_MOTOR_SENSE_VOLTAGE_RUNNING 900
 #define DOOR_MOTOR_SENSE_VOLTAGE_STALL 720
+// quieter readings, e.g. with ADCW_SLEEP, may do with less.
+#ifndef DOOR_MOTOR_SENSE_FUZZ
 #define DOOR_MOTOR_SENSE_FUZZ 10
+#endif
+// the motor current is noisy: 32 conversions per reading, filtered by 1/4.
+#ifndef DOOR_MOTOR_SENSE_READ_SHIFT
+#define DOOR_MOTOR_SENSE_READ_SHIFT 5
+#endif
+#ifndef DOOR_MOTOR_SENSE_FILTER_SHIFT
+#define DOOR_MOTOR_SENSE_FILTER_SHIFT 2
+#endif
+// readings in a row while the motor runs, to catch a stall early.
+#ifndef DOOR_MOTOR_SENSE_WEIGHT
+#define DOOR_MOTOR_SENSE_WEIGHT 4
+#endif
 
 #define DOOR_MODE_IDLE 0
 #define DOOR_MODE_LOCKING 1 
@@ -91,6 +105,14 @@
 #define DOOR_MODE_UNLOCKRETRACT 4
 
 uint8_t door_mode = 0;
+// the pending door_lock_event and door_maybe_motorfail_event, if any.
+// All door events drive the motor and share state with the pin-change
+// interrupts, so they stay in the ISR with EVENTS_DEFERRED. They are the
+// only high priority events, so that neither music nor the display can
+// keep them from being queued or running on time.
+#define DOOR_EVENT_FLAGS (EVENT_FLAG_ISR | EVENT_FLAG_HIGH)
+event_handle_t door_lock_handle = EVENT_HANDLE_NONE;
+event_handle_t door_motorfail_handle = EVENT_HANDLE_NONE;
 
 bool door_is_locked()
 {
@@ -162,6 +184,9 @@ void door_enter_mode(uint8_t mode)
   else
   {
     // motor running. Watch it.
+    adc_watch_set_oversampling(DOOR_MOTOR_SENSE_PIN,DOOR_MOTOR_SENSE_READ_SHIFT);
+    adc_watch_set_filter(DOOR_MOTOR_SENSE_PIN,DOOR_MOTOR_SENSE_FILTER_SHIFT);
+    adc_watch_set_weight(DOOR_MOTOR_SENSE_PIN,DOOR_MOTOR_SENSE_WEIGHT);
     adc_watch_set_range(DOOR_MOTOR_SENSE_PIN,
                         DOOR_MOTOR_SENSE_VOLTAGE_STALL, DOOR_MOTOR_SENSE_VOLTAGE_RUNNING);
     adc_watch_set_mask(adcw_state.mask | mask);
@@ -248,12 +273,15 @@ void door_on_motor_sense_read(int16_t value)
   //  low = 1023;
   //  high = 0;
   adc_watch_set_range(DOOR_MOTOR_SENSE_PIN, low, high);
-  dequeue_events(&door_maybe_motorfail_event);
   if (reason == 1 ||
       (reason == 2 && door_mode != DOOR_MODE_IDLE) ||
       (reason == 3 && door_mode == DOOR_MODE_IDLE))
   {
-    enqueue_event_rel(dtime, &door_maybe_motorfail_event, (void *)(uint16_t)reason);
+    requeue_event_rel_flags(&door_motorfail_handle, dtime, &door_maybe_motorfail_event, (void *)(uint16_t)reason, DOOR_EVENT_FLAGS);
+  }
+  else
+  {
+    event_cancel(door_motorfail_handle);
   }
 }
 
@@ -280,7 +308,7 @@ void door_lock_event(void *param)
     if (mode == DOOR_MODE_LOCKING && !door_is_locked() && door_is_closed())
     {
       // retry later.
-      enqueue_event_rel(DOOR_RETRYLOCKTIME, &door_lock_event, (void *)1);
+      requeue_event_rel_flags(&door_lock_handle, DOOR_RETRYLOCKTIME, &door_lock_event, (void *)1, DOOR_EVENT_FLAGS);
     }
     if (mode == DOOR_MODE_LOCKING)
       EVENT_door_locked(door_is_locked());
@@ -297,30 +325,27 @@ void door_lock_event(void *param)
 
 void door_schedule_locking(uint32_t reltime)
 {
-  dequeue_events(&door_lock_event);
   door_enter_mode(DOOR_MODE_IDLE);
-  enqueue_event_rel(reltime, &door_lock_event, (void *)1);
+  requeue_event_rel_flags(&door_lock_handle, reltime, &door_lock_event, (void *)1, DOOR_EVENT_FLAGS);
 }
 
 void door_lock()
 {
   // turn motor until sensor says yo plus delta.
-  dequeue_events(&door_lock_event);
   door_enter_mode(DOOR_MODE_LOCKING);
-  enqueue_event_rel(DOOR_MAXLOCKTIME, &door_lock_event, NULL);
+  requeue_event_rel_flags(&door_lock_handle, DOOR_MAXLOCKTIME, &door_lock_event, NULL, DOOR_EVENT_FLAGS);
 }
 
 void door_unlock()
 {
   // turn motor back until sensor says yo plus delta.
-  dequeue_events(&door_lock_event);
   door_enter_mode(DOOR_MODE_UNLOCKING);
-  enqueue_event_rel(DOOR_MAXUNLOCKTIME, &door_lock_event, NULL);
+  requeue_event_rel_flags(&door_lock_handle, DOOR_MAXUNLOCKTIME, &door_lock_event, NULL, DOOR_EVENT_FLAGS);
 }
 
 void door_schedule_mfail_recover(uint8_t mode){
   //after a seized motor stop schedule a short turn in the opposed direction
-  dequeue_events(&door_lock_event);
+  event_cancel(door_lock_handle);
   uint8_t dir = 0;
   if(mode == DOOR_MODE_LOCKRETRACT){
     dir = 2;
@@ -329,7 +354,7 @@ void door_schedule_mfail_recover(uint8_t mode){
     dir = 1;
   }
   door_set_motor(dir);
-  enqueue_event_rel(DOOR_MFAIL_RECOVERTIME, &motor_stop_event, NULL);
+  enqueue_event_rel_flags(DOOR_MFAIL_RECOVERTIME, &motor_stop_event, NULL, DOOR_EVENT_FLAGS);
 
 }
 
@@ -358,13 +383,11 @@ void door_boltsensor_changed()
 {
   if (door_mode == DOOR_MODE_LOCKING && door_is_locked())
   {
-    dequeue_events(&door_lock_event);
-    enqueue_event_rel(DOOR_OVERLOCKTIME, &door_lock_event, NULL);
+    requeue_event_rel_flags(&door_lock_handle, DOOR_OVERLOCKTIME, &door_lock_event, NULL, DOOR_EVENT_FLAGS);
   }
   else if (door_mode == DOOR_MODE_UNLOCKING && !door_is_locked())
   {
-    dequeue_events(&door_lock_event);
-    enqueue_event_rel(DOOR_OVERUNLOCKTIME, &door_lock_event, NULL);
+    requeue_event_rel_flags(&door_lock_handle, DOOR_OVERUNLOCKTIME, &door_lock_event, NULL, DOOR_EVENT_FLAGS);
   }
   else if (door_mode == DOOR_MODE_IDLE && !door_is_locked())
   {
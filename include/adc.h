@@ -80,6 +80,24 @@ void adc_start_continuous(uint8_t srcpin, uint8_t ref) {
   ADCSRA |= (1<<ADATE) | (1<<ADSC); // set to automatic, start and clear ADIF.
 }
 
+// auto trigger sources for adc_start_triggered(), see ADTS in ADCSRB.
+#define ADC_TRIGGER_FREE_RUNNING 0
+#define ADC_TRIGGER_TIMER0_COMPA 3
+#define ADC_TRIGGER_TIMER0_OVERFLOW 4
+#define ADC_TRIGGER_TIMER1_COMPB 5
+#define ADC_TRIGGER_TIMER1_OVERFLOW 6
+
+// converts once on each rising edge of the trigger's interrupt flag.
+// The flag has to be cleared in between, or there won't be another edge.
+// Unlike in free running mode, the mux is read when a conversion starts,
+// so adc_set_channel() applies to the next conversion already.
+void adc_start_triggered(uint8_t srcpin, uint8_t ref, uint8_t trigger) {
+  uint8_t mux = (ref << REFS0) | (srcpin << MUX0); // also ADLAR = 0.
+  ADMUX = mux;
+  ADCSRB = trigger << ADTS0;
+  ADCSRA |= (1<<ADATE) | (1<<ADIF); // set to automatic and clear ADIF.
+}
+
 void adc_stop_continuous() {
   ADCSRA &= ~(1<<ADATE);
   // remove automatic flag. current conversion still continues though.
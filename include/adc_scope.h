@@ -0,0 +1,130 @@
+/*
+
+  ADC scope
+  records the raw conversions of one ADC channel into a ring, from a
+  trigger on, for the main loop to send them out.
+
+*/
+
+/*
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License version 2 or 3 as
+ * published by the Free Software Foundation.
+ */
+
+/*
+  adc_scope_arm() picks the channel and the number of samples,
+  adc_scope_trigger() starts the recording, and the ADC ISR hands every
+  conversion to adc_scope_conversion(). The main loop takes the samples out
+  with adc_scope_take().
+  A sample is the 10 bit conversion result, with the number of conversions
+  on other channels (or dropped after a switch) since the sample before in
+  the upper 6 bits, up to 63. With a fixed conversion rate, that gives the
+  time of each sample.
+  The recording is contiguous: if the ring runs full, it stops with
+  ADC_SCOPE_OVERRUN instead of leaving out samples.
+*/
+
+#ifndef __ADC_SCOPE_H__
+#define __ADC_SCOPE_H__
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <util/atomic.h>
+
+// samples in the ring, a power of two up to 128.
+#ifndef ADC_SCOPE_SIZE
+#define ADC_SCOPE_SIZE 64
+#endif
+#if (ADC_SCOPE_SIZE & (ADC_SCOPE_SIZE-1)) != 0 || ADC_SCOPE_SIZE > 128
+#error "ADC_SCOPE_SIZE must be a power of two up to 128"
+#endif
+
+#define ADC_SCOPE_OFF 0
+#define ADC_SCOPE_ARMED 1
+#define ADC_SCOPE_RUNNING 2
+// all samples recorded, some may still be in the ring.
+#define ADC_SCOPE_DONE 3
+// the ring ran full, the samples before are still in it.
+#define ADC_SCOPE_OVERRUN 4
+
+#define ADC_SCOPE_VALUE(sample) ((sample) & 0x3ff)
+#define ADC_SCOPE_SKIPPED(sample) ((sample) >> 10)
+
+/*
+  The ring works like the RX ring of usart.h: the ISR writes at head, the
+  main loop reads at tail.
+*/
+struct {
+  volatile uint8_t state;
+  uint8_t channel, skipped;
+  // samples still to record, and recorded since the trigger.
+  uint16_t left, count;
+  volatile uint8_t head, tail;
+  uint16_t ring[ADC_SCOPE_SIZE];
+} adc_scope;
+
+// records count samples of channel from the next trigger on, or stops
+// with count 0.
+void adc_scope_arm(uint8_t channel, uint16_t count) {
+  ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+    adc_scope.state = count != 0 ? ADC_SCOPE_ARMED : ADC_SCOPE_OFF;
+    adc_scope.channel = channel;
+    adc_scope.left = count;
+    adc_scope.count = 0;
+    adc_scope.tail = adc_scope.head;
+  }
+}
+
+void adc_scope_trigger() {
+  ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+    if (adc_scope.state == ADC_SCOPE_ARMED) {
+      adc_scope.skipped = 0;
+      adc_scope.state = ADC_SCOPE_RUNNING;
+    }
+  }
+}
+
+// from the ADC ISR: a conversion on channel, 0xff for one that is dropped.
+static inline void adc_scope_conversion(uint8_t channel, uint16_t value) {
+  if (adc_scope.state != ADC_SCOPE_RUNNING)
+    return;
+  if (channel != adc_scope.channel) {
+    if (adc_scope.skipped < 63)
+      adc_scope.skipped++;
+    return;
+  }
+  uint8_t head = adc_scope.head;
+  if ((uint8_t)(head-adc_scope.tail) >= ADC_SCOPE_SIZE) {
+    adc_scope.state = ADC_SCOPE_OVERRUN;
+    return;
+  }
+  adc_scope.ring[head & (ADC_SCOPE_SIZE-1)] = value | (uint16_t)adc_scope.skipped << 10;
+  adc_scope.head = head+1;
+  adc_scope.skipped = 0;
+  adc_scope.count++;
+  if (--adc_scope.left == 0)
+    adc_scope.state = ADC_SCOPE_DONE;
+}
+
+// the number of samples in the ring.
+static inline uint8_t adc_scope_available() {
+  return adc_scope.head-adc_scope.tail;
+}
+
+// moves up to max samples from the ring to dest, returns how many.
+uint8_t adc_scope_take(uint16_t* dest, uint8_t max) {
+  uint8_t tail = adc_scope.tail;
+  uint8_t n = adc_scope.head-tail;
+  if (n > max)
+    n = max;
+  for (uint8_t i = 0; i < n; i++) {
+    // the ISR writes 16 bits, but never the place we read.
+    dest[i] = adc_scope.ring[tail & (ADC_SCOPE_SIZE-1)];
+    tail++;
+  }
+  adc_scope.tail = tail;
+  return n;
+}
+
+#endif
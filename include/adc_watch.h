@@ -17,6 +17,10 @@
 #define __ADC_WATCH_H__
 
 #include <adc.h>
+#include <timers.h>
+#ifdef ADCW_SCOPE
+#include <adc_scope.h>
+#endif
 
 #define ADCW_STATE_STOPPED 0
 #define ADCW_STATE_INIT 1
@@ -24,17 +28,74 @@
 #define ADCW_STATE_SWITCHING 3
 #define ADCW_STATE_IDLE 4
 
-#ifndef ADCW_READ_COUNT
-#define ADCW_READ_COUNT 10
+/*
+  Each reading of a channel is the mean of 2^read_shift conversions, which
+  then goes through a filter of
+    value += (reading - value) / 2^filter_shift.
+  Both are shifts, so the ISR doesn't divide. The filter works in 1/32 ADC
+  units to keep the bits the oversampling gains; the first reading after a
+  channel is added to the mask starts it afresh.
+  The defaults are 2^ADCW_READ_SHIFT conversions and a filter shift of
+  ADCW_FILTER_SHIFT, set them per channel with adc_watch_set_oversampling()
+  and adc_watch_set_filter().
+  The channels in the mask take turns, each for as many readings in a row
+  as its weight, 1 by default, see adc_watch_set_weight(). The total rate
+  of conversions stays the same, a heavier channel just gets more of them.
+  Readings in a row also save the conversion dropped after a switch.
+
+  By default the ADC converts all the time, at 9.6 kHz with ADC_DIV_128.
+  With a sample period (ADCW_SAMPLE_PERIOD or adc_watch_set_period()) in
+  Timer 1 ticks, the ADC is triggered by Timer 1 Compare Match B instead,
+  and the ISR moves OCR1B on by the period. That's a fixed sample rate and
+  an ADC that is idle in between. The period must be below 2^16 ticks and
+  longer than a conversion, a late ISR starts again from now.
+
+  With ADCW_SLEEP, the ADC doesn't run by itself. The main loop starts each
+  conversion with adc_watch_sleep(), in ADC noise reduction sleep when
+  nothing else needs the I/O clock, so the CPU and digital I/O are quiet
+  while the ADC samples. That stops Timer 1, too, and the event clock is
+  moved on by the conversion time afterwards. There's no sample period then.
+
+  With ADCW_SCOPE, every conversion also goes to adc_scope.h.
+*/
+#define ADCW_READ_SHIFT_MAX 5
+#define ADCW_FRAC_BITS ADCW_READ_SHIFT_MAX
+
+#ifndef ADCW_READ_SHIFT
+#define ADCW_READ_SHIFT 3
+#endif
+#ifndef ADCW_FILTER_SHIFT
+#define ADCW_FILTER_SHIFT 1
+#endif
+#ifdef ADCW_SLEEP
+#include <avr/sleep.h>
+#undef ADCW_SAMPLE_PERIOD
+#define ADCW_SAMPLE_PERIOD 0
+// Timer 1 ticks per conversion: 13 ADC clocks at ADC_DIV_128.
+#ifndef ADCW_CONVERSION_TICKS
+#define ADCW_CONVERSION_TICKS (13*128/TIMER_DIV)
+#endif
+#endif
+#ifndef ADCW_SAMPLE_PERIOD
+#define ADCW_SAMPLE_PERIOD 0
 #endif
 
 void EVENT_adc_watch(uint8_t channel, int16_t value);
 
 struct {
-  uint8_t channel, next_channel, state, mask, count, max_count;
+  uint8_t channel, next_channel, state, mask, count, max_count, shift;
   // prescaler;
   uint16_t val;
   int16_t values[8],min[8],max[8];
+  // in 1/2^ADCW_FRAC_BITS ADC units.
+  int16_t filtered[8];
+  uint8_t read_shift[8], filter_shift[8];
+  // readings in a row per channel, and those left on the current one.
+  uint8_t weight[8], turns;
+  // Timer 1 ticks between conversions, 0 when free running.
+  uint16_t period;
+  // channels whose filter has a value.
+  uint8_t primed;
 } adcw_state;// = {0,0,ADCW_STATE_STOPPED,0,0,0,{0,0,0,0,0,0,0,0}};
 
 void adc_watch_idle() {
@@ -51,9 +112,33 @@ void adc_watch_unidle() {
   while (c < 7 && (mask & (1<<c)) == 0)
     c++;
   adcw_state.channel = c;
+  adcw_state.turns = adcw_state.weight[c];
   adcw_state.state = ADCW_STATE_INIT;
   adc_interrupt_enable(true);
-  adc_start_continuous(c,ADC_REF_VCC);
+#ifdef ADCW_SLEEP
+  // adc_watch_sleep() starts the conversions.
+  adc_stop_continuous();
+  adc_set_channel(c,ADC_REF_VCC);
+#else
+  uint16_t period = adcw_state.period;
+  if (period != 0) {
+    OCR1B = Timer_Value(1)+period;
+    Timer_Interrupt_Flag_Clear(1,TIMER_INTERRUPT_OUTPUT_COMPARE_B);
+    adc_start_triggered(c,ADC_REF_VCC,ADC_TRIGGER_TIMER1_COMPB);
+  } else {
+    adc_start_continuous(c,ADC_REF_VCC);
+  }
+#endif
+}
+
+// whether conversions read ADMUX when they start. In free running mode
+// the next one has started already when the ISR sees a result.
+static inline bool adc_watch_mux_at_start() {
+#ifdef ADCW_SLEEP
+  return true;
+#else
+  return adcw_state.period != 0;
+#endif
 }
 
 void adc_watch_stop() {
@@ -80,7 +165,12 @@ void adc_watch_init(uint8_t channel_mask) {
     adcw_state.max[i] = -1;
   // -> The default is "alert everything".
   adcw_state.mask = channel_mask;
-  adcw_state.max_count = ADCW_READ_COUNT-1;
+  for (int i = 0; i < 8; i++) {
+    adcw_state.read_shift[i] = ADCW_READ_SHIFT;
+    adcw_state.filter_shift[i] = ADCW_FILTER_SHIFT;
+    adcw_state.weight[i] = 1;
+  }
+  adcw_state.period = ADCW_SAMPLE_PERIOD;
   //adcw_state.prescaler = prescaler;
   adcw_state.state = ADCW_STATE_STOPPED;
 }
@@ -91,6 +181,7 @@ void adc_watch_set_mask(uint8_t channel_mask) {
       adc_watch_idle();
     adcw_state.mask = 0;
   } else {
+    adcw_state.primed &= ~(channel_mask & ~adcw_state.mask);
     adcw_state.mask = channel_mask;
     if (adcw_state.state == ADCW_STATE_IDLE)
       adc_watch_unidle();
@@ -102,54 +193,132 @@ void adc_watch_set_range(uint8_t channel, int16_t min, int16_t max) {
   adcw_state.max[channel] = max;
 }
 
-void adc_watch_set_read_count(uint8_t count) {
-  if (count >= 1)
-    adcw_state.max_count = count-1;
+// 2^shift conversions per reading, up to 2^ADCW_READ_SHIFT_MAX.
+void adc_watch_set_oversampling(uint8_t channel, uint8_t shift) {
+  if (shift > ADCW_READ_SHIFT_MAX)
+    shift = ADCW_READ_SHIFT_MAX;
+  adcw_state.read_shift[channel] = shift;
+}
+
+// 0 turns the filter off, every reading replaces the value.
+void adc_watch_set_filter(uint8_t channel, uint8_t shift) {
+  if (shift > 15)
+    shift = 15;
+  adcw_state.filter_shift[channel] = shift;
+}
+
+#ifndef ADCW_SLEEP
+// Timer 1 ticks between conversions, or 0 to convert all the time.
+void adc_watch_set_period(uint16_t period) {
+  uint8_t state = adcw_state.state;
+  bool running = state != ADCW_STATE_STOPPED && state != ADCW_STATE_IDLE;
+  if (running)
+    adc_watch_stop();
+  adcw_state.period = period;
+  if (running)
+    adc_watch_unidle();
+}
+#endif
+
+// readings in a row on channel before the next one gets its turn, at least 1.
+void adc_watch_set_weight(uint8_t channel, uint8_t weight) {
+  adcw_state.weight[channel] = weight == 0 ? 1 : weight;
+}
+
+// starts a reading on the current channel with the running conversion
+// and picks the channel of the next one.
+void adc_watch_begin_reading() {
+  adcw_state.state = ADCW_STATE_READING;
+  adcw_state.count = 0;
+  adcw_state.val = 0;
+  uint8_t c = adcw_state.channel;
+  uint8_t mask = adcw_state.mask;
+  if (mask == 0) {
+    adc_watch_idle();
+    return;
+  }
+  if (adcw_state.turns > 1 && (mask & (1<<c))) {
+    adcw_state.turns--;
+  } else {
+    do {
+      c++;
+      if (c >= 8) c -= 8;
+    } while (!(mask & (1<<c)));
+  }
+  adcw_state.next_channel = c;
+  uint8_t shift = adcw_state.read_shift[adcw_state.channel];
+  adcw_state.shift = shift;
+  adcw_state.max_count = (1 << shift)-1;
+  if (adcw_state.max_count == 0) {
+    // the running conversion is the only one.
+    adcw_state.state = ADCW_STATE_SWITCHING;
+    if (!adc_watch_mux_at_start())
+      adc_set_channel(c,ADC_REF_VCC);
+  }
 }
 
 On_ADC_read {
-  // do something
+  uint16_t period = adcw_state.period;
+  if (period != 0) {
+    // the next trigger, and the edge for it.
+    uint16_t next = OCR1B+period;
+    if ((int16_t)(next-Timer_Value(1)) < 2)
+      next = Timer_Value(1)+period;
+    OCR1B = next;
+    Timer_Interrupt_Flag_Clear(1,TIMER_INTERRUPT_OUTPUT_COMPARE_B);
+  }
+#ifdef ADCW_SCOPE
+  uint8_t state = adcw_state.state;
+  if (state == ADCW_STATE_READING || state == ADCW_STATE_SWITCHING)
+    adc_scope_conversion(adcw_state.channel,adc_value());
+  else if (state == ADCW_STATE_INIT)
+    adc_scope_conversion(0xff,0);
+#endif
   switch(adcw_state.state) {
     case ADCW_STATE_STOPPED:
       break; // result returned ignored after stopping.
-    case ADCW_STATE_INIT: {
+    case ADCW_STATE_INIT:
       // first read on the channel complete, but garbage.
-      adcw_state.state = ADCW_STATE_READING;
-      adcw_state.count = 0;
-      adcw_state.val = 0;
-      uint8_t c = adcw_state.channel;
-      uint8_t mask = adcw_state.mask;
-      if (mask == 0) {
-        adc_watch_idle();
-        return;
-      }
-      do {
-        c++;
-        if (c >= 8) c -= 8;
-      } while (!(mask & (1<<c)));
-      adcw_state.next_channel = c;
+      adc_watch_begin_reading();
       break;
-    }
     case ADCW_STATE_READING:
       adcw_state.val += adc_value();
       adcw_state.count++;
       if (adcw_state.count >= adcw_state.max_count) {
         //ADCW_READ_COUNT-1) {
         adcw_state.state = ADCW_STATE_SWITCHING;
-        adc_set_channel(adcw_state.next_channel,ADC_REF_VCC);
-        // next read result is still on current channel.
+        // next read result is still on current channel. Triggered
+        // conversions haven't started yet, they switch a read later.
+        if (!adc_watch_mux_at_start())
+          adc_set_channel(adcw_state.next_channel,ADC_REF_VCC);
       }
       break;
     case ADCW_STATE_SWITCHING: {
+      // the sum of 2^shift conversions, scaled to 2^ADCW_FRAC_BITS.
       uint16_t uval = adcw_state.val + adc_value();
-      uint8_t count = adcw_state.count+1; //ADCW_READ_COUNT;
-      //uint8_t count = adcw_state.count+1;
-      uval /= count;
+      int16_t reading = uval << (ADCW_FRAC_BITS-adcw_state.shift);
       uint8_t chan = adcw_state.channel;
-      int16_t val = (adcw_state.values[chan]+(int16_t)uval)/2;
+      uint8_t bit = 1 << chan;
+      int16_t filtered = reading;
+      if (adcw_state.primed & bit) {
+        filtered = adcw_state.filtered[chan];
+        filtered += (reading-filtered) >> adcw_state.filter_shift[chan];
+      }
+      adcw_state.primed |= bit;
+      adcw_state.filtered[chan] = filtered;
+      int16_t val = (filtered + (1 << (ADCW_FRAC_BITS-1))) >> ADCW_FRAC_BITS;
       adcw_state.values[chan] = val;
-      adcw_state.channel = adcw_state.next_channel;
-      adcw_state.state = ADCW_STATE_INIT;
+      uint8_t next = adcw_state.next_channel;
+      if (next == chan) {
+        // the running conversion is on the same channel already.
+        adc_watch_begin_reading();
+      } else {
+        if (adc_watch_mux_at_start())
+          adc_set_channel(next,ADC_REF_VCC);
+        adcw_state.channel = next;
+        adcw_state.turns = adcw_state.weight[next];
+        adcw_state.state = ADCW_STATE_INIT;
+      }
       if ((val > adcw_state.max[chan]) || (val < adcw_state.min[chan])) {
         EVENT_adc_watch(chan,val);
       }
@@ -166,4 +335,48 @@ On_ADC_read {
   }
 }
 
+#ifdef ADCW_SLEEP
+/*
+  starts the conversion the watcher waits for, if any. With quiet, and no
+  event due before it ends, the CPU sleeps in ADC noise reduction mode till
+  it's done. The USART stops then as well, so a pin change on RXD wakes us
+  in time for a start bit. We can't tell when another interrupt woke us, so
+  we assume half the conversion time, like tickless_sleep(). The ISR that
+  woke us sees a clock that is up to one conversion late.
+  To be called with interrupts disabled. Returns with interrupts disabled,
+  true if it slept.
+*/
+bool adc_watch_sleep(bool quiet) {
+  uint8_t state = adcw_state.state;
+  if (state == ADCW_STATE_STOPPED || state == ADCW_STATE_IDLE ||
+      (ADCSRA & (1<<ADSC)))
+    return false;
+  uint32_t next;
+  if (quiet && events_next_time(&next) &&
+      (int32_t)(next-get_time_sync()) <= (int32_t)ADCW_CONVERSION_TICKS)
+    quiet = false;
+  if (!quiet) {
+    ADCSRA |= 1<<ADSC;
+    return false;
+  }
+  uint8_t pcicr = PCICR, pcmsk2 = PCMSK2;
+  PCMSK2 |= 1 << PCINT16;
+  PCICR |= 1 << PCIE2;
+  set_sleep_mode(SLEEP_MODE_ADC);
+  sleep_enable();
+  sei();
+  sleep_cpu();
+  sleep_disable();
+  cli();
+  set_sleep_mode(SLEEP_MODE_IDLE);
+  PCMSK2 = pcmsk2;
+  PCICR = pcicr;
+  uint16_t ticks = ADCW_CONVERSION_TICKS;
+  if (ADCSRA & (1<<ADSC))
+    ticks >>= 1;
+  events_advance_time(ticks);
+  return true;
+}
+#endif
+
 #endif
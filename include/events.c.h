@@ -15,67 +15,444 @@
 
 #include <events.h>
 #include <timers.h>
+#ifdef EVENTS_STATS
+#include <string.h>
+#endif
+
+// host simulations (test/fakeheader/fake_timer1.h) let the clock run on by
+// this many cycles for the code around it.
+#ifndef EVENTS_SIM_COST
+#define EVENTS_SIM_COST(cycles)
+#endif
+
+// instead of x > y. Means that x >= y > x-(1<<(sizeof(x)-1))
+// <=> (x-y >= 0) for signed types:
+#define gteq_mod_type(x,y) (((x) - (y)) & (1 << (sizeof(x)*8-1)) == 0)
+
+static inline bool gteq_mod32(uint32_t x,uint32_t y) {
+  return (int32_t)(x-y) >= 0;
+}
+
+static inline bool gteq_mod16(uint16_t x,uint16_t y) {
+  return (int16_t)(x-y) >= 0;
+}
+
+static inline bool gteq_mod8(uint8_t x,uint8_t y) {
+  return (int8_t)(x-y) >= 0;
+}
+
+// x is due before y. Times wrap around, so this only holds up for times
+// less than 2^31 ticks apart, which is what all queued events are.
+static inline bool events_before(uint32_t x,uint32_t y) {
+  // loading one of the times, sub+3*sbc and a branch.
+  EVENTS_SIM_COST(14);
+  return (int32_t)(x-y) < 0;
+}
+
+// x is due before y, for the keys of two queued slots.
+static inline bool events_key_before(event_key_t x,event_key_t y) {
+#ifdef EVENTS_COMPACT
+  // the keys are both after event_epoch and don't wrap.
+  EVENTS_SIM_COST(6);
+  return x < y;
+#else
+  return events_before(x,y);
+#endif
+}
+
+static inline void events_heap_set(uint8_t i, uint8_t slot)
+{
+  EVENTS_SIM_COST(10);
+  event_heap[i] = slot;
+  event_slots[slot].heap_ix = i;
+}
 
 /**
- * @brief Computes the successor of a value in modular arithmetic.
- * 
- * Increments the value `i` within the range [0, mod - 1]. 
- * If `i` is less than `mod - 1`, returns `i + 1`; otherwise, returns 0.
- * 
- * @param i   Current value (8-bit unsigned integer, must satisfy 0 <= i < mod.
- * @param mod Modulus defining the range (8-bit unsigned integer, must be > 0).
- * 
- * @return uint8_t The next value in the cycle.
+ * @brief Moves a slot up the heap from a hole at index `i` to its place.
+ *
+ * Parents due later than `slot` are moved down into the hole until the hole
+ * reaches the root or a parent due no later than `slot`, where `slot` is
+ * stored.
+ *
+ * @param i     Index of the hole, usually the new last element.
+ * @param slot  The slot to store.
+ *
+ * @return uint8_t The index `slot` ended up at. 0 means it is the next one due.
  */
-static inline uint8_t succmod(uint8_t i, uint8_t mod)
+static uint8_t events_sift_up(uint8_t i, uint8_t slot)
 {
-  return (i!=mod-1)?i+1:0;
+  event_key_t time = event_slots[slot].time;
+  while (i != 0) {
+    uint8_t parent = (i-1)/2;
+    uint8_t pslot = event_heap[parent];
+    if (!events_key_before(time,event_slots[pslot].time))
+      break;
+    events_heap_set(i,pslot);
+    i = parent;
+  }
+  events_heap_set(i,slot);
+  return i;
 }
 
 /**
- * @brief Computes the predecessor of a value in modular arithmetic.
- * 
- * Decrements the value `i` within the range [0, mod - 1]. 
- * If `i` is greater than 0, returns `i - 1`; otherwise, wraps around to `mod - 1`.
- * 
- * @param i   Current value (8-bit unsigned integer). Valid range: 0 <= i < mod.
- * @param mod Modulus defining the range (8-bit unsigned integer, must be > 0).
- * 
- * @return uint8_t The previous value in the cycle.
+ * @brief Moves a slot down the heap from a hole at index `i` to its place.
+ *
+ * The earlier child is moved up into the hole as long as it is due before
+ * `slot`, then `slot` is stored in the hole.
+ *
+ * @param i      Index of the hole, e.g. 0 after taking out the first event.
+ * @param slot   The slot to store.
+ * @param count  Number of events in the heap.
  */
-static inline uint8_t predmod(uint8_t i, uint8_t mod)
+static void events_sift_down(uint8_t i, uint8_t slot, uint8_t count)
+{
+  event_key_t time = event_slots[slot].time;
+  while (1) {
+    uint8_t child = 2*i+1;
+    if (child >= count)
+      break;
+    uint8_t cslot = event_heap[child];
+    if (child+1 < count) {
+      uint8_t cslot2 = event_heap[child+1];
+      if (events_key_before(event_slots[cslot2].time,event_slots[cslot].time)) {
+        child++;
+        cslot = cslot2;
+      }
+    }
+    if (!events_key_before(event_slots[cslot].time,time))
+      break;
+    events_heap_set(i,cslot);
+    i = child;
+  }
+  events_heap_set(i,slot);
+}
+
+// the slot at heap index i has a new time. Move it to its place.
+static void events_heap_update(uint8_t i)
+{
+  uint8_t slot = event_heap[i];
+  if (i != 0 && events_key_before(event_slots[slot].time,
+                                  event_slots[event_heap[(i-1)/2]].time)) {
+    events_sift_up(i,slot);
+  } else {
+    events_sift_down(i,slot,event_count);
+  }
+}
+
+// frees a slot, so that handles to it become invalid.
+static inline void events_slot_free(uint8_t slot)
+{
+  event_slot_t *ev = &event_slots[slot];
+  EVENTS_SIM_COST(12);
+  if (ev->flags & EVENT_FLAG_HIGH)
+    event_high_count--;
+#ifdef EVENTS_COMPACT
+  uint8_t rec = ev->flags >> EVENT_FLAGS_LONG_SHIFT;
+  if (rec != 0)
+    event_long[rec-1].slot = EVENT_HEAP_IX_NONE;
+#endif
+  ev->flags = 0;
+  ev->heap_ix = EVENT_HEAP_IX_NONE;
+  uint8_t gen = ev->generation+1;
+  if (gen == 0) gen = 1; // keeps handles from becoming EVENT_HANDLE_NONE.
+  ev->generation = gen;
+}
+
+/**
+ * @brief Takes the event at heap index `i` out of the heap, but keeps its slot.
+ *
+ * The last event fills the hole and moves up or down from there. The slot
+ * takes the place of the last event, at the start of the free slots.
+ * Does not touch the hardware timer.
+ *
+ * @param i  Heap index of the event, must be less than `event_count`.
+ *
+ * @return uint8_t The slot, now at `event_heap[event_count]`.
+ */
+static uint8_t events_heap_unlink(uint8_t i)
+{
+  uint8_t count = event_count-1;
+  uint8_t slot = event_heap[i];
+  uint8_t last = event_heap[count];
+  event_count = count;
+  event_heap[count] = slot;
+  if (i != count) {
+    events_heap_set(i,last);
+    events_heap_update(i);
+  }
+  return slot;
+}
+
+// takes the event at heap index i out of the heap and frees its slot.
+static inline void events_heap_remove(uint8_t i)
+{
+  events_slot_free(events_heap_unlink(i));
+}
+
+// puts the slot at event_heap[pos] (pos >= event_count) into the heap.
+// Returns its heap index, 0 meaning that it is the next one due.
+static uint8_t events_heap_insert(uint8_t pos)
+{
+  uint8_t count = event_count;
+  uint8_t slot = event_heap[pos];
+  event_heap[pos] = event_heap[count];
+  event_count = count+1;
+  return events_sift_up(count,slot);
+}
+
+#ifdef EVENTS_DEFERRED
+#define events_free_end() (EVENT_QUEUE_SIZE-event_ready_count)
+
+// whether a slot with a valid handle is ready rather than in the heap.
+static inline bool events_slot_is_ready(uint8_t slot)
+{
+  return event_slots[slot].heap_ix >= event_count;
+}
+
+// marks the slot returned by events_heap_unlink() ready by moving it in
+// front of the other ready slots at the end of event_heap.
+static void events_ready_add(uint8_t slot)
+{
+  uint8_t pos = EVENT_QUEUE_SIZE-1-event_ready_count;
+  event_heap[event_count] = event_heap[pos];
+  events_heap_set(pos,slot);
+  event_ready_count++;
+}
+
+// takes a ready slot out of the ready ones. Returns its new position,
+// which is at the end of the free slots.
+static uint8_t events_ready_remove(uint8_t slot)
+{
+  uint8_t first = EVENT_QUEUE_SIZE-event_ready_count;
+  events_heap_set(event_slots[slot].heap_ix,event_heap[first]);
+  event_heap[first] = slot;
+  event_ready_count--;
+  return first;
+}
+#else
+#define events_free_end() EVENT_QUEUE_SIZE
+#endif
+
+// looks up the slot of a handle. Returns EVENT_HEAP_IX_NONE for a handle
+// whose event already fired or was cancelled.
+static inline uint8_t events_handle_slot(event_handle_t handle)
+{
+  uint8_t slot = event_handle_slot(handle);
+  if (slot >= EVENT_QUEUE_SIZE ||
+      event_slots[slot].generation != event_handle_generation(handle) ||
+      event_slots[slot].heap_ix == EVENT_HEAP_IX_NONE)
+    return EVENT_HEAP_IX_NONE;
+  return slot;
+}
+
+#ifdef EVENTS_COMPACT
+#define EVENTS_BUILTIN_HANDLERS &event_timeout_hop,
+// handler index of a handler that is not in events_handlers[].
+#define EVENTS_HANDLER_NONE 0xff
+
+static void event_timeout_hop(void* param);
+
+// the index of h in events_handlers[], or EVENTS_HANDLER_NONE.
+static uint8_t events_handler_index(event_handler_fun_t h)
+{
+  for (uint8_t i = 0; i != EVENTS_HANDLER_NONE; i++) {
+    event_handler_fun_t x = (event_handler_fun_t)pgm_read_ptr(&events_handlers[i]);
+    EVENTS_SIM_COST(8);
+    if (x == NULL)
+      break;
+    if (x == h)
+      return i;
+  }
+  return EVENTS_HANDLER_NONE;
+}
+
+static inline event_handler_fun_t events_slot_handler(uint8_t slot)
 {
-  return (i!=0)?i-1:mod-1;
+  return (event_handler_fun_t)pgm_read_ptr(&events_handlers[event_slots[slot].handler]);
+}
+
+// the key of time t: 0 for times before event_epoch, 0xffff for far ones.
+static inline uint16_t events_key(uint32_t t)
+{
+  int32_t d = t-event_epoch;
+  if (d < 0)
+    return 0;
+  if (d > 0xffff)
+    return 0xffff;
+  return d;
+}
+
+// the long record of a slot, or NULL.
+static inline event_long_t* events_slot_long(uint8_t slot)
+{
+  uint8_t rec = event_slots[slot].flags >> EVENT_FLAGS_LONG_SHIFT;
+  return rec != 0 ? &event_long[rec-1] : NULL;
+}
+
+// the real time of a slot.
+static inline uint32_t events_slot_due(uint8_t slot)
+{
+  event_long_t *l = events_slot_long(slot);
+  return l != NULL ? l->time : events_slot_time(slot);
+}
+
+static inline uint32_t events_slot_period(uint8_t slot)
+{
+  event_long_t *l = events_slot_long(slot);
+  return l != NULL ? l->period : 0;
 }
 
 /*
-  Macro definitions to so that it is not needed to write x = succmod(x,(mod));
+  Sets the time and period of a slot, taking or giving back its long
+  record as needed. Returns false if it needs one and there is none left.
+  Doesn't move the slot in the heap.
 */
-#define events_incmod(x,mod) do { x = succmod(x,(mod)); } while(0)
-#define events_decmod(x,mod) do { x = predmod(x,(mod)); } while(0)
+static bool events_slot_set(uint8_t slot, uint32_t time, uint32_t period)
+{
+  event_slot_t *ev = &event_slots[slot];
+  event_long_t *l = events_slot_long(slot);
+  if (period != 0 || (int32_t)(time-event_epoch) > 0xffff) {
+    if (l == NULL) {
+      uint8_t k = 0;
+      while (event_long[k].slot != EVENT_HEAP_IX_NONE) {
+        if (++k == EVENTS_LONG_SIZE)
+          return false;
+      }
+      l = &event_long[k];
+      l->slot = slot;
+      ev->flags |= (k+1) << EVENT_FLAGS_LONG_SHIFT;
+    }
+    l->time = time;
+    l->period = period;
+  } else if (l != NULL) {
+    l->slot = EVENT_HEAP_IX_NONE;
+    ev->flags &= (1 << EVENT_FLAGS_LONG_SHIFT)-1;
+  }
+  ev->time = events_key(time);
+  return true;
+}
 
-// instead of x > y. Means that x >= y > x-(1<<(sizeof(x)-1))
-// <=> (x-y >= 0) for signed types:
-#define gteq_mod_type(x,y) (((x) - (y)) & (1 << (sizeof(x)*8-1)) == 0)
+/*
+  Moves event_epoch forward to EVENTS_COMPACT_BEHIND ticks before now, and
+  the keys of the queued and ready slots back by as much, which keeps
+  them in order. Then the slots with a long record get the key of their
+  real time, which for far events is a larger one, and move down the heap
+  from there. One-shot events that aren't far any more give their record
+  back. If that moves the first event to a later time, the compare unit
+  gets its new time, as a match at the old one would find nothing due and
+  leave it for a whole timer period. To be called with interrupts disabled.
+*/
+static inline void events_set_hw_timer(uint32_t time);
 
-static inline bool gteq_mod32(uint32_t x,uint32_t y) {
-  return (int32_t)(x-y) >= 0;
+static void events_rebase(uint32_t now)
+{
+  uint32_t first = event_count != 0 ? events_slot_time(event_heap[0]) : 0;
+  uint32_t epoch = now-EVENTS_COMPACT_BEHIND;
+  uint32_t shift = epoch-event_epoch;
+  event_epoch = epoch;
+  for (uint8_t slot = 0; slot < EVENT_QUEUE_SIZE; slot++) {
+    event_slot_t *ev = &event_slots[slot];
+    EVENTS_SIM_COST(12);
+    ev->time = ev->time > shift ? ev->time-shift : 0;
+  }
+  for (uint8_t k = 0; k < EVENTS_LONG_SIZE; k++) {
+    event_long_t *l = &event_long[k];
+    uint8_t slot = l->slot;
+    if (slot == EVENT_HEAP_IX_NONE)
+      continue;
+    events_slot_set(slot,l->time,l->period);
+    if (event_slots[slot].heap_ix < event_count)
+      events_heap_update(event_slots[slot].heap_ix);
+  }
+  if (event_count != 0 && events_slot_time(event_heap[0]) != first)
+    events_set_hw_timer(events_slot_time(event_heap[0]));
 }
 
-static inline bool gteq_mod16(uint16_t x,uint16_t y) {
-  return (int16_t)(x-y) >= 0;
+// rebases before the keys get too far behind now. The heap keeps the
+// timer interrupt coming at least every 0xffff ticks, but an empty one
+// doesn't.
+static inline void events_epoch_update(uint32_t now)
+{
+  if ((uint32_t)(now-event_epoch) >= EVENTS_COMPACT_BEHIND+0x8000)
+    events_rebase(now);
+}
+#else
+static inline event_handler_fun_t events_slot_handler(uint8_t slot)
+{
+  return event_slots[slot].handler;
 }
 
-static inline bool gteq_mod8(uint8_t x,uint8_t y) {
-  return (int8_t)(x-y) >= 0;
+static inline uint32_t events_slot_due(uint8_t slot)
+{
+  return event_slots[slot].time;
+}
+
+static inline uint32_t events_slot_period(uint8_t slot)
+{
+  return event_slots[slot].period;
+}
+
+static inline bool events_slot_set(uint8_t slot, uint32_t time, uint32_t period)
+{
+  event_slots[slot].time = time;
+  event_slots[slot].period = period;
+  return true;
+}
+#endif
+
+#ifdef EVENTS_STATS
+// counts a handler that runs `late` ticks after its time.
+static void events_stats_late(event_handler_fun_t h, uint32_t late)
+{
+  uint8_t b = 0;
+  late >>= EVENTS_STATS_SHIFT;
+  while (late != 0 && b < EVENTS_STATS_BUCKETS-1) {
+    late >>= 1;
+    b++;
+  }
+  events_stats_handler_t *s = events_stats.handlers;
+  // the last entry is for all the others.
+  for (uint8_t i = 0; i < EVENTS_STATS_HANDLERS-1; i++, s++) {
+    if (s->handler == h)
+      break;
+    if (s->handler == NULL) {
+      s->handler = h;
+      break;
+    }
+  }
+  if (s->lateness[b] != 0xffff)
+    s->lateness[b]++;
+}
+
+static inline void events_stats_count(uint8_t count)
+{
+#ifdef EVENTS_DEFERRED
+  count += event_ready_count;
+#endif
+  if (count > events_stats.max_count)
+    events_stats.max_count = count;
 }
 
+#define events_stats_inc(counter) \
+  do { if (events_stats.counter != 0xffff) events_stats.counter++; } while (0)
+
+void events_stats_clear(void)
+{
+  ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+    memset(&events_stats,0,sizeof(events_stats));
+  }
+}
+#endif
+
 static inline void events_checknclear_ovf(void) {
   bool tovf;
   tovf = (Timer_Interrupt_Flags(1) & TIMER_INTERRUPT_OVERFLOW) != 0;
   if (tovf) {
     Timer_Interrupt_Flag_Clear(1,TIMER_INTERRUPT_OVERFLOW);
-    event_time_high++;
+    uint16_t h = event_time_high+1;
+    event_time_high = h;
+    if (h == 0)
+      event_time_top++;
   }
 }
 
@@ -91,7 +468,8 @@ static inline void events_checknclear_ovf(void) {
     [Due to a design flaw we cannot catch an overflow interrupt before an
     output-compare interrupt anyway.]
 
-  This function takes min 26 cycles and max 37 cycles. (incl. call & ret)
+  This function takes min 26 cycles and max 40 cycles. (incl. call & ret)
+  (46 cycles once in 2^32 ticks.)
 
 */
 static /*inline*/ uint32_t get_time_sync(void) {
@@ -99,6 +477,7 @@ static /*inline*/ uint32_t get_time_sync(void) {
   bool tov_before, tov_after;
   // 5 cycles (call).
   // 4 cycles (2*lds):
+  EVENTS_SIM_COST(9);
   h = event_time_high;
   // 1 cycle (in):
   tov_before = (Timer_Interrupt_Flags(1) & TIMER_INTERRUPT_OVERFLOW) != 0;
@@ -113,6 +492,9 @@ static /*inline*/ uint32_t get_time_sync(void) {
     // is rare.
     // 4 cycles (2*sts):
     event_time_high = h;
+    // every 2^32 ticks: 3 cycles (or+brne) plus 6 for the increment.
+    if (h == 0)
+      event_time_top++;
     // 2 cycles (ldi+out):
     Timer_Interrupt_Flag_Clear(1,TIMER_INTERRUPT_OVERFLOW);
     // 3/2 cycles ((1/2/3)+(2/0): sbrc+rjmp):
@@ -121,6 +503,11 @@ static /*inline*/ uint32_t get_time_sync(void) {
       l = 0;
     }
   }
+#ifndef __AVR__
+  // host builds (test/) have neither r22 nor movw.
+  EVENTS_SIM_COST(9);
+  return ((uint32_t)h) << 16 | l;
+#else
   register uint32_t res __asm__("r22"); // reduces shuffling around of bytes.
   // 2 cycles (movw):
   __asm__ (
@@ -140,6 +527,7 @@ static /*inline*/ uint32_t get_time_sync(void) {
   );
   // 5 cycles (ret):
   return res;
+#endif
 // This would do heavy calculating:
 //  return ((uint32_t)h) << 16 | l;
 
@@ -188,14 +576,43 @@ uint32_t get_time(void) {
   return res;
 }
 
+// the 48 bit time, which doesn't wrap for 200 days at 16 MHz.
+uint64_t get_time64(void) {
+  uint64_t res;
+  ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+    uint32_t low = get_time_sync();
+    res = ((uint64_t)event_time_top) << 32 | low;
+  }
+  return res;
+}
+
+// the time in units of 2^16 ticks (4.1 ms at 16 MHz), wrapping after 2^32
+// of them. Does not touch the timer, so it is much cheaper than get_time(),
+// but an overflow shows up only once an interrupt handled it.
+static inline uint32_t get_time_coarse(void) {
+  uint32_t res;
+  ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+    res = ((uint32_t)event_time_top) << 16 | event_time_high;
+  }
+  return res;
+}
+
+// just the fast-changing bits of the time, e.g. as entropy for the prng.
+// Doesn't care about overflows and doesn't need to be atomic.
+static inline uint8_t get_time_entropy(void) {
+  return Timer_Value(1) & 0xff;
+}
+
 /*
 ISR (TIMER1_OVF_vect, ISR_BLOCK)
 {
   uint16_t time_high = event_time_high;
   time_high++;
   event_time_high = time_high;
-  if (event_first_ix != EVENT_INDEX_EMPTY) {
-    uint32_t time = event_queue[event_first_ix].time;
+  if (time_high == 0)
+    event_time_top++;
+  if (event_count != 0) {
+    uint32_t time = event_slots[event_heap[0]].time;
     if (time_high == time >> 16) {
       OCR1A = time & 0xffff;
       Timer_Interrupt_Enable(1,TIMER_INTERRUPT_OUTPUT_COMPARE_A);
@@ -204,42 +621,105 @@ ISR (TIMER1_OVF_vect, ISR_BLOCK)
 }
 */
 
-ISR (TIMER1_COMPA_vect, ISR_BLOCK)
+// finds the earliest due event with EVENT_FLAG_HIGH, which runs before the
+// other due events. Returns its heap index or 0 if there is none.
+static uint8_t events_find_due_high(uint32_t now, uint8_t count)
+{
+  uint8_t res = 0;
+  uint32_t res_time = now;
+  for (uint8_t i = 1; i < count; i++) {
+    uint8_t slot = event_heap[i];
+    uint32_t time = events_slot_time(slot);
+    if ((event_slots[slot].flags & EVENT_FLAG_HIGH) && gteq_mod32(now,time) &&
+        (res == 0 || events_before(time,res_time))) {
+      res = i;
+      res_time = time;
+    }
+  }
+  return res;
+}
+
+// runs (or with EVENTS_DEFERRED readies) all due events.
+static inline void events_run_due(void)
 {
   do {
-    uint8_t first_ix = event_first_ix;
-    if (first_ix == EVENT_INDEX_EMPTY) {
+    uint8_t count = event_count;
+    if (count == 0) {
       events_checknclear_ovf();
       return;
     }
-    event_t *ev = &event_queue[first_ix];
-    uint32_t next_t = ev->time;
+    uint8_t i = 0;
+    uint8_t slot = event_heap[0];
+    event_slot_t *ev = &event_slots[slot];
+    // the loads, and the icall of a due handler.
+    EVENTS_SIM_COST(30);
     uint32_t now = get_time_sync();
+#ifdef EVENTS_COMPACT
+    events_epoch_update(now);
+#endif
+    uint32_t next_t = events_slot_time(slot);
     if (gteq_mod32(now,next_t)) {
-      uint8_t free_ix = event_free_ix;
-      first_ix++;
-      event_t *ev_next = ev+1;
-      if (first_ix == EVENT_QUEUE_SIZE) {
-        first_ix = 0;
-        ev_next = &event_queue[0];
+      // only search when there is a high priority event at all.
+      if (event_high_count != 0 && !(ev->flags & EVENT_FLAG_HIGH)) {
+        i = events_find_due_high(now,count);
+        slot = event_heap[i];
+        ev = &event_slots[slot];
+        next_t = events_slot_time(slot);
+      }
+      event_handler_fun_t h = events_slot_handler(slot);
+      void *p = ev->param;
+      uint32_t period = events_slot_period(slot);
+#ifdef EVENTS_DEFERRED
+      bool deferred = !(ev->flags & EVENT_FLAG_ISR);
+      if (period != 0 && !deferred) {
+#else
+      if (period != 0) {
+#endif
+        // stays queued, usually right at the root.
+        events_slot_set(slot,events_slot_due(slot)+period,period);
+        events_heap_update(i);
+      } else {
+#ifdef EVENTS_DEFERRED
+        // a deferred periodic event goes back into the heap when its
+        // handler is run.
+        events_heap_unlink(i);
+        if (deferred)
+          events_ready_add(slot);
+        else
+          events_slot_free(slot);
+#else
+        // frees the slot before the call, so h() can reuse it.
+        events_heap_remove(i);
+#endif
+        count--;
       }
-      if (first_ix != free_ix) {
-        uint16_t t_lo = ev_next->time /*event_queue[first_ix].time*/ & 0xffff;
+#ifdef EVENTS_STATS
+#ifdef EVENTS_DEFERRED
+      if (!deferred)
+#endif
+        events_stats_late(h,now-next_t);
+#endif
+      if (count != 0) {
+        uint32_t t = events_slot_time(event_heap[0]);
+        uint16_t t_lo = t & 0xffff;
         OCR1A = t_lo;
         // 4 cycles (2*lds):
-        uint16_t now = Timer_Value(1);
+        uint16_t now_lo = Timer_Value(1);
         // 2 cycles for useless movw.
+        // a first event half a timer period or more ahead must not be
+        // taken for one in the past by the 16 bit compare below.
+        // 6 cycles (sub+3*sbc+sbrc+rjmp):
+        int32_t ahead = t-now;
         // 5/4 cycles (1+1+(1/2)+(2/0) sub+sbc+sbrc+rjmp)
-        if (gteq_mod16(now,t_lo)) {
+        if (ahead <= 0 || (ahead < 0x8000 && gteq_mod16(now_lo,t_lo))) {
           // 6 cycles (1+1+4 subi+sbci+2*sts)
-          OCR1A = now+18;
+          OCR1A = now_lo+18;
         }
-      } else {
-        first_ix = EVENT_INDEX_EMPTY;
       }
-      event_first_ix = first_ix;
-      event_handler_fun_t h = ev->handler;
-      void *p = ev->param;
+#ifdef EVENTS_DEFERRED
+      if (deferred)
+        continue; // left to events_dispatch().
+#endif
       h(p);
       cli();
       // h() may sei() and even modify events.
@@ -251,6 +731,19 @@ ISR (TIMER1_COMPA_vect, ISR_BLOCK)
   } while (1);
 }
 
+ISR (TIMER1_COMPA_vect, ISR_BLOCK)
+{
+#ifdef EVENTS_STATS
+  uint16_t start = Timer_Value(1);
+  events_run_due();
+  uint16_t ticks = Timer_Value(1)-start;
+  if (ticks > events_stats.isr_max)
+    events_stats.isr_max = ticks;
+#else
+  events_run_due();
+#endif
+}
+
 
 /**
  * @brief Sets the hardware timer to fire at the given time or as soon as possible if the time has already passed.
@@ -292,6 +785,9 @@ static inline void events_set_hw_timer(uint32_t time)
   // 4 cycles for sub+3*sbc,
   // 3/2 cycles ((1/2/3)+(2/0) sbrc+rjmp):
   if (gteq_mod32(now,time)) { // The event is in the past. Reschedule.
+#ifdef EVENTS_STATS
+    events_stats_inc(past);
+#endif
     // 3 cycles (lds+andi):
     uint8_t scale = (TCCR1B >> CS10) & 7;
     uint8_t dist;
@@ -316,6 +812,37 @@ static inline void events_set_hw_timer(uint32_t time)
   }
 }
 
+// to be called with interrupts disabled after changing the heap, with the
+// first slot and its time from before the change. Updates the hardware
+// timer if the first event changed.
+static inline void events_first_changed(uint8_t first, uint32_t time)
+{
+  if (event_count != 0) {
+    uint8_t new_first = event_heap[0];
+    uint32_t new_time = events_slot_time(new_first);
+    if (new_first != first || new_time != time)
+      events_set_hw_timer(new_time);
+  }
+  // we don't need to update OCR1A for an empty queue. The old value will do.
+}
+
+// to be called with interrupts disabled after changing the time of a
+// slot with a valid handle, with the first slot and its time from before
+// the change. Moves the slot to its place, or back into the heap if it
+// was ready.
+static void events_slot_retimed(uint8_t slot, uint8_t first, uint32_t time)
+{
+#ifdef EVENTS_DEFERRED
+  if (events_slot_is_ready(slot)) {
+    if (events_heap_insert(events_ready_remove(slot)) == 0)
+      events_set_hw_timer(events_slot_time(slot));
+    return;
+  }
+#endif
+  events_heap_update(event_slots[slot].heap_ix);
+  events_first_changed(first,time);
+}
+
 /**
  * @brief Enqueues an event using the provided event structure.
  * 
@@ -325,11 +852,11 @@ static inline void events_set_hw_timer(uint32_t time)
  * 
  * @param ev  A pointer to the event structure containing the event details (time, handler, and parameters).
  * 
- * @return true if the event was successfully enqueued, false if the event queue is full.
+ * @return A handle of the event, or EVENT_HANDLE_NONE if the event queue is full.
  *
  * @note This function simplifies event enqueueing by allowing direct use of the `event_t` structure.
  */
-bool enqueue_event(const event_t* ev)
+event_handle_t enqueue_event(const event_t* ev)
 {
   return enqueue_event_abs(ev->time,ev->handler,ev->param);
 }
@@ -337,63 +864,91 @@ bool enqueue_event(const event_t* ev)
 /**
  * @brief Enqueues an event at a specified absolute time in the event queue.
  * 
- * This function adds an event to the event queue at a specified absolute time. It ensures that events are added in 
- * chronological order by adjusting the queue when necessary, handling time wraparound, and updating the first 
- * available index and the event handler.
+ * This function puts the event into the first free slot and adds the slot at the end of the event heap, from
+ * where it moves up past every parent due later, which takes at most log2(EVENT_QUEUE_SIZE) moves. If it
+ * becomes the first event, the hardware timer is updated.
  * 
- * The function uses atomic blocks to ensure thread-safety while modifying shared variables, and handles edge cases 
- * like queue wraparound and overflow.
+ * The function uses atomic blocks to ensure thread-safety while modifying shared variables.
  *
  * @param time   The absolute time at which the event should occur (32-bit).
  * @param h      The event handler function to be called at the specified time.
  * @param param  A pointer to the parameters that should be passed to the event handler.
  * 
- * @return true if the event was successfully enqueued, false if the event queue is full.
+ * @return A handle for `event_cancel` and `event_reschedule`, or EVENT_HANDLE_NONE if the event queue is full.
+ *         The handle is also a valid truth value for whether the event was enqueued.
  *
- * @note This function assumes that the event queue is managed in a circular buffer and that events are sorted 
- *       by time.
+ * @note Events due at the same time are not guaranteed to run in the order they were enqueued.
  */
-bool enqueue_event_abs(uint32_t time, event_handler_fun_t h, void* param)
+event_handle_t enqueue_event_abs(uint32_t time, event_handler_fun_t h, void* param)
 {
-  uint8_t ix;
+  return enqueue_event_abs_flags(time,h,param,0);
+}
+
+/**
+ * @brief Enqueues an event at a specified absolute time, with flags.
+ * 
+ * Like `enqueue_event_abs`, but the flags can mark the event as hard realtime (`EVENT_FLAG_ISR`), to have its
+ * handler run right in the timer interrupt even with EVENTS_DEFERRED, and as high priority (`EVENT_FLAG_HIGH`),
+ * to have it run before other due events and use the EVENT_QUEUE_RESERVED slots.
+ *
+ * @param time   The absolute time at which the event should occur (32-bit).
+ * @param h      The event handler function to be called at the specified time.
+ * @param param  A pointer to the parameters that should be passed to the event handler.
+ * @param flags  A combination of EVENT_FLAG_* values.
+ * 
+ * @return A handle of the event, or EVENT_HANDLE_NONE if the event queue is full.
+ */
+event_handle_t enqueue_event_abs_flags(uint32_t time, event_handler_fun_t h, void* param, uint8_t flags)
+{
+  event_handle_t res;
+#ifdef EVENTS_COMPACT
+  // the table is in flash, no need to search it with interrupts disabled.
+  uint8_t handler = events_handler_index(h);
+  if (handler == EVENTS_HANDLER_NONE)
+    return EVENT_HANDLE_NONE;
+#else
+  event_handler_fun_t handler = h;
+#endif
   ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
     // need to copy the volatiles for the optimizer:
-    uint8_t first_ix = event_first_ix;
-    uint8_t free_ix = event_free_ix;
-    if (free_ix == first_ix)
-      return false;
-    if (first_ix == EVENT_INDEX_EMPTY) {
-      first_ix = 0;
-      free_ix = 1;
-      ix = 0;
-      event_first_ix = first_ix;
-    } else {
-      uint8_t k = predmod(free_ix,EVENT_QUEUE_SIZE);
-      uint8_t low = predmod(first_ix,EVENT_QUEUE_SIZE);
-      
-      // we have to care about time wraparound here, so we subtract the
-      // current time (coarsely) before comparing.
-      int32_t time_base = (int32_t)event_time_high<<16; //get_time, more coarse, but faster.
-      int32_t dtime = (int32_t)time-time_base;
-      while (dtime < (int32_t)event_queue[k].time-time_base && k != low) {
-        events_decmod(k,EVENT_QUEUE_SIZE);
-      }
-      events_incmod(k,EVENT_QUEUE_SIZE);
-      for (uint8_t i = free_ix; i != k; i = (i!=0)?i-1:EVENT_QUEUE_SIZE-1) {
-        event_queue[i] = event_queue[predmod(i,EVENT_QUEUE_SIZE)];
-      }
-      ix = k;
-      events_incmod(free_ix,EVENT_QUEUE_SIZE);
+    uint8_t count = event_count;
+    uint8_t reserved = (flags & EVENT_FLAG_HIGH) ? 0 : EVENT_QUEUE_RESERVED;
+    if (count+reserved >= events_free_end()) {
+#ifdef EVENTS_STATS
+      events_stats_inc(dropped);
+#endif
+      return EVENT_HANDLE_NONE;
     }
-    if (ix == first_ix) {
-      events_set_hw_timer(time);
+    uint8_t slot = event_heap[count];
+    event_slot_t *ev = &event_slots[slot];
+    ev->flags = flags;
+#ifdef EVENTS_COMPACT
+    events_epoch_update(get_time_sync());
+    // a far event needs a long record.
+    if (!events_slot_set(slot,time,0)) {
+      ev->flags = 0;
+#ifdef EVENTS_STATS
+      events_stats_inc(dropped);
+#endif
+      return EVENT_HANDLE_NONE;
     }
-    event_free_ix = free_ix;
-    event_queue[ix].time = time;
-    event_queue[ix].handler = h;
-    event_queue[ix].param = param;
+#else
+    events_slot_set(slot,time,0);
+#endif
+    if (flags & EVENT_FLAG_HIGH)
+      event_high_count++;
+#ifdef EVENTS_STATS
+    events_stats_count(count+1);
+#endif
+    EVENTS_SIM_COST(30);
+    ev->handler = handler;
+    ev->param = param;
+    if (events_heap_insert(count) == 0) {
+      events_set_hw_timer(events_slot_time(slot));
+    }
+    res = event_handle(slot,ev->generation);
   }
-  return true;
+  return res;
 }
 
 /**
@@ -406,91 +961,440 @@ bool enqueue_event_abs(uint32_t time, event_handler_fun_t h, void* param)
  * @param h      The event handler function to be called at the specified time.
  * @param param  A pointer to the parameters that should be passed to the event handler.
  * 
- * @return true if the event was successfully enqueued, false if the event queue is full.
+ * @return A handle of the event, or EVENT_HANDLE_NONE if the event queue is full.
  *
  * @note This function is useful for scheduling events to occur after a certain delay from the current time.
  */
-bool enqueue_event_rel(uint32_t time, event_handler_fun_t h, void* param)
+event_handle_t enqueue_event_rel(uint32_t time, event_handler_fun_t h, void* param)
+{
+  return enqueue_event_abs_flags(get_time()+time,h,param,0);
+}
+
+// like enqueue_event_rel(), with flags as for enqueue_event_abs_flags().
+event_handle_t enqueue_event_rel_flags(uint32_t time, event_handler_fun_t h, void* param, uint8_t flags)
+{
+  return enqueue_event_abs_flags(get_time()+time,h,param,flags);
+}
+
+/**
+ * @brief Enqueues an event that fires every `period` ticks, starting one period from now.
+ * 
+ * Each firing costs no more than moving the event down the heap to its next time, which is the previous
+ * time plus `period`, so the event doesn't drift even if its handler runs late. The handle stays valid
+ * until the event is stopped with `stop_periodic` or `event_cancel`. `event_reschedule` moves the next
+ * firing, and the period goes on from there.
+ * 
+ * @param period The time between two firings, in ticks. Must not be 0 and less than EVENTS_MAX_DELAY.
+ * @param h      The event handler function to be called every period.
+ * @param param  A pointer to the parameters that should be passed to the event handler.
+ * 
+ * @return A handle of the event, or EVENT_HANDLE_NONE if the event queue is full.
+ */
+event_handle_t enqueue_periodic(uint32_t period, event_handler_fun_t h, void* param)
 {
-  return enqueue_event_abs(get_time()+time,h,param);
+  return enqueue_periodic_flags(period,h,param,0);
+}
+
+// like enqueue_periodic(), with flags as for enqueue_event_abs_flags().
+event_handle_t enqueue_periodic_flags(uint32_t period, event_handler_fun_t h, void* param, uint8_t flags)
+{
+  event_handle_t res;
+  ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+    res = enqueue_event_abs_flags(get_time_sync()+period,h,param,flags);
+    uint8_t slot = event_handle_slot(res);
+    if (res != EVENT_HANDLE_NONE &&
+        !events_slot_set(slot,events_slot_due(slot),period)) {
+      // no long record left for it.
+      event_cancel(res);
+      res = EVENT_HANDLE_NONE;
+    }
+  }
+  return res;
+}
+
+// stops the (periodic) event behind *handle and clears the handle. Returns
+// false if it wasn't running.
+bool stop_periodic(event_handle_t* handle)
+{
+  bool res;
+  ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+    res = event_cancel(*handle);
+    *handle = EVENT_HANDLE_NONE;
+  }
+  return res;
+}
+
+/**
+ * @brief Schedules an event at a relative time, replacing the event behind a handle.
+ * 
+ * This is the handle-based form of the `dequeue_events(h); enqueue_event_rel(time,h,param);` idiom for
+ * events of which only one should be pending at any time. If `*handle` still names a pending event, that
+ * event is moved to the new time and gets the new handler and parameter, in O(log n). Otherwise a new event
+ * is enqueued and `*handle` is set to it.
+ * 
+ * @param handle The handle to reuse and update. Should start out as EVENT_HANDLE_NONE.
+ * @param time   The relative time offset (in cycles) from the current time when the event should occur.
+ * @param h      The event handler function to be called at the specified time.
+ * @param param  A pointer to the parameters that should be passed to the event handler.
+ * 
+ * @return true if the event is scheduled, false if it was not pending and the event queue is full.
+ */
+bool requeue_event_rel(event_handle_t* handle, uint32_t time, event_handler_fun_t h, void* param)
+{
+  return requeue_event_rel_flags(handle,time,h,param,0);
+}
+
+// like requeue_event_rel(), with flags as for enqueue_event_abs_flags().
+bool requeue_event_rel_flags(event_handle_t* handle, uint32_t time, event_handler_fun_t h, void* param, uint8_t flags)
+{
+#ifdef EVENTS_COMPACT
+  uint8_t handler = events_handler_index(h);
+  if (handler == EVENTS_HANDLER_NONE)
+    return false;
+#else
+  event_handler_fun_t handler = h;
+#endif
+  time += get_time();
+  ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+    uint8_t slot = events_handle_slot(*handle);
+    if (slot != EVENT_HEAP_IX_NONE) {
+#ifdef EVENTS_COMPACT
+      events_epoch_update(get_time_sync());
+#endif
+      uint8_t first = event_heap[0];
+      uint32_t first_time = events_slot_time(first);
+      if (!events_slot_set(slot,time,0))
+        return false;
+      event_slot_t *ev = &event_slots[slot];
+      ev->handler = handler;
+      ev->param = param;
+      if (ev->flags & EVENT_FLAG_HIGH)
+        event_high_count--;
+      if (flags & EVENT_FLAG_HIGH)
+        event_high_count++;
+      // keeps the long record.
+      ev->flags = (ev->flags & ~(EVENT_FLAG_ISR | EVENT_FLAG_HIGH)) | flags;
+      events_slot_retimed(slot,first,first_time);
+      return true;
+    }
+    *handle = enqueue_event_abs_flags(time,h,param,flags);
+  }
+  return *handle != EVENT_HANDLE_NONE;
 }
 
 /**
  * @brief Removes all events with the specified handler from the event queue.
  * 
- * This function iterates through the event queue and removes all events that have the specified handler `h`. 
- * The queue is adjusted accordingly, and the first event time is updated if necessary.
+ * This function iterates through the event heap and removes all events that have the specified handler `h`. 
+ * The remaining events are moved together and the heap is rebuilt bottom-up, both in O(n). Prefer keeping
+ * a handle and using `event_cancel`, which takes O(log n).
  * 
  * @param h  The event handler function whose associated events should be removed.
  * 
  * @return true if one or more events were removed; false if no matching events were found.
  *
- * @note This function modifies the event queue in place and handles the update of the event indices. It also 
- *       ensures that the hardware timer is updated if the first event is removed.
+ * @note The hardware timer is only updated if the first event is removed.
  */
 bool dequeue_events(event_handler_fun_t h)
 {
+  bool res = false;
+#ifdef EVENTS_COMPACT
+  uint8_t handler = events_handler_index(h);
+  if (handler == EVENTS_HANDLER_NONE)
+    return false;
+#else
+  event_handler_fun_t handler = h;
+#endif
   ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
     // need to copy the volatiles for the optimizer:
-    uint8_t first_ix = event_first_ix;
-    uint8_t free_ix = event_free_ix;
-    if (first_ix == EVENT_INDEX_EMPTY) {
-      return false;
-    } else {
-      bool deleted_first = false;
-      uint8_t deleted = 0;
-      for (uint8_t k = first_ix; k != free_ix;
-                   k = k!=EVENT_QUEUE_SIZE-1?k+1:0) {
-        if (event_queue[k].handler == h) {
-          if (k == first_ix) {
-            first_ix = succmod(k,EVENT_QUEUE_SIZE);
-            deleted_first = true;
-          } else {
-            deleted++;
-          }
-        } else if (deleted != 0) {
-          event_queue[(k+EVENT_QUEUE_SIZE-deleted)%EVENT_QUEUE_SIZE] = event_queue[k];
-        }
+    uint8_t count = event_count;
+    uint8_t first = event_heap[0];
+    uint32_t first_time = events_slot_time(first);
+    uint8_t kept = 0;
+    for (uint8_t k = 0; k < count; k++) {
+      uint8_t slot = event_heap[k];
+      if (event_slots[slot].handler != handler) {
+        // swap, so that the removed slots end up behind the kept ones.
+        event_heap[k] = event_heap[kept];
+        events_heap_set(kept,slot);
+        kept++;
+      } else {
+        events_slot_free(slot);
       }
-      if (deleted != 0) {
-        free_ix = (free_ix+EVENT_QUEUE_SIZE-deleted)%EVENT_QUEUE_SIZE;
-        event_free_ix = free_ix;
+    }
+    if (kept != count) {
+      res = true;
+      event_count = kept;
+      for (uint8_t i = kept/2; i-- != 0;) {
+        events_sift_down(i,event_heap[i],kept);
       }
-      if (deleted_first) {
-        if (first_ix == free_ix) {
-          first_ix = EVENT_INDEX_EMPTY;
-          // we don't need to update OCR1A. The old value will do.
-        } else {
-          uint32_t time = event_queue[first_ix].time;
-          events_set_hw_timer(time);
-        }
-        event_first_ix = first_ix;
+      events_first_changed(first,first_time);
+    }
+#ifdef EVENTS_DEFERRED
+    // removing a ready slot moves an already checked one to its place.
+    for (uint8_t pos = events_free_end(); pos < EVENT_QUEUE_SIZE; pos++) {
+      uint8_t slot = event_heap[pos];
+      if (event_slots[slot].handler == handler) {
+        events_ready_remove(slot);
+        events_slot_free(slot);
+        res = true;
+      }
+    }
+#endif
+  }
+  return res;
+}
+
+/**
+ * @brief Removes the event behind a handle from the event queue.
+ * 
+ * Takes O(log n), as the event is found by its handle and the heap is fixed from there.
+ * 
+ * @param handle  A handle returned by one of the enqueue functions.
+ * 
+ * @return true if the event was removed; false if it already fired or was cancelled.
+ */
+bool event_cancel(event_handle_t handle)
+{
+  ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+    uint8_t slot = events_handle_slot(handle);
+    if (slot == EVENT_HEAP_IX_NONE)
+      return false;
+#ifdef EVENTS_DEFERRED
+    if (events_slot_is_ready(slot)) {
+      events_ready_remove(slot);
+      events_slot_free(slot);
+      return true;
+    }
+#endif
+    uint8_t first = event_heap[0];
+    uint32_t first_time = events_slot_time(first);
+    events_heap_remove(event_slots[slot].heap_ix);
+    events_first_changed(first,first_time);
+  }
+  return true;
+}
+
+/**
+ * @brief Moves the event behind a handle to a new absolute time.
+ * 
+ * Takes O(log n). The handle stays valid.
+ * 
+ * @param handle  A handle returned by one of the enqueue functions.
+ * @param time    The new absolute time at which the event should occur.
+ * 
+ * @return true if the event was moved; false if it already fired or was cancelled, or with EVENTS_COMPACT, if
+ *         it needs a long record and there is none left.
+ */
+bool event_reschedule(event_handle_t handle, uint32_t time)
+{
+  ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+    uint8_t slot = events_handle_slot(handle);
+    if (slot == EVENT_HEAP_IX_NONE)
+      return false;
+#ifdef EVENTS_COMPACT
+    events_epoch_update(get_time_sync());
+#endif
+    uint8_t first = event_heap[0];
+    uint32_t first_time = events_slot_time(first);
+    if (!events_slot_set(slot,time,events_slot_period(slot)))
+      return false;
+    events_slot_retimed(slot,first,first_time);
+  }
+  return true;
+}
+
+// checks whether the event behind a handle is still waiting to fire (or,
+// with EVENTS_DEFERRED, for its handler to be run).
+bool event_pending(event_handle_t handle)
+{
+  bool res;
+  ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+    res = events_handle_slot(handle) != EVENT_HEAP_IX_NONE;
+  }
+  return res;
+}
+
+// takes the next hop towards the deadline of an event_timeout_t.
+static void event_timeout_hop(void* param)
+{
+  event_timeout_t *t = (event_timeout_t*)param;
+  uint64_t now = get_time64();
+  if (now >= t->deadline) {
+    t->handle = EVENT_HANDLE_NONE;
+    t->handler(t->param);
+    return;
+  }
+  uint64_t left = t->deadline-now;
+  t->handle = enqueue_event_rel(left > EVENT_TIMEOUT_HOP ? EVENT_TIMEOUT_HOP : left,
+                                &event_timeout_hop,t);
+}
+
+/**
+ * @brief Starts a timeout that may be longer than EVENTS_MAX_DELAY.
+ * 
+ * Calls `h(param)` after `ticks` ticks, on the 48 bit clock. Until then, the timeout takes up one slot of the
+ * event queue, and `*t` must stay valid. Restarting a running timeout replaces it.
+ *
+ * @param t      The timeout. Needs no initialization.
+ * @param ticks  The delay in ticks.
+ * @param h      The event handler function to be called at the deadline.
+ * @param param  A pointer to the parameters that should be passed to the event handler.
+ * 
+ * @return true if the timeout is running, false if the event queue is full.
+ */
+bool event_timeout_start(event_timeout_t* t, uint64_t ticks, event_handler_fun_t h, void* param)
+{
+  ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+    if (event_handle_slot(t->handle) < EVENT_QUEUE_SIZE &&
+        event_slots[event_handle_slot(t->handle)].param == t)
+      event_cancel(t->handle);
+    t->deadline = get_time64()+ticks;
+    t->handler = h;
+    t->param = param;
+    t->handle = EVENT_HANDLE_NONE;
+    event_timeout_hop(t);
+  }
+  return t->handle != EVENT_HANDLE_NONE;
+}
+
+// stops a running timeout. Returns false if it wasn't running.
+bool event_timeout_cancel(event_timeout_t* t)
+{
+  bool res;
+  ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+    res = event_cancel(t->handle);
+    t->handle = EVENT_HANDLE_NONE;
+  }
+  return res;
+}
+
+/**
+ * @brief Removes all events from the event queue.
+ * 
+ * Handles of the removed events become invalid. Also sets up the free slots, so this must have been called
+ * (usually by `events_start`) before the first event is enqueued.
+ */
+void events_clear(void)
+{
+  ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+    event_count = 0;
+#ifdef EVENTS_DEFERRED
+    event_ready_count = 0;
+#endif
+    for (uint8_t i = 0; i < EVENT_QUEUE_SIZE; i++) {
+      event_heap[i] = i;
+      events_slot_free(i);
+    }
+    event_high_count = 0;
+#ifdef EVENTS_COMPACT
+    for (uint8_t k = 0; k < EVENTS_LONG_SIZE; k++)
+      event_long[k].slot = EVENT_HEAP_IX_NONE;
+#endif
+  }
+}
+
+#ifdef EVENTS_DEFERRED
+/**
+ * @brief Runs the handlers of all ready events.
+ * 
+ * To be called from the main loop. The handlers run with interrupts enabled, in order of their event times.
+ * Events that become ready while this function runs are handled as well, so check `events_ready` with
+ * interrupts disabled afterwards before going to sleep.
+ * 
+ * @return true if any handler was run.
+ */
+bool events_dispatch(void)
+{
+  bool res = false;
+  while (1) {
+    event_handler_fun_t h;
+    void *p;
+    ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+      uint8_t pos = events_free_end();
+      if (pos == EVENT_QUEUE_SIZE)
+        return res;
+      // there are only a few ready events at a time. Find the earliest,
+      // high priority ones first.
+      uint8_t slot = event_heap[pos];
+      for (pos++; pos < EVENT_QUEUE_SIZE; pos++) {
+        uint8_t other = event_heap[pos];
+        uint8_t high = event_slots[slot].flags & EVENT_FLAG_HIGH;
+        uint8_t other_high = event_slots[other].flags & EVENT_FLAG_HIGH;
+        if (other_high > high || (other_high == high &&
+            events_key_before(event_slots[other].time,event_slots[slot].time)))
+          slot = other;
+      }
+      h = events_slot_handler(slot);
+      p = event_slots[slot].param;
+#ifdef EVENTS_STATS
+      events_stats_late(h,get_time_sync()-events_slot_time(slot));
+#endif
+      pos = events_ready_remove(slot);
+      uint32_t period = events_slot_period(slot);
+      if (period != 0) {
+#ifdef EVENTS_COMPACT
+        events_epoch_update(get_time_sync());
+#endif
+        // back into the heap, one period after the time it was due.
+        events_slot_set(slot,events_slot_due(slot)+period,period);
+        if (events_heap_insert(pos) == 0)
+          events_set_hw_timer(events_slot_time(slot));
+      } else {
+        events_slot_free(slot);
       }
-      bool res = deleted_first || (deleted != 0);
-      return res;
     }
+    h(p);
+    res = true;
   }
-  return false; // never reached, but compiler disagrees.
+}
+#endif
+
+/**
+ * @brief Moves the clock forward after Timer 1 was stopped for a while.
+ * 
+ * Timer 1 does not count while the MCU sleeps in a mode deeper than idle. After waking up from such a sleep,
+ * call this with the duration of the sleep to get the clock right again. Events that became due in the
+ * meantime fire as soon as the interrupts are enabled.
+ * 
+ * This function should only be called with interrupts **disabled**.
+ *
+ * @param ticks  The time Timer 1 missed, in ticks.
+ */
+void events_advance_time(uint32_t ticks)
+{
+  uint8_t tccr1b = TCCR1B;
+  Timer_SetScale(1,TIMER_SCALE_STOPPED);
+  // also takes care of a pending overflow, which can't happen again while
+  // the timer is stopped.
+  uint32_t before = get_time_sync();
+  uint32_t now = before+ticks;
+  if (now < before)
+    event_time_top++;
+  Timer_SetValue(1,now & 0xffff);
+  event_time_high = now >> 16;
+  TCCR1B = tccr1b;
+  // we most likely skipped over OCR1A.
+  uint32_t time;
+  if (events_next_time(&time))
+    events_set_hw_timer(time);
 }
 
 /**
  * @brief Initializes and starts the event system with a specified timer scale.
  * 
- * This function initializes Timer 1, sets the output compare register `OCR1A` based on the first event's time 
- * (if available), and configures the timer interrupts. It also sets the timer's scaling factor as specified by 
- * the `scale` parameter.
+ * This function initializes Timer 1, empties the event queue (see `events_clear`) and configures the timer
+ * interrupts. It also sets the timer's scaling factor as specified by the `scale` parameter.
  * 
  * @param scale  The timer scaling factor to control the timer's frequency.
  *
- * @note This function assumes that the event system is already initialized and that the first event's time 
- *       is available in the event queue. It configures the timer for event-based scheduling.
+ * @note Events must only be enqueued after this function was called.
  */
 void events_start(uint8_t scale)
 {
   Timer_Init(1);
-  if (event_first_ix != EVENT_INDEX_EMPTY)
-    OCR1A = event_queue[event_first_ix].time & 0xffff;
-   else OCR1A = 0;
+  events_clear();
+  OCR1A = 0;
   Timer_Interrupts(1) = TIMER_INTERRUPT_OUTPUT_COMPARE_A;
   Timer_SetScale(1,scale);
 }
@@ -16,17 +16,60 @@
 #ifndef _EVENTS_H_
 #define _EVENTS_H_
 
-// must be at most 254
+// must be at most 127
 #ifndef EVENT_QUEUE_SIZE
 # define EVENT_QUEUE_SIZE 16
 #endif
 
+// slots that only events with EVENT_FLAG_HIGH may use, see below.
+#ifndef EVENT_QUEUE_RESERVED
+# define EVENT_QUEUE_RESERVED 0
+#endif
+
+/*
+  Statistics: with EVENTS_STATS defined, events_stats counts how late the
+  handlers run, per handler, in log2 buckets of (now - time) >>
+  EVENTS_STATS_SHIFT ticks: bucket 0 counts handlers that ran within
+  1<<EVENTS_STATS_SHIFT ticks, bucket b those that ran up to
+  1<<(b+EVENTS_STATS_SHIFT) ticks late, and the last bucket all later ones.
+  The first EVENTS_STATS_HANDLERS-1 handlers get their own histogram, the
+  last one counts all others. Counters stop at 0xffff.
+*/
+#ifdef EVENTS_STATS
+#ifndef EVENTS_STATS_HANDLERS
+# define EVENTS_STATS_HANDLERS 8
+#endif
+#ifndef EVENTS_STATS_BUCKETS
+# define EVENTS_STATS_BUCKETS 12
+#endif
+#ifndef EVENTS_STATS_SHIFT
+# define EVENTS_STATS_SHIFT 4
+#endif
+#endif
+
 //#ifndef EVENT_TIMER_SCALE
 //# define EVENT_TIMER_SCALE TIMER_SCALE_1
 //#endif
 
 typedef void (*event_handler_fun_t)(void*);
 
+/*
+  Event times are 32 bit and compared modulo 2^32, so an event must be due
+  less than EVENTS_MAX_DELAY ticks after it is enqueued (about 134 s with
+  prescaler 1 at 16 MHz), no matter when the clock wraps. Longer timeouts
+  need an event_timeout_t, which hops through the queue in steps of
+  EVENT_TIMEOUT_HOP ticks until its deadline on the 48 bit clock.
+*/
+#define EVENTS_MAX_DELAY 0x7fffffffUL
+#define EVENT_TIMEOUT_HOP 0x40000000UL
+
+typedef struct event_timeout_t {
+  uint64_t deadline;
+  event_handler_fun_t handler;
+  void *param;
+  uint16_t handle; // event_handle_t of the next hop.
+} event_timeout_t;
+
 typedef struct event_t {
   uint32_t time;
   event_handler_fun_t handler;
@@ -34,37 +77,222 @@ typedef struct event_t {
 } event_t;
 
 /*
-  the event queue is a ring buffer from index first_ix to exclusive free_ix.
-  since first_ix == free_ix would both mark a full and an empty queue, the
-  empty queue is specially marked with first_ix == EVENT_INDEX_EMPTY.
+  Every queued event lives in one of the slots, which never move. A handle
+  names a slot together with the slot's generation, which is counted up
+  whenever the slot is freed (when the event fires or gets cancelled), so a
+  handle of a past event never matches a later event in the same slot.
+  EVENT_HANDLE_NONE is never a valid handle.
 */
+typedef uint16_t event_handle_t;
+#define EVENT_HANDLE_NONE 0
+#define event_handle(slot,generation) ((event_handle_t)(generation) << 8 | (slot))
+#define event_handle_slot(h) ((uint8_t)((h) & 0xff))
+#define event_handle_generation(h) ((uint8_t)((h) >> 8))
+
+// heap_ix of a slot that is not queued.
+#define EVENT_HEAP_IX_NONE 0xff
+
+/*
+  Deferred dispatch: with EVENTS_DEFERRED defined, TIMER1_COMPA_vect only
+  runs the handlers of events enqueued with EVENT_FLAG_ISR, for hard
+  realtime work like bit-banging or stopping the motor. Any other due event
+  is only marked ready, and its handler is run by events_dispatch() from
+  the main loop with interrupts enabled, so that long handlers don't hold
+  up the USART and pin-change interrupts. A ready event is still pending
+  until its handler runs: it can be cancelled or rescheduled.
+  Without EVENTS_DEFERRED, the flags are ignored and all handlers run in
+  the ISR.
+*/
+#define EVENT_FLAG_ISR 1
+
+/*
+  Priorities: events with EVENT_FLAG_HIGH, like the motor timeouts, always
+  find a slot and never wait for other events that are due at the same
+  time. Other events can't take the last EVENT_QUEUE_RESERVED free slots,
+  so a queue flooded by music or the display drops those rather than a
+  high priority event. When several events are due, the high priority
+  ones run first, both in the ISR and in events_dispatch(), and the rest
+  in time order after them.
+*/
+#define EVENT_FLAG_HIGH 2
+
+/*
+  Periodic events (enqueue_periodic) keep their slot and handle while they
+  run: after firing, the next time is the previous one plus the period, not
+  the dispatch time plus the period, so a late handler doesn't delay the
+  ones after it. If the event is still the next one due, it stays at the
+  root of the heap. It runs until it is stopped with stop_periodic() or
+  event_cancel(), also from its own handler.
+*/
+#ifndef EVENTS_COMPACT
+typedef struct event_slot_t {
+  uint32_t time;
+  uint32_t period; // 0 for a one-shot event.
+  event_handler_fun_t handler;
+  void *param;
+  uint8_t heap_ix, generation, flags;
+} event_slot_t;
+typedef uint32_t event_key_t;
+#else
+/*
+  Compact slots: with EVENTS_COMPACT defined, a slot takes 8 bytes instead
+  of 15 (plus its byte in event_heap), so the same RAM holds about 1.8
+  times as many events. Its time is a 16 bit key, the ticks after
+  event_epoch, and its handler an index into events_handlers[] in flash,
+  which the application defines with every handler it ever enqueues:
 
-#define EVENT_INDEX_EMPTY 0xff
-//const uint8_t EVENT_INDEX_EMPTY = 0xff;
+    const event_handler_fun_t events_handlers[] PROGMEM = {
+      EVENTS_BUILTIN_HANDLERS &beep_event, &door_lock_event, NULL
+    };
 
-event_t event_queue[EVENT_QUEUE_SIZE];
-volatile uint8_t event_first_ix = EVENT_INDEX_EMPTY,
-                 event_free_ix = 0;
+  Enqueueing a handler that is not in the table fails.
+  Events more than 0xffff ticks after event_epoch (the far bucket) and
+  periodic events also take one of the EVENTS_LONG_SIZE long records,
+  which hold their full time and period. A far event sits in the heap with
+  key 0xffff, so that the timer interrupt comes back in time to move
+  event_epoch forward (events_rebase()) and give it its real key. When the
+  long records run out, enqueueing or rescheduling such an event fails.
+  An event more than EVENTS_COMPACT_BEHIND ticks in the past gets key 0,
+  so it may run after another late event that was due after it.
+  Enqueueing costs a get_time and a search of the handler table, taking
+  and firing an event an addition for the epoch.
+*/
+#include <avr/pgmspace.h>
+#ifndef EVENTS_LONG_SIZE
+# define EVENTS_LONG_SIZE 4
+#endif
+#ifndef EVENTS_COMPACT_BEHIND
+# define EVENTS_COMPACT_BEHIND 0x1000
+#endif
+// the long record of a slot is flags >> EVENT_FLAGS_LONG_SHIFT, minus 1.
+#define EVENT_FLAGS_LONG_SHIFT 4
+
+typedef struct event_slot_t {
+  uint16_t time;   // key: ticks after event_epoch, 0xffff for far events.
+  uint8_t handler; // index into events_handlers[].
+  void *param;
+  uint8_t heap_ix, generation, flags;
+} event_slot_t;
+typedef uint16_t event_key_t;
+
+typedef struct event_long_t {
+  uint8_t slot;    // EVENT_HEAP_IX_NONE for an unused record.
+  uint32_t time;
+  uint32_t period; // 0 for a one-shot event.
+} event_long_t;
+
+extern const event_handler_fun_t events_handlers[] PROGMEM;
+#endif
+
+/*
+  event_heap is a binary min-heap of the event_count queued slots:
+  event_heap[0] is the slot of the next event due and no event is due
+  before its parent event_heap[(i-1)/2]. Inserting an event or taking out
+  any of them moves O(log n) slot numbers instead of shifting the whole
+  queue, which keeps the interrupts-off time short even for long queues.
+  event_heap[event_count..EVENT_QUEUE_SIZE-1] are the free slots, followed
+  by the event_ready_count ready slots with EVENTS_DEFERRED.
+*/
+
+event_slot_t event_slots[EVENT_QUEUE_SIZE];
+uint8_t event_heap[EVENT_QUEUE_SIZE];
+volatile uint8_t event_count = 0;
+#ifdef EVENTS_COMPACT
+event_long_t event_long[EVENTS_LONG_SIZE];
+uint32_t event_epoch = 0;
+#endif
+// number of slots in use by events with EVENT_FLAG_HIGH.
+volatile uint8_t event_high_count = 0;
+#ifdef EVENTS_DEFERRED
+volatile uint8_t event_ready_count = 0;
+#endif
+
+#ifdef EVENTS_STATS
+typedef struct events_stats_handler_t {
+  event_handler_fun_t handler; // NULL for an unused entry.
+  uint16_t lateness[EVENTS_STATS_BUCKETS];
+} events_stats_handler_t;
+
+typedef struct events_stats_t {
+  uint8_t max_count;  // most events queued (and ready) at once.
+  uint16_t dropped;   // enqueues that failed for a full queue.
+  uint16_t past;      // events that were already due when the timer was set.
+  uint16_t isr_max;   // longest run of TIMER1_COMPA_vect, in ticks.
+  events_stats_handler_t handlers[EVENTS_STATS_HANDLERS];
+} events_stats_t;
+
+events_stats_t events_stats;
+#endif
+// the clock is TCNT1 extended by event_time_high and event_time_top.
 volatile uint16_t event_time_high = 0;
+volatile uint16_t event_time_top = 0;
 
 uint32_t get_time(void);
-bool enqueue_event(const event_t* ev);
-bool enqueue_event_abs(uint32_t time, event_handler_fun_t h, void* param);
-bool enqueue_event_rel(uint32_t time, event_handler_fun_t h, void* param);
+uint64_t get_time64(void);
+static inline uint32_t get_time_coarse(void);
+static inline uint8_t get_time_entropy(void);
+event_handle_t enqueue_event(const event_t* ev);
+event_handle_t enqueue_event_abs(uint32_t time, event_handler_fun_t h, void* param);
+event_handle_t enqueue_event_rel(uint32_t time, event_handler_fun_t h, void* param);
+event_handle_t enqueue_event_abs_flags(uint32_t time, event_handler_fun_t h, void* param, uint8_t flags);
+event_handle_t enqueue_event_rel_flags(uint32_t time, event_handler_fun_t h, void* param, uint8_t flags);
+bool requeue_event_rel(event_handle_t* handle, uint32_t time, event_handler_fun_t h, void* param);
+bool requeue_event_rel_flags(event_handle_t* handle, uint32_t time, event_handler_fun_t h, void* param, uint8_t flags);
+event_handle_t enqueue_periodic(uint32_t period, event_handler_fun_t h, void* param);
+event_handle_t enqueue_periodic_flags(uint32_t period, event_handler_fun_t h, void* param, uint8_t flags);
+bool stop_periodic(event_handle_t* handle);
 bool dequeue_events(event_handler_fun_t h);
+bool event_cancel(event_handle_t handle);
+bool event_reschedule(event_handle_t handle, uint32_t time);
+bool event_pending(event_handle_t handle);
+bool event_timeout_start(event_timeout_t* t, uint64_t ticks, event_handler_fun_t h, void* param);
+bool event_timeout_cancel(event_timeout_t* t);
 
 void events_start(uint8_t scale);
+void events_clear(void);
 static inline void events_stop(void);
-static inline void events_clear(void);
+static inline bool events_next_time(uint32_t* time);
+static inline uint32_t events_slot_time(uint8_t slot);
+void events_advance_time(uint32_t ticks);
+#ifdef EVENTS_STATS
+void events_stats_clear(void);
+#endif
+#ifdef EVENTS_DEFERRED
+bool events_dispatch(void);
+static inline bool events_ready(void);
+
+// whether events_dispatch() has work to do. Check with interrupts disabled
+// before going to sleep.
+static inline bool events_ready(void)
+{
+  return event_ready_count != 0;
+}
+#endif
 
 static inline void events_stop(void)
 {
   Timer_SetScale(1,TIMER_SCALE_STOPPED);
 }
 
-static inline void events_clear(void)
+// the time a slot has in the heap, which for a far event with
+// EVENTS_COMPACT is earlier than its real one.
+static inline uint32_t events_slot_time(uint8_t slot)
+{
+#ifdef EVENTS_COMPACT
+  return event_epoch+event_slots[slot].time;
+#else
+  return event_slots[slot].time;
+#endif
+}
+
+// gets the time of the next queued event. Returns false for an empty queue.
+// To be called with interrupts disabled.
+static inline bool events_next_time(uint32_t* time)
 {
-  event_first_ix = EVENT_INDEX_EMPTY; // don't even need atomic here.
+  if (event_count == 0)
+    return false;
+  *time = events_slot_time(event_heap[0]);
+  return true;
 }
 
 #endif
@@ -0,0 +1,55 @@
+/*
+
+  LED blinking
+  toggles the LED a number of times from a periodic event. Include after
+  events.c.h and the LEDs_* macros.
+
+*/
+
+/*
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License version 2 or 3 as
+ * published by the Free Software Foundation.
+ */
+
+#ifndef __LED_BLINK_H__
+#define __LED_BLINK_H__
+
+#include <stdint.h>
+#include <events.h>
+
+#ifndef LED_BLINK_PERIOD
+#define LED_BLINK_PERIOD msec2ticks(250,TIMER_DIV)
+#endif
+// the most blinks led_blink_count can hold, about 4.5 hours.
+#define LED_BLINK_MAX 0x7fff
+
+// The LED is sadly placed on SCK, so we don't use it right now.
+event_handle_t led_blink_handle = EVENT_HANDLE_NONE;
+// toggles left after the next one.
+uint16_t led_blink_count;
+
+void led_blink_event(void* param) {
+  LEDs_ToggleLEDs(LEDS_LED1);
+
+  if (led_blink_count > 0) {
+    led_blink_count--;
+  } else {
+    stop_periodic(&led_blink_handle);
+  }
+}
+
+// blinks the LED count times, up to LED_BLINK_MAX, starting from off.
+// With count 0, it just stays off.
+void led_blink(uint32_t count) {
+  LEDs_TurnOffLEDs(LEDS_LED1);
+  stop_periodic(&led_blink_handle);
+  if (count == 0)
+    return;
+  if (count > LED_BLINK_MAX)
+    count = LED_BLINK_MAX;
+  led_blink_count = count*2-1;
+  led_blink_handle = enqueue_periodic(LED_BLINK_PERIOD,&led_blink_event,NULL);
+}
+
+#endif
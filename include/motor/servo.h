@@ -63,19 +63,16 @@ void door_set_motor(uint8_t dir) {
   }
 }
 
+event_handle_t servo_handle = EVENT_HANDLE_NONE;
+
+void servo_pulse_end(void* param) {
+  PORTC &= ~(1<<SERVO_PIN);
+}
+
+// starts a pulse every servo_pwm_period.
 void servo_ontimer(void* param) {
-  uint16_t val = (uint16_t)param;
-  int32_t interv = 0;
-  if (val == 0) {
-    PORTC |= 1<<SERVO_PIN;
-    interv = servo_pulse;
-    val = 1;
-  } else {
-    PORTC &= ~(1<<SERVO_PIN);
-    interv = servo_pwm_period - servo_pulse;
-    val = 0;
-  }
-  enqueue_event_rel(interv,&servo_ontimer,(void*)val);
+  PORTC |= 1<<SERVO_PIN;
+  enqueue_event_rel_flags(servo_pulse,&servo_pulse_end,NULL,EVENT_FLAG_ISR);
 }
 
 void servo_set_pos(uint8_t servo_pos)
@@ -92,10 +89,12 @@ void servo_start() {
   PORTC &= ~(1<<SERVO_PIN);
   DDRC |= 1<<SERVO_PIN;
   servo_ontimer(NULL);
+  servo_handle = enqueue_periodic_flags(servo_pwm_period,&servo_ontimer,NULL,EVENT_FLAG_ISR);
 }
 
 void servo_stop() {
-  dequeue_events(&servo_ontimer);
+  stop_periodic(&servo_handle);
+  dequeue_events(&servo_pulse_end);
   DDRC &= ~(1<<SERVO_PIN);
   PORTC |= 1<<SERVO_PIN;
 }
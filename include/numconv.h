@@ -0,0 +1,136 @@
+/*
+
+  Integer formatting and parsing without division.
+
+*/
+
+/*
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License version 2 or 3 as
+ * published by the Free Software Foundation.
+ */
+
+/*
+  The AVR has no divider, so every / 10 or % 10 on a 32 bit value is a call
+  to __udivmodsi4 of several hundred cycles. fmt_dec() takes the digits off
+  by multiplying with the reciprocal instead: for x < 2^16, x/10 is
+  (x*0xCCCD) >> 19, a 16x16 bit multiplication. Larger values are brought
+  down by numconv_div10_32(), which only shifts and adds.
+  The parsers are strict: they take exactly len characters of digits, no
+  signs or spaces, and report anything else as an error instead of reading
+  it as 0.
+*/
+
+#ifndef __NUMCONV_H__
+#define __NUMCONV_H__
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+
+static inline uint16_t numconv_div10_16(uint16_t x) {
+  return ((uint32_t)x*0xCCCDu) >> 19;
+}
+
+// x/10, from Hacker's Delight: an estimate that is at most 1 too small.
+static inline uint32_t numconv_div10_32(uint32_t x) {
+  uint32_t q = (x >> 1) + (x >> 2);
+  q += q >> 4;
+  q += q >> 8;
+  q += q >> 16;
+  q >>= 3;
+  uint32_t r = x-((q << 3) + (q << 1));
+  return q + (r > 9);
+}
+
+// writes the lowest count hex digits of value to dest, with a 0 after them.
+void fmt_hex(uint32_t value, char* dest, uint8_t count) {
+  dest[count] = 0;
+  while (count-- > 0) {
+    uint8_t val = value & 0xf;
+    value >>= 4;
+    dest[count] = val < 10 ? '0'+val : 'A'-10+val;
+  }
+}
+
+/*
+  writes value in decimal to the len characters at s, aligned to the right
+  and padded with spaces. Returns false if it doesn't fit, then s is filled
+  with '#'. There's no 0 at the end.
+*/
+bool fmt_dec(char* s, uint8_t len, int32_t value) {
+  bool negative = value < 0;
+  uint32_t val = negative ? -(uint32_t)value : (uint32_t)value;
+  uint8_t i = len;
+  do {
+    if (i == 0)
+      break;
+    uint8_t digit;
+    if (val > 0xffff) {
+      uint32_t q = numconv_div10_32(val);
+      digit = val-q*10;
+      val = q;
+    } else {
+      uint16_t q = numconv_div10_16(val);
+      digit = (uint16_t)val-q*10;
+      val = q;
+    }
+    s[--i] = '0'+digit;
+  } while (val != 0);
+  if (val != 0 || i == len || (negative && i == 0)) {
+    memset(s,'#',len);
+    return false;
+  }
+  if (negative)
+    s[--i] = '-';
+  while (i > 0)
+    s[--i] = ' ';
+  return true;
+}
+
+/*
+  parses the len characters at s as a hex number of either case. Returns
+  false if there are none, if one isn't a hex digit or if the number
+  doesn't fit into 32 bits. *value is only written on success.
+*/
+bool parse_hex(const char* s, uint8_t len, uint32_t* value) {
+  uint32_t res = 0;
+  if (len == 0)
+    return false;
+  for (uint8_t i = 0; i < len; i++) {
+    uint8_t c = s[i];
+    uint8_t v = c-'0';
+    if (v > 9) {
+      // to lower case, which leaves the digits and most else alone.
+      v = (c | 0x20)-'a';
+      if (v > 5)
+        return false;
+      v += 10;
+    }
+    if (res >> 28)
+      return false;
+    res = res << 4 | v;
+  }
+  *value = res;
+  return true;
+}
+
+// like parse_hex(), for a decimal number.
+bool parse_dec(const char* s, uint8_t len, uint32_t* value) {
+  uint32_t res = 0;
+  if (len == 0)
+    return false;
+  for (uint8_t i = 0; i < len; i++) {
+    uint8_t v = (uint8_t)s[i]-'0';
+    if (v > 9)
+      return false;
+    // 4294967295 is the largest.
+    if (res > 429496729 || (res == 429496729 && v > 5))
+      return false;
+    res = (res << 3) + (res << 1) + v;
+  }
+  *value = res;
+  return true;
+}
+
+#endif
@@ -81,6 +81,24 @@ void init() {
 #define PINPAD_PIN 0 // C0, ADC0
 #endif // PINPAD_PIN
 
+// a key plateau should show up in the next reading, so 16 conversions per
+// reading and no filter after them.
+#ifndef PINPAD_ADC_READ_SHIFT
+#define PINPAD_ADC_READ_SHIFT 4
+#endif
+#ifndef PINPAD_ADC_FILTER_SHIFT
+#define PINPAD_ADC_FILTER_SHIFT 0
+#endif
+// how far a reading may stray while a key is down before we look at it
+// again. Quieter readings, e.g. with ADCW_SLEEP, may do with less.
+#ifndef PINPAD_ADC_FUZZ
+#define PINPAD_ADC_FUZZ 5
+#endif
+// readings in a row while a key is down, 1 otherwise.
+#ifndef PINPAD_ADC_WEIGHT_PRESSED
+#define PINPAD_ADC_WEIGHT_PRESSED 4
+#endif
+
 
 /// @brief Pinpad context to trac the currently monitored value
 typedef struct
@@ -90,7 +108,6 @@ typedef struct
 pinpad_ctx_t pinpad_ctx;
 
 void EVENT_pinpad_keypressed(char c);
-bool snprintl(char *s, int len, int32_t value);
 /**
  * @brief pressing a key i means going down to a voltage that is within
  *        pinpad_adc_values[i], then going up again.
@@ -104,7 +121,8 @@ void pinpad_on_adc_read(int16_t value)
   if (minval == 1024)
   {
     // TODO:
-    adc_watch_set_range(PINPAD_PIN, value - 5, value + 5);
+    adc_watch_set_range(PINPAD_PIN, value - PINPAD_ADC_FUZZ, value + PINPAD_ADC_FUZZ);
+    adc_watch_set_weight(PINPAD_PIN, PINPAD_ADC_WEIGHT_PRESSED);
   }
   // Update the tracked value if the value if it is lower
   if (value < minval)
@@ -122,6 +140,7 @@ void pinpad_on_adc_read(int16_t value)
     // Reset traced value and adc watch range
     pinpad_ctx.minval = 1024;
     adc_watch_set_range(PINPAD_PIN, pinpad_max_valid, 1023);
+    adc_watch_set_weight(PINPAD_PIN, 1);
   }
 }
 
@@ -152,6 +171,8 @@ void pinpad_init()
   DDRC &= ~(1 << PINPAD_PIN);
   PORTC &= ~(1 << PINPAD_PIN);
   // PORTC |= (1<<PINPAD_PIN);
+  adc_watch_set_oversampling(PINPAD_PIN,PINPAD_ADC_READ_SHIFT);
+  adc_watch_set_filter(PINPAD_PIN,PINPAD_ADC_FILTER_SHIFT);
   pinpad_unsleep();
 }
 
@@ -159,6 +180,7 @@ void pinpad_stop()
 {
   pinpad_sleep();
   pinpad_ctx.minval = 1024;
+  adc_watch_set_weight(PINPAD_PIN, 1);
   PORTC |= (1 << PINPAD_PIN); // enable internal pull-up, just in case.
 }
 
@@ -86,6 +86,8 @@
 #define segment_display_period msec2ticks(1.0,TIMER_DIV)
 //#define segment_display_period sec2ticks(1.0,TIMER_DIV)
 uint64_t segment_display_symbols = 0;
+uint8_t segment_display_ix = 0; // the symbol to show next.
+event_handle_t segment_display_handle = EVENT_HANDLE_NONE;
 
 const uint8_t segment_digits[] PROGMEM = {
   0b11111101, // 0
@@ -281,7 +283,7 @@ void segment_show_both(uint8_t symbol)
 
 void segment_ontimer(void* param)
 {
-  uint16_t ix = (uint16_t)param;
+  uint8_t ix = segment_display_ix;
   uint64_t symbols = segment_display_symbols;
   if (symbols != 0) {
     uint8_t sym = (symbols >> (8*ix)) & 0xff;
@@ -289,9 +291,9 @@ void segment_ontimer(void* param)
     segment_show(sym,ix);
     ix++;
     if (ix >= 8) ix = 0;
-    param = (void*)(ix);
-    enqueue_event_rel(segment_display_period,&segment_ontimer,param);
+    segment_display_ix = ix;
   } else {
+    stop_periodic(&segment_display_handle);
     segment_setstate(0xff,0); // shutdown anodes.
   }
 }
@@ -300,16 +302,16 @@ void segment_ontimer(void* param)
 // bits 0..7 are the left symbol, bits 8..15 are the right symbol.
 void segment_display(uint64_t symbols)
 {
-  void* param = (void*)0;
-  bool stopped = segment_display_symbols == 0;
   segment_display_symbols = symbols;
-  if (stopped)
-    enqueue_event_rel(1,&segment_ontimer,param);
+  if (!event_pending(segment_display_handle)) {
+    segment_display_ix = 0;
+    segment_display_handle = enqueue_periodic_flags(segment_display_period,&segment_ontimer,NULL,EVENT_FLAG_ISR);
+  }
 }
 
 void segment_undisplay()
 {
-  dequeue_events(&segment_ontimer);
+  stop_periodic(&segment_display_handle);
   segment_display_symbols = 0;
   segment_setstate(0xff,0); // shutdown anodes.
 }
@@ -0,0 +1,151 @@
+/*
+
+  Tickless deep sleep for the event subsystem.
+  Sleeps in power-down mode until shortly before the next event, woken up
+  by the watchdog interrupt, and moves the event clock forward by the time
+  slept. Consumes the watchdog. Include after events.c.h.
+
+*/
+
+/*
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License version 2 or 3 as
+ * published by the Free Software Foundation.
+ */
+
+/*
+  Timer 1 stops in every sleep mode below idle, and Timer 2 can only keep
+  running in power-save mode from a 32 kHz crystal on TOSC1/2, which are
+  the pins our 16 MHz crystal is on. So the watchdog times the sleep. Its
+  period (nominally 16 ms << n) is measured in Timer 1 ticks by
+  tickless_calibrate().
+  Any other interrupt ends the sleep early. We can't tell when that
+  happened, so we assume half the period and the clock may be off by up to
+  half of TICKLESS_MAX_PERIOD afterwards. The ISR that woke us runs before
+  the clock is fixed, so it sees a time that is up to a whole period late.
+  The USART can't wake us, so a pin-change interrupt on RXD does. The
+  character that woke us is lost, and so is everything else that comes in
+  during the oscillator start-up of about 1 ms. Hosts have to send a line
+  feed before each command, and faster baud rates lose more than that.
+*/
+
+#ifndef __TICKLESS_H__
+#define __TICKLESS_H__
+
+#include <avr/sleep.h>
+#include <avr/wdt.h>
+#include <events.h>
+
+// longest single sleep, as a WDTO_* value. Bounds the clock error.
+#ifndef TICKLESS_MAX_PERIOD
+#define TICKLESS_MAX_PERIOD WDTO_250MS
+#endif
+
+// Timer 1 ticks per shortest watchdog period (WDTO_15MS).
+uint32_t tickless_wdt_ticks = 0;
+volatile bool tickless_wdt_fired;
+
+struct {
+  uint32_t sleeps;   // times we went to deep sleep.
+  uint32_t early;    // sleeps ended by another interrupt than the watchdog.
+  uint32_t slept_ms; // total time slept in nominal watchdog milliseconds.
+} tickless_stats;
+
+ISR (WDT_vect, ISR_BLOCK)
+{
+  tickless_wdt_fired = true;
+}
+
+// runs the watchdog in interrupt mode with period 16ms << period.
+static inline void tickless_wdt_start(uint8_t period)
+{
+  wdt_reset();
+  WDTCSR = (1<<WDCE)|(1<<WDE);
+  WDTCSR = (1<<WDIF)|(1<<WDIE)|(period & 7)|((period & 8) << (WDP3-3));
+}
+
+// measures the watchdog period against Timer 1, which must be running.
+// Keeps the interrupts disabled for about 32 ms.
+void tickless_calibrate()
+{
+  ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+    uint32_t start = 0, now = 0;
+    tickless_wdt_start(WDTO_15MS);
+    for (uint8_t i = 0; i < 2; i++) {
+      // polling often enough also keeps get_time_sync() from missing an
+      // overflow.
+      do {
+        now = get_time_sync();
+      } while (!(WDTCSR & (1<<WDIF)));
+      WDTCSR |= 1<<WDIF;
+      if (i == 0)
+        start = now;
+    }
+    wdt_disable();
+    tickless_wdt_ticks = now-start;
+  }
+}
+
+/**
+ * @brief Sleeps in power-down mode until shortly before the next event.
+ *
+ * Picks the longest watchdog period that ends before the next event (and is at most TICKLESS_MAX_PERIOD),
+ * sleeps and moves the event clock forward. Everything that needs the I/O clock stops while sleeping: make
+ * sure that no output is pending and neither the ADC nor any pwm is in use.
+ *
+ * To be called with interrupts disabled. Returns with interrupts disabled.
+ *
+ * @return true if it slept, false if the next event is too close (or the watchdog is not calibrated).
+ */
+bool tickless_sleep()
+{
+  uint32_t period = tickless_wdt_ticks;
+  uint32_t max = period << TICKLESS_MAX_PERIOD;
+  uint32_t next;
+  if (events_next_time(&next)) {
+    uint32_t now = get_time_sync();
+    if (gteq_mod32(now,next))
+      return false;
+    if (next-now < max)
+      max = next-now;
+  }
+  if (period == 0 || period > max)
+    return false;
+  uint8_t n = 0;
+  while (n < TICKLESS_MAX_PERIOD && (period << 1) <= max) {
+    period <<= 1;
+    n++;
+  }
+
+  // wake up on incoming data, too.
+  uint8_t pcicr = PCICR, pcmsk2 = PCMSK2;
+  PCMSK2 |= 1 << PCINT16;
+  PCICR |= 1 << PCIE2;
+  tickless_wdt_fired = false;
+  tickless_wdt_start(n);
+
+  set_sleep_mode(SLEEP_MODE_PWR_DOWN);
+  sleep_enable();
+  sleep_bod_disable();
+  sei();
+  sleep_cpu();
+  sleep_disable();
+  cli();
+  set_sleep_mode(SLEEP_MODE_IDLE);
+
+  wdt_disable();
+  PCMSK2 = pcmsk2;
+  PCICR = pcicr;
+  uint16_t ms = 16 << n;
+  if (!tickless_wdt_fired) {
+    period >>= 1;
+    ms >>= 1;
+    tickless_stats.early++;
+  }
+  events_advance_time(period);
+  tickless_stats.sleeps++;
+  tickless_stats.slept_ms += ms;
+  return true;
+}
+
+#endif
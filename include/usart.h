@@ -1,6 +1,14 @@
 /*
 
   USART driver with configurable output buffer and character-input event.
+  The RX interrupt only puts the received characters into a ring buffer,
+  the main loop hands them to EVENT_USART_Read() with usart_rx_dispatch().
+  Output goes through a queue of spans, which the UDRE interrupt sends
+  from flash or from the RAM buffer outbuf. Whole lines are written as
+  messages, which go out completely or not at all.
+  With USART_FRAMES, messages can also go out as binary frames, see
+  usart_frame_begin(). With USART_BUS, several devices can share one line,
+  see usart_bus_address.
 
   Copyright (c) 2018 Thomas Kremer
 
@@ -17,19 +25,147 @@
 #define __USART_H__
 
 #include <avr/pgmspace.h>
+#include <string.h>
+#ifdef USART_FRAMES
+#include <util/crc16.h>
+#endif
 
 // baudrate may be predefined, defaults to 9600 baud
 #ifndef baudrate
 #define baudrate 9600
 #endif
 
+// RAM for the characters written with usart_writechar() and usart_write(),
+// up to 255. Flash strings don't take any.
 #ifndef outbuf_size
 #define outbuf_size 20
 #endif
+#if outbuf_size > 255
+#error "outbuf_size must be at most 255"
+#endif
+
+// number of spans waiting to be sent, a power of two up to 128.
+#ifndef usart_tx_queue_size
+#define usart_tx_queue_size 8
+#endif
+#if (usart_tx_queue_size & (usart_tx_queue_size-1)) != 0 || usart_tx_queue_size > 128
+#error "usart_tx_queue_size must be a power of two up to 128"
+#endif
 
 char outbuf[outbuf_size];
-int outbuf_len = 0;
-int outbuf_start = 0;
+uint8_t outbuf_len = 0;
+uint8_t outbuf_start = 0;
+bool usart_tx_used = false;
+
+/*
+  The TX queue: a span is len characters, either in flash at s, or, with
+  s == NULL, the next ones in outbuf. usart_write_P() enqueues a string
+  without copying it, the characters written to RAM go into outbuf, and
+  consecutive ones share a span. The UDRE interrupt sends the span at
+  usart_tx_tail and drops it when it is done. Both indices run freely.
+*/
+typedef struct usart_tx_span_t {
+  const char *s;
+  uint8_t len;
+} usart_tx_span_t;
+usart_tx_span_t usart_tx_queue[usart_tx_queue_size];
+uint8_t usart_tx_head = 0;
+uint8_t usart_tx_tail = 0;
+
+// message priorities, see usart_msg_begin().
+#define USART_PRIO_DEBUG 0
+#define USART_PRIO_REPLY 1
+#define USART_PRIO_STATE 2
+#define USART_PRIOS 3
+// dropped messages per priority. Saturate at 0xffff.
+uint16_t usart_tx_dropped[USART_PRIOS];
+bool usart_in_msg = false;
+uint8_t usart_msg_sreg;
+
+#ifdef USART_FRAMES
+/*
+  Frames: with usart_framing set, every message goes out as
+    COBS(type, payload..., CRC-8) 0
+  The CRC is avr-libc's _crc8_ccitt_update() (polynomial 0x07, starting
+  at 0) over type and payload, COBS (consistent overhead byte stuffing)
+  replaces the zeros, so that a 0 only ends a frame. Messages started
+  with usart_msg_begin() become frames of type USART_FRAME_TEXT with the
+  text line as payload.
+  The frame is encoded as it is copied into outbuf: every byte updates the
+  CRC, and a 0 goes in as a placeholder for the next code byte, whose
+  distance is only known at the next 0 or usart_msg_end(). That's why
+  flash strings are copied in a frame.
+*/
+#define USART_FRAME_TEXT 't'
+// code byte, type, CRC and the 0 at the end.
+#define USART_FRAME_OVERHEAD 4
+bool usart_framing = false;
+// the frame being written: the outbuf index of its open code byte, the
+// distance from there and the CRC so far.
+bool usart_frame_open = false;
+uint8_t usart_frame_code_ix, usart_frame_code, usart_frame_crc;
+#define usart_frame_overhead() (usart_framing ? USART_FRAME_OVERHEAD : 0)
+#else
+#define usart_frame_overhead() 0
+#endif
+
+#ifdef USART_BUS
+/*
+  Bus mode: with usart_bus_address set (1..254) before usart_init(),
+  several devices share one line in 9 bit frames, their TX pins joined
+  like open collectors. A frame with the 9th bit set addresses one of them.
+  The others keep the multi-processor filter (MPCM0) on, so that they
+  don't get an RX interrupt for anything but the next address.
+  The addressed device waits for the first data byte, which the host sends
+  once the device before is done. That byte is dropped and the device
+  sends what it has queued. When
+  it's addressed away, it finishes the line or frame it is in and turns its
+  transmitter off. Output waits in the TX queue till the next turn.
+*/
+#define USART_BUS_OFF 0      // not addressed.
+#define USART_BUS_ADDRESSED 1 // waits for a data byte.
+#define USART_BUS_TALKING 2
+#define USART_BUS_CLOSING 3  // addressed away, finishes its line.
+uint8_t usart_bus_address = 0; // 0: point to point.
+uint8_t usart_bus_state = USART_BUS_OFF;
+// the last character sent didn't end a line or a frame.
+bool usart_bus_midline = false;
+#endif
+
+// size of the RX ring, a power of two up to 128. At 115200 baud a
+// character comes every 87 us, so 32 of them last for 2.8 ms of commands.
+#ifndef usart_rx_size
+#define usart_rx_size 32
+#endif
+#if (usart_rx_size & (usart_rx_size-1)) != 0 || usart_rx_size > 128
+#error "usart_rx_size must be a power of two up to 128"
+#endif
+
+/*
+  The RX ring: the ISR writes at usart_rx_head, the main loop reads at
+  usart_rx_tail. Both run freely and are only masked on access, so each
+  side changes just its own byte and neither needs an atomic block.
+  A character received with a frame error or after a hardware overrun, and
+  the last one before the ring ran full, are replaced by 0, which makes
+  process_char() drop the broken line.
+*/
+volatile char usart_rx_buf[usart_rx_size];
+volatile uint8_t usart_rx_head = 0;
+volatile uint8_t usart_rx_tail = 0;
+
+// lost input: hardware overruns (DOR0), frame errors (FE0), characters
+// that didn't fit into the ring and binary frames that failed to decode
+// (see usart_frame_decode()). Saturate at 0xffff.
+typedef struct usart_rx_stats_t {
+  uint16_t overrun, frame_error, ring_full, bad_frame;
+} usart_rx_stats_t;
+usart_rx_stats_t usart_rx_stats;
+
+static inline void usart_rx_count(uint16_t* counter) {
+  uint16_t n = *counter+1;
+  if (n != 0)
+    *counter = n;
+}
 
 //#define ATTR_CONST __attribute__((const))
 //#define ATTR_ALIAS(func) __attribute__((alias(#func)))
@@ -45,10 +181,25 @@ static void usart_init_ubrr(uint8_t ubrr) {
     UCSR0B = 0;
     // In theory we have to wait for any outgoing transmissions to complete...
     UBRR0 = ubrr;
+#ifdef USART_BUS
+    if (usart_bus_address != 0) {
+      // 9 data bits, only addresses come in. The TX pin is left to DDRD and
+      // PORTD till it's our turn.
+      UCSR0A = (1<<U2X0)|(1<<MPCM0);
+      UCSR0C = (0<<USBS0)|(3<<UCSZ00);
+      UCSR0B = (1<<RXCIE0)|(1<<RXEN0)|(1<<UCSZ02);
+      usart_bus_state = USART_BUS_OFF;
+      usart_bus_midline = false;
+      return;
+    }
+#endif
     UCSR0A = 1<<U2X0; // set U2X0 (double speed), clear MPCM0 (address filter)
     UCSR0C = (0<<USBS0)|(3<<UCSZ00); // 8 data bits, 1 stop bit, no parity
     UCSR0B = (1<<RXEN0)|(1<<TXEN0); // enable TX and RX
     UCSR0B = (1<<RXCIE0)|(1<<RXEN0)|(1<<TXEN0); // enable TX and RX and RX-ISR
+    // go on with the output that was left.
+    if (usart_tx_head != usart_tx_tail)
+      UCSR0B |= (1<<UDRIE0);
   }
 
   //UCSR0B |= (1<<RXCIE0);
@@ -92,6 +243,19 @@ void usart_init_baud(uint32_t baud) {
   usart_init_ubrr(ubrr);
 }
 
+// the UBRR0 value for baud, or -1 if the rate we'd get is off by more than
+// 2.5%, which is about the tolerance of both sides together.
+int16_t usart_baud_ubrr(uint32_t baud) {
+  if (baud < F_CPU/8/256 || baud > F_CPU/8)
+    return -1;
+  uint16_t ubrr = ((uint32_t)F_CPU/baud+4)/8-1;
+  uint32_t actual = (uint32_t)F_CPU/8/(ubrr+1);
+  uint32_t diff = actual > baud ? actual-baud : baud-actual;
+  if (diff*40 > baud)
+    return -1;
+  return ubrr;
+}
+
 // after initialization, the transmitter is enabled.
 // to disable it again (to attach other transmitting hardware), use these:
 // You need to manage Pin D1 configuration first, though
@@ -128,43 +292,134 @@ bool usart_can_write() {
   return UCSR0A & (1<<UDRE0);
 }
 
+#ifdef USART_BUS
+// the turn ends with the character being sent. Called from the ISRs.
+static void usart_bus_end_turn() {
+  usart_bus_state = USART_BUS_OFF;
+  UCSR0B &= ~(1<<TXEN0);
+}
+
+// an address came in, for us or someone else.
+static void usart_bus_addressed(bool us) {
+  if (us) {
+    UCSR0A = UCSR0A & (1<<U2X0);
+    if (usart_bus_state != USART_BUS_TALKING)
+      usart_bus_state = USART_BUS_ADDRESSED;
+  } else {
+    UCSR0A = (UCSR0A & (1<<U2X0)) | (1<<MPCM0);
+    if (usart_bus_state == USART_BUS_ADDRESSED || !usart_bus_midline)
+      usart_bus_end_turn();
+    else
+      usart_bus_state = USART_BUS_CLOSING;
+  }
+}
+
+// the first data byte after our address.
+static void usart_bus_talk() {
+  usart_bus_state = USART_BUS_TALKING;
+  UCSR0B |= (1<<TXEN0);
+  if (usart_tx_head != usart_tx_tail)
+    UCSR0B |= (1<<UDRIE0);
+}
+#endif
+
 // doesn't need an atomic block because we only use it in the ISR directly.
 bool usart_pollwrite() {
-  if (outbuf_len != 0 && usart_can_write()) {
-    UDR0 = outbuf[outbuf_start];
-    outbuf_len--;
-    if (outbuf_len == 0) {
-      outbuf_start = 0;
+#ifdef USART_BUS
+  if (usart_bus_address != 0 && usart_bus_state != USART_BUS_TALKING &&
+      !(usart_bus_state == USART_BUS_CLOSING && usart_bus_midline))
+    return 0;
+#endif
+  if (usart_tx_tail != usart_tx_head && usart_can_write()) {
+    usart_tx_span_t *span = &usart_tx_queue[usart_tx_tail & (usart_tx_queue_size-1)];
+    char c;
+    if (span->s != NULL) {
+      c = pgm_read_byte(span->s);
+      span->s++;
     } else {
-      outbuf_start = (outbuf_start+1)%outbuf_size;
+      c = outbuf[outbuf_start];
+      outbuf_len--;
+      // cheaper than % for a size that isn't a power of two.
+      if (++outbuf_start == outbuf_size)
+        outbuf_start = 0;
     }
+    UDR0 = c;
+    // clear TXC0, so that it tells when this character is sent.
+    UCSR0A = (UCSR0A & ((1<<U2X0)|(1<<MPCM0))) | (1<<TXC0);
+    usart_tx_used = true;
+    if (--span->len == 0)
+      usart_tx_tail++;
+#ifdef USART_BUS
+    usart_bus_midline = c != '\n' && c != 0;
+    if (usart_bus_state == USART_BUS_CLOSING && !usart_bus_midline)
+      usart_bus_end_turn();
+#endif
     return 1;
   }
   return 0;
 }
 
-bool usart_writechar(char c) {
-  /*
-  if (outbuf_len > 0 && usart_can_write()) {
-    usart_pollwrite();
-  }
-  */
-  // we need an atomic block because we calculate start+len and each summand
-  // may change in the ISR.
-  ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
-    if (outbuf_len < outbuf_size) {
-      outbuf[(outbuf_start+outbuf_len)%outbuf_size] = c;
-      outbuf_len++;
-    } else {
-      return 0;
+// enqueues a span and starts sending. Returns false if the queue is full.
+// To be called with interrupts disabled.
+static bool usart_tx_push(const char* s, uint8_t len) {
+  if ((uint8_t)(usart_tx_head-usart_tx_tail) == usart_tx_queue_size)
+    return false;
+  usart_tx_span_t *span = &usart_tx_queue[usart_tx_head & (usart_tx_queue_size-1)];
+  span->s = s;
+  span->len = len;
+  usart_tx_head++;
+  UCSR0B |= (1<<UDRIE0);
+  return true;
+}
+
+// copies up to len characters into outbuf and queues them. Returns how
+// many fit. To be called with interrupts disabled.
+static uint8_t usart_tx_copy(const char* s, uint8_t len, bool progmem) {
+  uint8_t space = outbuf_size-outbuf_len;
+  if (len > space)
+    len = space;
+  if (len == 0)
+    return 0;
+  // the last span gets longer if it is one in outbuf, even while it is
+  // being sent.
+  usart_tx_span_t *last = &usart_tx_queue[(usart_tx_head-1) & (usart_tx_queue_size-1)];
+  if (usart_tx_head != usart_tx_tail && last->s == NULL && last->len <= 255-len)
+    last->len += len;
+  else if (!usart_tx_push(NULL,len))
+    return 0;
+  uint8_t i = outbuf_start+outbuf_len;
+  if (i >= outbuf_size)
+    i -= outbuf_size;
+  outbuf_len += len;
+  for (uint8_t k = 0; k < len; k++) {
+    char c = progmem ? pgm_read_byte(s+k) : s[k];
+    outbuf[i] = c;
+#ifdef USART_FRAMES
+    if (usart_frame_open) {
+      usart_frame_crc = _crc8_ccitt_update(usart_frame_crc,c);
+      // a 0 becomes the code byte for the bytes after it.
+      if (c == 0) {
+        outbuf[usart_frame_code_ix] = usart_frame_code;
+        usart_frame_code_ix = i;
+        usart_frame_code = 1;
+      } else {
+        usart_frame_code++;
+      }
     }
+#endif
+    if (++i == outbuf_size)
+      i = 0;
   }
-  if (outbuf_len == 1) {
-    UCSR0B |= (1<<UDRIE0);
-    // debug: usart_writechar('M');
+  return len;
+}
+
+bool usart_writechar(char c) {
+  // we need an atomic block because the ISR changes the lengths.
+  uint8_t res;
+  ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+    res = usart_tx_copy(&c,1,false);
   }
-  //usart_pollwrite();
-  return 1;
+  return res;
 }
 
 /*
@@ -177,50 +432,284 @@ void usart_writechar(char c) {
 }
 */
 
+// writes as much of s as fits into outbuf.
 void usart_write(const char* s, int len) {
-/*  if (len == -1) {
-    len = strlen(s);
-  }*/
-  for (int i = 0; i < len; i++) {
-    usart_writechar(s[i]);
+  if (len <= 0)
+    return;
+  if (len > outbuf_size)
+    len = outbuf_size;
+  ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+    usart_tx_copy(s,len,false);
   }
 }
 
-// s is a pointer to PROGMEM.
+// s is a pointer to PROGMEM. It is sent from there, unless the TX queue
+// is full, then as much as fits is copied into outbuf. In a message, the
+// last free span is left for that.
 void usart_write_P(const char* s, int len) {
-/*  if (len == -1) {
-    len = strlen(s);
-  }*/
-  for (int i = 0; i < len; i++) {
-    char c = pgm_read_byte(s+i);
-    usart_writechar(c);
+  while (len > 0) {
+    uint8_t n = len > 255 ? 255 : len;
+    ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+      uint8_t free_spans = usart_tx_queue_size-(uint8_t)(usart_tx_head-usart_tx_tail);
+#ifdef USART_FRAMES
+      if (usart_in_msg && usart_framing)
+        free_spans = 0;
+#endif
+      if ((usart_in_msg && free_spans < 2) || !usart_tx_push(s,n))
+        n = usart_tx_copy(s,n,true);
+    }
+    if (n == 0)
+      break;
+    s += n;
+    len -= n;
   }
 }
 
 // Note: if you use this macro multiple times for the same string, it will consume its size in progmem multiple times. Better to wrap it in an inline function then.
 #define usart_msg(msg) usart_write_P(PSTR(msg),sizeof(msg)-1)
 
-// gets the free space in the write buffer.
-// TODO: Do we need an atomic block or not? Do we need volatile?
+static inline uint16_t usart_msg_headroom(uint8_t prio, uint16_t size) {
+  return prio == USART_PRIO_DEBUG ? size/2 : prio == USART_PRIO_REPLY ? size/8 : 0;
+}
+
+// checks whether len characters of output would be taken now.
+static bool usart_tx_fits(uint8_t prio, uint16_t len) {
+  bool res;
+  ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+    uint8_t free_spans = usart_tx_queue_size-(uint8_t)(usart_tx_head-usart_tx_tail);
+    res = (uint16_t)(outbuf_size-outbuf_len) >= len+usart_msg_headroom(prio,outbuf_size) &&
+          free_spans >= 1+usart_msg_headroom(prio,usart_tx_queue_size);
+  }
+  return res;
+}
+
+// checks whether a message of len characters would be taken now.
+bool usart_msg_fits(uint8_t prio, uint8_t len) {
+  return usart_tx_fits(prio,len+usart_frame_overhead());
+}
+
+/*
+  Starts a message of len characters, written with the usual functions up
+  to usart_msg_end(). Lower priorities leave room for the higher ones:
+  USART_PRIO_DEBUG takes no more than half of outbuf and of the TX queue,
+  USART_PRIO_REPLY leaves an eighth, USART_PRIO_STATE may fill them.
+  If the message doesn't fit, it is counted in usart_tx_dropped and false
+  is returned; then nothing must be written.
+  In between, the interrupts are disabled, so that no ISR output gets into
+  the line. Keep it short and do the formatting before, where that's easy.
+*/
+static bool usart_msg_open(uint8_t prio, uint16_t len) {
+  uint8_t sreg = SREG;
+  cli();
+  if (!usart_tx_fits(prio,len)) {
+    uint16_t n = usart_tx_dropped[prio]+1;
+    if (n != 0)
+      usart_tx_dropped[prio] = n;
+    SREG = sreg;
+    return false;
+  }
+  usart_msg_sreg = sreg;
+  usart_in_msg = true;
+  return true;
+}
+
+#ifdef USART_FRAMES
+/*
+  Starts a frame with type and len bytes of payload, written with the
+  usual functions up to usart_msg_end(). Returns false if it doesn't fit,
+  like usart_msg_begin(), but writes a frame even without usart_framing.
+*/
+bool usart_frame_begin(uint8_t prio, char type, uint8_t len) {
+  if (len > 250 || !usart_msg_open(prio,len+USART_FRAME_OVERHEAD))
+    return false;
+  uint8_t i = outbuf_start+outbuf_len;
+  usart_frame_code_ix = i >= outbuf_size ? i-outbuf_size : i;
+  usart_frame_code = 1;
+  usart_frame_crc = 0;
+  char code = 0;
+  usart_tx_copy(&code,1,false);
+  usart_frame_open = true;
+  usart_tx_copy(&type,1,false);
+  return true;
+}
+
+// adds the CRC, the last code byte and the end of the frame.
+static void usart_frame_end() {
+  uint8_t crc = usart_frame_crc;
+  usart_tx_copy((const char*)&crc,1,false);
+  usart_frame_open = false;
+  outbuf[usart_frame_code_ix] = usart_frame_code;
+  char end = 0;
+  usart_tx_copy(&end,1,false);
+}
+
+/*
+  Decodes a frame in place, without its 0 at the end, and checks its CRC.
+  Returns the length of type and payload, which start at buf, or 0 for a
+  broken frame, which is counted in usart_rx_stats.bad_frame.
+*/
+uint8_t usart_frame_decode(char* buf, uint8_t len) {
+  uint8_t i = 0, o = 0;
+  uint8_t crc = 0;
+  while (i < len) {
+    uint8_t code = buf[i++];
+    if (code == 0 || code-1 > len-i) {
+      o = 0;
+      break;
+    }
+    for (uint8_t k = 1; k < code; k++) {
+      crc = _crc8_ccitt_update(crc,buf[i]);
+      buf[o++] = buf[i++];
+    }
+    if (i != len && code != 0xff) {
+      crc = _crc8_ccitt_update(crc,0);
+      buf[o++] = 0;
+    }
+  }
+  // the CRC over data and CRC is 0.
+  if (crc == 0 && o >= 2)
+    return o-1;
+  ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+    usart_rx_count(&usart_rx_stats.bad_frame);
+  }
+  return 0;
+}
+#endif
+
+// starts a message of len characters, see above.
+bool usart_msg_begin(uint8_t prio, uint8_t len) {
+#ifdef USART_FRAMES
+  if (usart_framing)
+    return usart_frame_begin(prio,USART_FRAME_TEXT,len);
+#endif
+  return usart_msg_open(prio,len);
+}
+
+void usart_msg_end() {
+#ifdef USART_FRAMES
+  if (usart_frame_open)
+    usart_frame_end();
+#endif
+  usart_in_msg = false;
+  SREG = usart_msg_sreg;
+}
+
+#ifdef USART_FRAMES
+// sends a whole frame.
+void usart_frame(uint8_t prio, char type, const void* payload, uint8_t len) {
+  if (usart_frame_begin(prio,type,len)) {
+    usart_write((const char*)payload,len);
+    usart_msg_end();
+  }
+}
+#endif
+
+// a message of just a flash string.
+void usart_line_P(uint8_t prio, const char* s, uint8_t len) {
+  if (usart_msg_begin(prio,len)) {
+    usart_write_P(s,len);
+    usart_msg_end();
+  }
+}
+#define usart_line(prio,msg) usart_line_P((prio),PSTR(msg),sizeof(msg)-1)
+
+// copies the counters of dropped messages, and resets them if clear is set.
+void usart_tx_dropped_get(uint16_t* res, bool clear) {
+  ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+    memcpy(res,usart_tx_dropped,sizeof(usart_tx_dropped));
+    if (clear)
+      memset(usart_tx_dropped,0,sizeof(usart_tx_dropped));
+  }
+}
+
+// gets the free space in outbuf, or 0 if the TX queue is full.
 int usart_writable_space() {
-  int len;
+  int res;
+  ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+    res = (uint8_t)(usart_tx_head-usart_tx_tail) == usart_tx_queue_size ? 0
+        : outbuf_size-outbuf_len;
+  }
+  return res;
+}
+
+// checks whether all output has been sent, e.g. before the clock stops.
+bool usart_idle() {
+  bool res;
   ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
-    len = (volatile int)outbuf_len;
+    res = usart_tx_head == usart_tx_tail && (!usart_tx_used || (UCSR0A & (1<<TXC0)));
+  }
+  return res;
+}
+
+// checks whether the ring holds characters for usart_rx_dispatch().
+static inline bool usart_rx_pending() {
+  return usart_rx_head != usart_rx_tail;
+}
+
+// hands all received characters to EVENT_USART_Read(). To be called from
+// the main loop.
+void usart_rx_dispatch() {
+  uint8_t tail = usart_rx_tail;
+  while (tail != usart_rx_head) {
+    char c = usart_rx_buf[tail & (usart_rx_size-1)];
+    tail++;
+    // frees the place before the call, which may take long.
+    usart_rx_tail = tail;
+    EVENT_USART_Read(c);
+  }
+}
+
+// copies the counters of lost input, and resets them if clear is set.
+void usart_rx_stats_get(usart_rx_stats_t* res, bool clear) {
+  ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+    *res = usart_rx_stats;
+    if (clear)
+      memset(&usart_rx_stats,0,sizeof(usart_rx_stats));
   }
-  return outbuf_size-len;
 }
 
 ISR(USART_RX_vect, ISR_BLOCK)
 {
+  // the error flags belong to the character in UDR0, so read them first.
+  uint8_t status = UCSR0A;
+#ifdef USART_BUS
+  // so does the 9th bit.
+  bool address = UCSR0B & (1<<RXB80);
+#endif
   char c = UDR0;
-  //sei();
-  EVENT_USART_Read(c);
+  if (status & ((1<<DOR0)|(1<<FE0))) {
+    usart_rx_count((status & (1<<DOR0)) ? &usart_rx_stats.overrun
+                                        : &usart_rx_stats.frame_error);
+    c = 0;
+  }
+#ifdef USART_BUS
+  if (usart_bus_address != 0) {
+    if (address) {
+      usart_bus_addressed((uint8_t)c == usart_bus_address);
+      return;
+    }
+    // the first data byte only gives us the turn.
+    if (usart_bus_state == USART_BUS_ADDRESSED) {
+      usart_bus_talk();
+      return;
+    }
+  }
+#endif
+  uint8_t head = usart_rx_head;
+  if ((uint8_t)(head-usart_rx_tail) < usart_rx_size) {
+    usart_rx_buf[head & (usart_rx_size-1)] = c;
+    usart_rx_head = head+1;
+  } else {
+    usart_rx_count(&usart_rx_stats.ring_full);
+    // not read yet, as the ring is full.
+    usart_rx_buf[(head-1) & (usart_rx_size-1)] = 0;
+  }
 }
 
 ISR(USART_UDRE_vect, ISR_BLOCK)
 {
-  usart_pollwrite();
-  if (outbuf_len == 0) {
+  // on a bus, the output may also have to wait for the next turn.
+  if (!usart_pollwrite() || usart_tx_head == usart_tx_tail) {
     UCSR0B &= ~ (1<<UDRIE0);
   }
 }
@@ -0,0 +1,152 @@
+#!/usr/bin/perl
+
+# tests lockserver.pl --bus against simulated devices on a pty:
+#   ./bus-test.pl
+# The devices use the addressing of USART_BUS in usart.h, with the address
+# bytes escaped as with --bus-escape. Device 2 is always slow to end its
+# line, so the rest of it comes after the next address. Each device
+# answers !0 and !C<token> with its address in the ECHO line. The output
+# is TAP.
+
+use strict;
+use warnings;
+
+use IO::Handle;
+use IO::Select;
+use IO::Socket::UNIX;
+use File::Temp qw(tempdir);
+use Fcntl qw(O_RDWR O_NOCTTY);
+use Time::HiRes;
+
+my @addresses = (1,2,3);
+my $dir = tempdir(CLEANUP => 1);
+
+# a pty without IO::Pty: unlock the slave and get its number.
+use constant { TIOCSPTLCK => 0x40045431, TIOCGPTN => 0x80045430 };
+sysopen(my $ptm,"/dev/ptmx",O_RDWR|O_NOCTTY) or die "cannot open /dev/ptmx: $!";
+my $unlock = pack("i",0);
+ioctl($ptm,TIOCSPTLCK,$unlock) or die "cannot unlock pty: $!";
+my $ptn = pack("i",0);
+ioctl($ptm,TIOCGPTN,$ptn) or die "cannot get pty number: $!";
+my $pts = "/dev/pts/".unpack("i",$ptn);
+
+my $pid = fork() // die "cannot fork: $!";
+if ($pid == 0) {
+  exec($^X,"lockserver.pl","--device",$pts,"--bus",join(",",@addresses),
+       "--bus-escape","--unix-socket","$dir/lock.sock","--unix-group","",
+       "--logfile","$dir/lockserver.log","--passwdfile","testpwd.shadow");
+  die "cannot run lockserver.pl: $!";
+}
+
+##### the devices #####
+
+my %devices = map { ($_ => { state => "off", in => "", out => "" }) } @addresses;
+my ($current,$escaped);
+
+# device 2 keeps the end of its line till it's addressed away.
+sub device_send {
+  my $dev = $devices{$current};
+  my $keep = $current == 2 && $dev->{out} =~ /\n$/ ? 3 : 0;
+  $keep = length $dev->{out} if $keep > length $dev->{out};
+  syswrite($ptm,substr($dev->{out},0,length($dev->{out})-$keep,""));
+}
+
+sub device_line {
+  my ($address,$line) = @_;
+  my $dev = $devices{$address};
+  if ($line =~ /^!0$/) {
+    $dev->{out} .= "VERSION 3\n";
+  } elsif ($line =~ /^!C(.*)$/) {
+    $dev->{out} .= "ECHO=$address:$1\n";
+  }
+}
+
+sub bus_address {
+  my ($address) = @_;
+  if (defined $current && $devices{$current}{state} eq "talking") {
+    # finishes its line.
+    syswrite($ptm,$1) if $devices{$current}{out} =~ s/^([^\n]*\n)//;
+    $devices{$current}{state} = "off";
+  }
+  $current = exists $devices{$address} ? $address : undef;
+  $devices{$current}{state} = "addressed" if defined $current;
+}
+
+sub bus_data {
+  my ($c) = @_;
+  return unless defined $current;
+  my $dev = $devices{$current};
+  if ($dev->{state} eq "addressed") {
+    # the go byte.
+    $dev->{state} = "talking";
+  } else {
+    $dev->{in} .= $c;
+    device_line($current,$1) while $dev->{in} =~ s/^([^\n]*)\n//;
+  }
+  device_send();
+}
+
+sub bus_input {
+  for my $c (split //, shift) {
+    if ($escaped) {
+      $escaped = 0;
+      $c eq "\xff" ? bus_data($c) : bus_address(ord $c);
+    } elsif ($c eq "\xff") {
+      $escaped = 1;
+    } else {
+      bus_data($c);
+    }
+  }
+}
+
+##### the clients #####
+
+my (%clients,%answers);
+my $end = Time::HiRes::time()+5;
+for my $address (@addresses) {
+  my $path = "$dir/lock-$address.sock";
+  Time::HiRes::sleep(0.1) until -S $path || Time::HiRes::time() > $end;
+  my $client = IO::Socket::UNIX->new(Type => SOCK_DGRAM, Local => "$dir/client-$address", Peer => $path)
+    or die "cannot connect to $path: $!";
+  $client->send(".register R");
+  $clients{$address} = $client;
+  $answers{$address} = "";
+}
+
+my $sel = IO::Select->new($ptm,values %clients);
+my $sent = 0;
+$end = Time::HiRes::time()+10;
+while (Time::HiRes::time() < $end) {
+  # the lockservers wait 2 s for their devices.
+  if (!$sent && Time::HiRes::time() > $end-7) {
+    $clients{$_}->send("!Chello$_") for @addresses;
+    $sent = 1;
+  }
+  for my $fh ($sel->can_read(0.1)) {
+    my $buffer = "";
+    if ($fh == $ptm) {
+      sysread($ptm,$buffer,8192) and bus_input($buffer);
+    } else {
+      my ($address) = grep { $clients{$_} == $fh } @addresses;
+      $fh->recv($buffer,8192);
+      $answers{$address} .= $buffer =~ s/^R //r;
+    }
+  }
+  last if $sent && @addresses == grep { $answers{$_} =~ /^ECHO=/m } @addresses;
+}
+
+kill TERM => $pid;
+waitpid($pid,0);
+
+print "1..",2*@addresses+1,"\n";
+my $n = 0;
+for my $address (@addresses) {
+  $n++;
+  print $answers{$address} =~ /^ECHO=$address:hello$address$/m ? "" : "not ",
+        "ok $n - device $address answers on its socket\n";
+  $n++;
+  print $answers{$address} =~ /^ECHO=(?!$address:)/m ? "not " : "",
+        "ok $n - no other device answers on the socket of device $address\n";
+}
+$n++;
+print $? == 0 ? "" : "not ", "ok $n - lockserver exits cleanly\n";
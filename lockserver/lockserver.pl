@@ -14,8 +14,10 @@ use warnings;
 
 use IO::Handle;
 use IO::Select;
+use Time::HiRes;
 use POSIX qw(EAGAIN EWOULDBLOCK strftime);
 use IO::Socket::UNIX;
+use Socket qw(AF_UNIX SOCK_STREAM PF_UNSPEC);
 use Getopt::Long qw(:config bundling);
 #use Device::SerialPort;
 #use DateTime;
@@ -48,6 +50,11 @@ my $logfile = "/var/log/lockserver.log";
 my $passwd_file = "/var/schluessel/pws.shadow";
 
 my $use_stdio = 0;
+my $use_frames = 0;
+my $max_baudrate = 0;
+my $use_tags = 0;
+my $bus_addresses = "";
+my $bus_escape = 0;
 my $log_everything = 0; #1;
 #my $server_group = undef;
 my $server_group = "www-data";
@@ -88,6 +95,11 @@ sub usage {
   passwdfile => \$passwd_file,
   pidfile => "",
   "retry-on-error" => 0,
+  binary => \$use_frames,
+  "max-baudrate" => \$max_baudrate,
+  tags => \$use_tags,
+  bus => \$bus_addresses,
+  "bus-escape" => \$bus_escape,
   help => sub { usage(0) },
 );
 
@@ -103,10 +115,15 @@ sub usage {
   passwdfile => "Path of the /etc/shadow-style password file used",
   pidfile => "Write this pidfile. It is deleted upon server shutdown.",
   "retry-on-error" => "Restart the daemon if any unexpected error happens.",
+  binary => "Talk to the device in binary frames with checksums (protocol version 4).",
+  "max-baudrate" => "Probe for the fastest working baudrate up to this one upon (re-)connecting.",
+  tags => "Tag the commands to the device with sequence numbers, to match the replies, measure their latency and retry the lost ones.",
+  bus => "Talk to several devices with these bus addresses (like 1,2,3) on one serial line. Each gets its own unix socket and logfile, named with the address appended.",
+  "bus-escape" => "Send bus addresses as 0xff and the address instead of with mark parity, for adapters without it and for testing on a pty.",
   help => "Show this help screen.",
 );
 
-@opts = qw(stdio|s! log-everything! debug|D! device|d=s baudrate|b=i unix-socket|sock|u=s unix-group|group|g=s logfile|l=s passwdfile|p=s pidfile|P=s retry-on-error! help|h|?);
+@opts = qw(stdio|s! log-everything! debug|D! device|d=s baudrate|b=i unix-socket|sock|u=s unix-group|group|g=s logfile|l=s passwdfile|p=s pidfile|P=s retry-on-error! binary|B! max-baudrate|m=i tags|t! bus=s bus-escape! help|h|?);
 
 GetOptions(\%opts,@opts) or usage(2);
 if (@ARGV) {
@@ -118,7 +135,7 @@ if (@ARGV) {
 #my $ux_path = shift || "/tmp/ux_tty_server.sock";
 #my $logfile = shift || "/tmp/ux_tty_server.log";
 
-my ($server,$tty,$dev,$stdin,$sel,$running,%input_buffers,$baudrate,$stdout,$dev_bad_input,$dev_last_input,@door_state,$log,$cron);
+my ($server,$tty,$bus_link,@bus_nodes,$dev,$stdin,$sel,$running,%input_buffers,$baudrate,$stdout,$dev_bad_input,$dev_last_input,@door_state,$log,$cron,$dev_framing,$dev_bad_frames,$dev_wait,$next_tag,%dev_inflight,%dev_latency,$dev_uptime);
 
 my %listeners;
 my $listener_lifetime = 3600;
@@ -126,6 +143,27 @@ my $idle_polltime = 60;
 my $dev_idle_timeout = 2*$idle_polltime;
 my $idle_awake_cycles;
 my $resettable_awake_cycles = 2;
+# rates the device makes within 2.5% at 16 MHz, and which stty knows.
+my @probe_baudrates = (2000000,1000000,500000,115200,57600,38400,19200);
+# the device goes back to the old rate after 1 s without the challenge.
+my $baud_echo_timeout = 0.5;
+my $baud_device_timeout = 1;
+# tagged commands without a reply are sent again after $tag_timeout
+# seconds, up to $tag_tries times in all. Not those that change the link.
+my $tag_timeout = 1;
+my $tag_tries = 3;
+my $tag_no_retry = qr/^[bBCz]/;
+
+# the device pushes its door state and uptime this often, which also keeps
+# do_device_ping() from polling. See telemetry_event() in main.c.
+my $telemetry_mask = 0x0003;
+my $telemetry_period = 30;
+# the fields of a snapshot in the order of their mask bits: bit, bytes, name.
+my @telemetry_fields = (
+  [0x01,1,"door"], [0x02,6,"uptime"],
+  [0x04,1,"events"], [0x04,2,"rx_lost"], [0x04,2,"tx_dropped"],
+  map { [0x100 << $_,2,"adc$_"] } 0..7
+);
 
 
 ##### log functions #####
@@ -404,11 +442,122 @@ sub send_listeners {
   }
 }
 
+##### binary frames (protocol version 4) #####
+
+# a frame is COBS(type, payload, CRC-8), ended by a 0. The CRC is the one of
+# avr-libc's _crc8_ccitt_update(): polynomial 0x07, starting at 0.
+
+sub crc8 {
+  my $crc = 0;
+  for my $byte (unpack("C*",shift)) {
+    $crc ^= $byte;
+    for (1..8) {
+      $crc = ($crc & 0x80) ? (($crc << 1) ^ 0x07) & 0xff : ($crc << 1) & 0xff;
+    }
+  }
+  return $crc;
+}
+
+sub cobs_encode {
+  my $data = shift;
+  my $res = "";
+  for my $block (split /\0/,$data,-1) {
+    while (length($block) >= 254) {
+      $res .= "\xff".substr($block,0,254,"");
+    }
+    $res .= chr(length($block)+1).$block;
+  }
+  return $res;
+}
+
+sub cobs_decode {
+  my $data = shift;
+  my $res = "";
+  while (length $data) {
+    my $code = ord(substr($data,0,1,""));
+    return undef if $code == 0 || $code-1 > length $data;
+    $res .= substr($data,0,$code-1,"");
+    $res .= "\0" if length($data) && $code != 0xff;
+  }
+  return $res;
+}
+
+sub encode_frame {
+  my ($type,$payload) = @_;
+  my $data = $type.$payload;
+  return cobs_encode($data.chr(crc8($data)))."\0";
+}
+
+# returns type and payload, or nothing for a broken frame.
+sub decode_frame {
+  my $data = cobs_decode(shift);
+  return () unless defined $data && length($data) >= 2 && crc8($data) == 0;
+  return (substr($data,0,1),substr($data,1,-1));
+}
+
+# the device's frames as the text lines of version 3: [payload length, sub].
+my %frame_lines = (
+  # the payload is the sequence tag, if any.
+  K => [-1, sub { shift."OK." }],
+  D => [1, sub {
+    my $s = unpack("C",shift);
+    sprintf("DOOR=%d%d%d%d",$s & 1,($s >> 1) & 1,($s >> 2) & 3,($s >> 4) & 3)
+  }],
+  A => [1, sub { "AWAKE=".unpack("C",shift) }],
+  S => [2, sub { sprintf("SENSE=%4d",unpack("s<",shift)) }],
+  M => [1, sub { "MFAIL=".unpack("C",shift) }],
+  P => [-1, sub { "PIN=".shift }],
+  T => [6, sub {
+    my ($low,$high) = unpack("Vv",shift);
+    sprintf("TIME=%04X%08X",$high,$low)
+  }],
+  t => [-1, sub { shift =~ s/\n$//r }],
+  # the ADC scope, see scope-dump.pl.
+  o => [8, sub { sprintf("CAPTURE=%d %d %08X %04X",unpack("CCVv",shift)) }],
+  O => [-1, sub {
+    my ($seq,@samples) = unpack("Cv*",shift);
+    join(" ",sprintf("SCOPE=%02X",$seq),map { sprintf("%04X",$_) } @samples)
+  }],
+  Y => [-1, sub {
+    my $payload = shift;
+    my $mask = unpack("v",substr($payload,0,2,""));
+    # the fields are little endian, in the line they have the highest digit first.
+    join(" ",sprintf("TELE=%04X",$mask),map {
+      uc unpack("H*",scalar reverse substr($payload,0,$_->[1],""))
+    } grep { $mask & $_->[0] } @telemetry_fields)
+  }],
+);
+
+sub handle_dev_frame {
+  my $frame = shift;
+  my ($type,$payload) = decode_frame($frame);
+  my $line = defined $type ? $frame_lines{$type} : undef;
+  if (defined $line && ($line->[0] < 0 || $line->[0] == length $payload)) {
+    handle_dev($line->[1]->($payload));
+  } else {
+    # counted apart from garbage, as a broken frame is just line noise.
+    $dev_bad_frames++;
+    log_warning("broken frame from device ($dev_bad_frames so far): ".unpack("H*",$frame));
+  }
+}
+
 ##### device functions #####
 
 sub send_dev {
   my $buffer = shift;
-  print $tty $buffer;
+  if ($use_tags) {
+    $buffer =~ s/^!(?!#)(.+)$/tag_command($1)/gme;
+  }
+  send_listeners("W",$buffer);
+  if ($dev_framing) {
+    # each line as a frame of type 'c'. The leading 0 ends any garbage
+    # before, also the one of a wakeup character lost in deep sleep.
+    print $tty "\0".join("",map { encode_frame("c",$_) } grep { $_ ne "" } split /\n/,$buffer);
+    return;
+  }
+  # the device may be in deep sleep, where it loses the character that
+  # wakes it up. An empty line is ignored.
+  print $tty "\n".$buffer;
 #  if ($buffer =~ /^!b([0-9a-fA-F]*)$/) {
 #    $tty->flush;
 #    $tty->sync;
@@ -417,7 +566,62 @@ sub send_dev {
 #    $dev->baudrate($baudrate);
 #    sleep 1;
 #  }
-  send_listeners("W",$buffer);
+}
+
+##### sequence tags #####
+
+# tags a command (without "!") and remembers it until its reply comes.
+sub tag_command {
+  my $cmd = shift;
+  my $tag = sprintf("%X",$next_tag);
+  $next_tag = ($next_tag+1) & 0xffff;
+  $dev_inflight{$tag} = {
+    cmd => $cmd,
+    sent => Time::HiRes::time(),
+    tries => $cmd =~ $tag_no_retry ? $tag_tries : 1,
+  };
+  $cron->schedule(time+$tag_timeout,"tag_check",\&check_inflight)
+    unless $cron->is_scheduled("tag_check");
+  return "!#$tag $cmd";
+}
+
+# takes the reply for $tag, and keeps track of the round-trip time.
+sub handle_tagged_reply {
+  my ($tag,$line) = @_;
+  my $cmd = delete $dev_inflight{$tag};
+  if (!defined $cmd) {
+    # sent by someone else, or a reply that we've already retried.
+    log_debug("reply with unknown tag $tag: $line");
+    return;
+  }
+  my $ms = 1000*(Time::HiRes::time()-$cmd->{sent});
+  my $stats = $dev_latency{substr($cmd->{cmd},0,1)} //= { count => 0, sum => 0, max => 0 };
+  $stats->{count}++;
+  $stats->{sum} += $ms;
+  $stats->{max} = $ms if $ms > $stats->{max};
+  log_debug(sprintf("reply to !%s after %.1f ms",$cmd->{cmd},$ms));
+  if ($line eq "ERR") {
+    log_warning("device doesn't understand !$cmd->{cmd}");
+  }
+}
+
+# sends the commands again which got no reply in time.
+sub check_inflight {
+  my $now = Time::HiRes::time();
+  for my $tag (sort keys %dev_inflight) {
+    my $cmd = $dev_inflight{$tag};
+    next if $now-$cmd->{sent} < $tag_timeout;
+    if ($cmd->{tries} >= $tag_tries) {
+      log_warning("no reply to !$cmd->{cmd} (#$tag)");
+      delete $dev_inflight{$tag};
+      next;
+    }
+    $cmd->{tries}++;
+    $cmd->{sent} = $now;
+    log_notice("sending !$cmd->{cmd} again (#$tag, try $cmd->{tries})");
+    send_dev("!#$tag $cmd->{cmd}\n");
+  }
+  $cron->schedule(time+$tag_timeout,"tag_check",\&check_inflight) if %dev_inflight;
 }
 
 sub schedule_device_ping {
@@ -429,15 +633,81 @@ sub set_baudrate {
   #$dev->baudrate($baudrate);
   system("stty","-F",$ttyfile,$baudrate) == 0
     or die "cannot stty $ttyfile baudrate to $baudrate";
+  # what came in at the old rate is garbage now.
+  $input_buffers{$tty} = "";
+}
+
+# waits up to $timeout seconds for a line from the device that matches $re,
+# handling everything that comes in as usual. Returns the line or undef.
+sub wait_dev_line {
+  my ($re,$timeout) = @_;
+  my $end = Time::HiRes::time()+$timeout;
+  $dev_wait = { re => $re };
+  my $sel = IO::Select->new($tty);
+  while (!defined $dev_wait->{line}) {
+    my $left = $end-Time::HiRes::time();
+    last if $left <= 0 || !$sel->can_read($left);
+    read_dev() or last;
+  }
+  my $line = $dev_wait->{line};
+  $dev_wait = undef;
+  return $line;
+}
+
+# switches device and tty to $rate. The device answers with BAUD= at the
+# old rate, and keeps the new one once it echoes our challenge. If that
+# doesn't work out, both go back to the old rate by themselves.
+sub negotiate_baudrate {
+  my ($rate) = @_;
+  my $old = $baudrate;
+  if (defined $bus_link) {
+    log_notice("the devices on a bus keep their baudrate");
+    return 0;
+  }
+  send_dev(sprintf "!B%x\n", $rate);
+  my $line = wait_dev_line(qr/^BAUD=/,1);
+  if (!defined $line || hex(substr($line,5)) != $rate) {
+    log_notice("device refuses baudrate $rate");
+    return 0;
+  }
+  set_baudrate($rate);
+  $baudrate = $rate;
+  # a bit of everything, to see the rate works for all of them.
+  my $token = join "", map { sprintf "%02X", int(rand(256)) } 1..8;
+  send_dev("!C$token\n");
+  if (defined wait_dev_line(qr/^ECHO=\Q$token\E$/,$baud_echo_timeout)) {
+    log_notice("set baudrate to $rate");
+    $dev_bad_input = 0;
+    return 1;
+  }
+  log_warning("no echo at baudrate $rate, going back to $old");
+  set_baudrate($old);
+  $baudrate = $old;
+  # until the device is back, too.
+  Time::HiRes::sleep($baud_device_timeout);
+  $input_buffers{$tty} = "";
+  return 0;
+}
+
+# finds the fastest baudrate up to $max_baudrate that works.
+sub probe_baudrate {
+  for my $rate (grep { $_ > $baudrate && $_ <= $max_baudrate } @probe_baudrates) {
+    return if negotiate_baudrate($rate);
+  }
 }
 
 sub setup_device {
   #$tty = do { no warnings "once"; \*GEN0 };
   $baudrate = $initial_baudrate;
-  # baudrate, 8 data bits, 1 stop bit, no parity, raw mode, ignore break chars, disable modem control signals, disable on-POSIX special chars, send hangup at close (=DTR-reset the arduino)
-  system("stty","-F",$ttyfile,$baudrate,qw(cs8 -cstopb -parenb raw -echo ignbrk clocal -iexten hup)) == 0
-    or die "cannot stty $ttyfile to initial settings";
-  open($tty,"+<",$ttyfile) or die "cannot open tty $ttyfile: $!";
+  if (defined $bus_link) {
+    # the bus master in the parent process has the tty.
+    $tty = $bus_link;
+  } else {
+    # baudrate, 8 data bits, 1 stop bit, no parity, raw mode, ignore break chars, disable modem control signals, disable on-POSIX special chars, send hangup at close (=DTR-reset the arduino)
+    system("stty","-F",$ttyfile,$baudrate,qw(cs8 -cstopb -parenb raw -echo ignbrk clocal -iexten hup)) == 0
+      or die "cannot stty $ttyfile to initial settings";
+    open($tty,"+<",$ttyfile) or die "cannot open tty $ttyfile: $!";
+  }
 
 #  system("stty","-F",$ttyfile,"raw") == 0
 #    or die "cannot stty $ttyfile into raw mode";
@@ -451,7 +721,13 @@ sub setup_device {
 #  #$dev->dtr_active(0);
 
   $tty->blocking(0);
+  # the handshakes below wait for answers to what we send.
+  $tty->autoflush(1);
   $dev_bad_input = 0;
+  $dev_bad_frames = 0;
+  $dev_framing = 0;
+  %dev_inflight = ();
+  $next_tag = 0;
   $dev_last_input = time;
   @door_state = (0,0,0,2);
   $idle_awake_cycles = 0;
@@ -459,11 +735,27 @@ sub setup_device {
   #$cron->schedule(time+2,"device_init",sub{send_dev("!T\n!d\n")});
   sleep(2); # wait for the device to accept input. After this function returns, we want the device to be ready for commands, so we sleep synchronously.
   # TODO: why does it more than a second to boot?
+  if ($use_frames) {
+    # a device that still talks frames gets back to text first. A device
+    # in text mode drops the framed "!03" as a broken line. The device
+    # switches to frames after its answer "VERSION 4".
+    print $tty encode_frame("c","!03");
+    send_dev("!04\n");
+    wait_dev_line(qr/^VERSION 4$/,1)
+      or log_warning("device doesn't switch to binary frames");
+  }
+  probe_baudrate() if $max_baudrate > $baudrate && !defined $bus_link;
   send_dev("!T\n!d\n");
+  $dev_uptime = undef;
+  subscribe_telemetry();
+}
+
+sub subscribe_telemetry {
+  send_dev(sprintf("!S%04X%X\n",$telemetry_mask,$telemetry_period*1000));
 }
 
 sub reset_device {
-  close($tty);
+  close($tty) unless defined $bus_link;
   #untie $dev;
   setup_device();
 }
@@ -473,7 +765,9 @@ sub do_device_ping {
     log_warning("resetting device (too much inactivity)");
     reset_device();
   }
-  send_dev("!0\n");
+  # the telemetry stopped, maybe the device was reset. It answers this
+  # right away.
+  subscribe_telemetry();
   schedule_device_ping();
 }
 
@@ -531,7 +825,7 @@ sub setup {
 # commands are forwarded directly to the device
 my $valid_command = qr/^![a-zA-Z0-9].*$/;
 # requests are directly processed from this script.
-my $valid_request = qr/^\.(?<name>register|unregister|baudrate|close|open|openfor|pinentry|state|reset_device)(?<param>(?: \w+)*)$/;
+my $valid_request = qr/^\.(?<name>register|unregister|baudrate|close|open|openfor|pinentry|state|latency|reset_device)(?<param>(?: \w+)*)$/;
 
 my @default_wants = qw(W R);
 
@@ -561,15 +855,7 @@ my %request_handlers = (
   baudrate => sub {
     my ($from,$request) = @_;
     my $param = $request->{param};
-    $baudrate = 0+$param;
-    send_dev(sprintf "!b%x\n", $baudrate);
-    $tty->flush;
-    $tty->sync;
-    sleep 1;
-    set_baudrate($baudrate);
-    log_notice("set baudrate to $baudrate");
-    sleep 1;
-    send_dev("!0\n");
+    negotiate_baudrate(0+$param);
   },
   open => sub {
     my ($from,$request) = @_;
@@ -632,6 +918,19 @@ my %request_handlers = (
     }
     return $res;
   },
+  latency => sub {
+    my ($from,$request) = @_;
+    # per command letter: count, average and maximum round-trip in ms.
+    my $datagram = join(" ","latency",map {
+      my $stats = $dev_latency{$_};
+      sprintf("%s %d %.1f %.1f",$_,$stats->{count},$stats->{sum}/$stats->{count},$stats->{max})
+    } sort keys %dev_latency);
+    my $res = eval { $server->send($datagram,0,$from); };
+    if (!$res) {
+      log_warning("Could not respond to a latency request.");
+    }
+    return $res;
+  },
   reset_device => sub {
     log_notice("resetting device (upon user request)");
     reset_device();
@@ -777,7 +1076,7 @@ sub handle_pinentry {
 }
 
 # leaving out: "!G%d %d" (!G response), P%d (pinpad debug)
-my $valid_devline = qr/^(?:(?<name>!ECHO OFF|OK\.|VERSION 3)|(?<name>PIN|DOOR|AWAKE|SENSE|MFAIL|r[012]|TIME)=(?<param>.*))$/;
+my $valid_devline = qr/^(?:(?<name>!ECHO OFF|OK\.|ERR|VERSION [34])|(?<name>PIN|DOOR|AWAKE|SENSE|MFAIL|r[012]|TIME|EVENTS|LATE|CMD|SLEEP|BAUD|ECHO|TELE|CAPTURE|SCOPE)=(?<param>.*))$/;
 
 my %device_handlers = (
   "!ECHO OFF" => sub {
@@ -785,6 +1084,12 @@ my %device_handlers = (
   },
 #  "OK." => sub {},
 #  "VERSION 3" => sub {},
+  "VERSION 4" => sub {
+    if ($use_frames && !$dev_framing) {
+      log_notice("device talks binary frames now");
+      $dev_framing = 1;
+    }
+  },
   PIN => sub {
     my ($msg) = @_;
     my $pin = $msg->{param};
@@ -843,6 +1148,31 @@ my %device_handlers = (
     my $t = hex($param);
     log_debug("device time is $t");
   },
+  TELE => sub {
+    my ($msg) = @_;
+    my $param = $msg->{param};
+    my ($mask,@values) = split / /, $param;
+    my @fields = grep { hex($mask) & $_->[0] } @telemetry_fields;
+    if (@values != @fields || grep { !/^[0-9A-F]+$/ } $mask, @values) {
+      log_warning("invalid telemetry \"$param\"");
+      return;
+    }
+    my %tele = map { ($fields[$_][2] => hex($values[$_])) } 0..$#fields;
+    if (defined $tele{door}) {
+      my $s = $tele{door};
+      my @state = ($s & 1,($s >> 1) & 1,($s >> 2) & 3);
+      if ("@state" ne "@door_state[0..2]") {
+        log_notice("door state (telemetry): ".
+          ("unlocked","locked")[$state[0]].", ".
+          ("open","closed")[$state[1]]);
+        @door_state[0..2] = @state;
+      }
+    }
+    if (defined $tele{uptime}) {
+      log_warning("device was reset") if defined $dev_uptime && $tele{uptime} < $dev_uptime;
+      $dev_uptime = $tele{uptime};
+    }
+  },
 # r0,r1,r2
 );
 
@@ -855,6 +1185,12 @@ sub handle_dev {
   if ($log_everything) {
     log_notice("device: ",$line);
   }
+  if ($line =~ s/^#([0-9A-F]{1,4}) //) {
+    handle_tagged_reply($1,$line);
+  }
+  if (defined $dev_wait && $line =~ $dev_wait->{re}) {
+    $dev_wait->{line} = $line;
+  }
   if ($line =~ /$valid_devline/) {
     my %msg = %+;
     my $name = $msg{name};
@@ -866,7 +1202,8 @@ sub handle_dev {
   } else {
     $dev_bad_input++;
     log_warning("garbage from device ($dev_bad_input)");
-    if ($dev_bad_input > 10) {
+    # not while we wait for an answer, which may be at another baudrate.
+    if ($dev_bad_input > 10 && !defined $dev_wait) {
       log_warning("resetting device (too much garbage)");
       reset_device();
     }
@@ -874,6 +1211,35 @@ sub handle_dev {
 
 }
 
+# reads what the device sent and handles the complete lines or frames.
+# Returns false on EOF.
+sub read_dev {
+  my $buffer = "";
+  my $buf = \$input_buffers{$tty};
+  # Anything coming from the device is copied to stdout as-is.
+  # DONE: line-buffer everything and provide it to unix-endpoints.
+  # DONE: pull Device::SerialPort out of the loop, since it throws warnings.
+  my $res = sysread($tty,$buffer,8192);
+  if ($res) {
+    $$buf .= $buffer;
+    # the line with "VERSION 4" may switch to frames in between.
+    while ($dev_framing ? $$buf =~ s/^([^\0]*)\0//s : $$buf =~ s/^(.*)\n//) {
+#    while ($$buf =~ s/^(.*)[\r\n]//) {
+      if ($dev_framing) {
+        handle_dev_frame($1) if length $1;
+      } else {
+        handle_dev($1);
+      }
+    }
+  } elsif (defined $res) {
+    log_error("EOF on device");
+    return 0;
+  } else {
+    log_error("device disconnected: $!");
+  }
+  return 1;
+}
+
 ##### idleness handling #####
 
 # nothing to do really, but we might want to act upon idleness by pinging the
@@ -909,22 +1275,7 @@ sub run {
       my $buffer = "";
       my $buf = \$input_buffers{$_};
       if ($_ == $tty) {
-        # Anything coming from the device is copied to stdout as-is.
-        # DONE: line-buffer everything and provide it to unix-endpoints.
-        # DONE: pull Device::SerialPort out of the loop, since it throws warnings.
-        my $res = sysread($tty,$buffer,8192);
-        if ($res) {
-          $$buf .= $buffer;
-          while ($$buf =~ s/^(.*)\n//) {
-#          while ($$buf =~ s/^(.*)[\r\n]//) {
-            handle_dev($1);
-          }
-        } elsif (defined $res) {
-          log_error("EOF on device");
-          $running = 0;
-        } else {
-          log_error("device disconnected: $!");
-        }
+        $running = 0 unless read_dev();
       } elsif ($_ == $stdin) {
         # stdin is assumed line-buffered.
         # Piping stuff in here is not a good idea.
@@ -968,6 +1319,166 @@ sub run {
   return $ret;
 }
 
+##### bus master #####
+
+# With --bus, several devices share the serial line in 9 bit frames, see
+# USART_BUS in usart.h. Each of them gets a child process, a lockserver of
+# its own that talks through a socketpair instead of the tty. The parent
+# takes turns: it addresses a device, lets the one before finish its line,
+# sends the go byte with the commands for the device and forwards the
+# answers until the device falls silent.
+
+my $bus_quiet = 0.03;
+my $bus_slice = 0.05;
+my $bus_slice_max = 1;
+my $bus_idle_polltime = 0.1;
+
+# missing from POSIX.pm, the value of Linux.
+use constant CMSPAR => 0x40000000;
+
+# sends $data in 9 bit frames, with the 9th bit set for an address. That's
+# mark or space parity on the tty. With --bus-escape, an address goes out
+# after a 0xff instead and a 0xff in the data is doubled.
+sub bus_write {
+  my ($data,$address) = @_;
+  if ($bus_escape) {
+    $data = $address ? "\xff".$data : $data =~ s/\xff/\xff\xff/gr;
+  } else {
+    my $termios = POSIX::Termios->new;
+    $termios->getattr(fileno($tty)) or die "cannot get tty attributes: $!";
+    my $cflag = $termios->getcflag | POSIX::PARENB() | CMSPAR;
+    $cflag = $address ? $cflag | POSIX::PARODD() : $cflag & ~POSIX::PARODD();
+    $termios->setcflag($cflag);
+    # after what went out with the old parity.
+    $termios->setattr(fileno($tty),POSIX::TCSADRAIN()) or die "cannot set tty parity: $!";
+  }
+  defined syswrite($tty,$data) or die "cannot write to $ttyfile: $!";
+  # the device's time starts when it has all of it.
+  POSIX::tcdrain(fileno($tty));
+}
+
+# forwards what comes from the tty to $node, until it was silent for $quiet
+# seconds or at most $max seconds are over. Returns true if anything came.
+sub bus_listen {
+  my ($node,$quiet,$max) = @_;
+  my $sel = IO::Select->new($tty);
+  my $now = Time::HiRes::time();
+  my ($end,$silent) = ($now+$max,$now+$quiet);
+  my $got = 0;
+  while ((my $left = ($silent < $end ? $silent : $end)-Time::HiRes::time()) > 0) {
+    last unless $sel->can_read($left);
+    my $buffer = "";
+    my $res = sysread($tty,$buffer,8192);
+    die "device disconnected: ".($res//$!) unless $res;
+    # nobody's talking before the first turn.
+    syswrite($node->{link},$buffer) if defined $node;
+    $got = 1;
+    $silent = Time::HiRes::time()+$quiet;
+  }
+  return $got;
+}
+
+# takes what the children want to send to their devices.
+sub bus_collect {
+  my ($timeout) = @_;
+  my %nodes = map { ($_->{link} => $_) } @bus_nodes;
+  my $sel = IO::Select->new(map { $_->{link} } @bus_nodes);
+  for ($sel->can_read($timeout)) {
+    my $node = $nodes{$_};
+    my $buffer = "";
+    if (!sysread($_,$buffer,8192)) {
+      log_error("lockserver of bus device $node->{address} is gone");
+      $running = 0;
+      return;
+    }
+    $node->{queue} .= $buffer;
+  }
+}
+
+# one turn of $node, after $prev. Returns true if anything happened.
+sub bus_turn {
+  my ($node,$prev) = @_;
+  bus_write(chr($node->{address}),1);
+  my $busy = bus_listen($prev,$bus_quiet,$bus_slice_max);
+  # whole lines and frames only, the rest waits for the next turn.
+  my $commands = $node->{queue} =~ s/^(.*[\n\0])//s ? $1 : "";
+  bus_write("\0".$commands,0);
+  $busy = 1 if bus_listen($node,$bus_slice,$bus_slice_max);
+  return $busy || $commands ne "";
+}
+
+sub bus_master {
+  setup_log();
+  log_notice("bus master started for devices ".join(",",map { $_->{address} } @bus_nodes));
+  if ($opts{pidfile} ne "") {
+    open(my $f,">",$opts{pidfile}) or die "cannot write pidfile: $!";
+    print $f $$,"\n";
+    close($f);
+  }
+  # as in setup_device(), but without parity checks. Only the devices see
+  # the 9th bit.
+  system("stty","-F",$ttyfile,$initial_baudrate,qw(cs8 -cstopb -parenb -inpck raw -echo ignbrk clocal -iexten hup)) == 0
+    or die "cannot stty $ttyfile to initial settings";
+  open($tty,"+<",$ttyfile) or die "cannot open tty $ttyfile: $!";
+  $running = 1;
+  local $SIG{INT} = sub { $running = 0; };
+  local $SIG{TERM} = sub { $running = 0; };
+  my $prev;
+  while ($running) {
+    my $busy = 0;
+    for my $node (@bus_nodes) {
+      bus_collect(0);
+      last unless $running;
+      $busy = 1 if bus_turn($node,$prev);
+      $prev = $node;
+    }
+    # nothing to do, poll a bit slower.
+    bus_collect($bus_idle_polltime) if $running && !$busy;
+  }
+  kill TERM => map { $_->{pid} } @bus_nodes;
+  waitpid($_->{pid},0) for @bus_nodes;
+  close($tty);
+  unlink $opts{pidfile} if $opts{pidfile} ne "";
+  log_notice("bus master exits");
+  return 0;
+}
+
+# forks the lockservers of the bus devices and returns in them. The parent
+# runs the bus and exits.
+sub setup_bus {
+  my @addresses = split /,/, $bus_addresses;
+  for (@addresses) {
+    die "bad bus address \"$_\"" unless /^\d+$/ && $_ >= 1 && $_ <= 254;
+  }
+  for my $address (@addresses) {
+    socketpair(my $parent_end,my $child_end,AF_UNIX,SOCK_STREAM,PF_UNSPEC)
+      or die "cannot create socketpair: $!";
+    my $pid = fork() // die "cannot fork: $!";
+    if ($pid == 0) {
+      close($parent_end);
+      close($_->{link}) for @bus_nodes;
+      @bus_nodes = ();
+      $bus_link = $child_end;
+      for ($ux_path,$logfile) {
+        s/(\.[^.\/]*)?$/-$address$1/ unless $_ eq "" || $_ eq "-";
+      }
+      $opts{pidfile} = "";
+      return;
+    }
+    close($child_end);
+    push @bus_nodes, { address => $address, link => $parent_end, pid => $pid, queue => "" };
+  }
+  my $ret = eval { bus_master() };
+  if (!defined $ret) {
+    log_error("Error encountered: \"$@\"");
+    kill TERM => map { $_->{pid} } @bus_nodes;
+    $ret = 1;
+  }
+  exit $ret;
+}
+
+setup_bus() if $bus_addresses ne "";
+
 while(1) {
   eval {
     setup();
@@ -0,0 +1,114 @@
+#!/usr/bin/perl
+
+# records the raw conversions of an ADC channel through the lockserver from
+# the next start of the motor on, and prints them as CSV:
+#   ./scope-dump.pl --channel 7 --count 2000 --baudrate 500000 --open > run.csv
+# The lockserver must talk binary frames (--binary). Columns: the sample,
+# the conversion it was (other channels take turns in between), its time
+# in microseconds if the conversions come at a fixed rate, and the value.
+# See scope_stream() in main.c.
+
+use strict;
+use warnings;
+
+use IO::Select;
+use IO::Socket::UNIX;
+use Socket ();
+use Time::HiRes qw(time);
+use Getopt::Long qw(:config bundling);
+
+# perls Socket functions don't understand Linux's autobind feature.
+my $sockaddr_un_auto = substr(pack_sockaddr_un("\0a"),0,-2);
+sub IO::Socket::UNIX::autobind {
+  $_[0]->bind($sockaddr_un_auto);
+}
+
+my $ux_path = "/run/lockserver.sock";
+my $channel = 7;
+my $count = 1000;
+my $baudrate = 0;
+my $open = 0;
+my $timeout = 30;
+my $f_cpu = 16000000;
+
+GetOptions(
+  "unix-socket|u=s" => \$ux_path,
+  "channel|c=i" => \$channel,
+  "count|n=i" => \$count,
+  "baudrate|b=i" => \$baudrate,
+  "open!" => \$open,
+  "timeout|t=f" => \$timeout,
+  "f-cpu=i" => \$f_cpu,
+) && !@ARGV && $channel >= 0 && $channel < 8 && $count > 0 && $count <= 0xffff
+  or die "usage: $0 [--unix-socket path] [--channel 0..7] [--count n] [--baudrate rate] [--open] [--timeout s] [--f-cpu hz]\n";
+
+my $sock = IO::Socket::UNIX->new(Type => SOCK_DGRAM, Peer => $ux_path)
+  or die "cannot connect to $ux_path: $!\n";
+$sock->autobind or die "cannot bind: $!\n";
+my $sel = IO::Select->new($sock);
+$sock->send(".register R");
+
+# the next line from the device that matches $re, or undef after $wait s.
+sub wait_line {
+  my ($re,$wait) = @_;
+  my $end = time+$wait;
+  while ((my $left = $end-time) > 0) {
+    next unless $sel->can_read($left);
+    my $datagram;
+    $sock->recv($datagram,8192);
+    for my $line (split /\n/, $datagram) {
+      # replies may carry a tag, see tag_command() in lockserver.pl.
+      next unless $line =~ s/^R (?:#[0-9A-F]+ )?//;
+      return $line if $line =~ $re;
+    }
+  }
+  return undef;
+}
+
+if ($baudrate) {
+  $sock->send(".baudrate $baudrate");
+  defined wait_line(qr/^BAUD=/,3) or warn "no answer to .baudrate, going on.\n";
+}
+
+$sock->send(sprintf("!O%X%X",$channel,$count));
+my $reply = wait_line(qr/^(?:OK\.|ERR)$/,3) // die "no answer from the device.\n";
+die "the device refused, is the lockserver running with --binary?\n" if $reply eq "ERR";
+$sock->send(".open scope_dump") if $open;
+print STDERR "armed, waiting for the motor.\n";
+
+my ($cycles,@samples,$state);
+my $seq = 0;
+my $lost = 0;
+my $end = time+$timeout;
+while (!defined $state) {
+  my $line = wait_line(qr/^(?:CAPTURE|SCOPE)=/,$end-time) // last;
+  if ($line =~ /^CAPTURE=(\d+) (\d+) ([0-9A-F]+) ([0-9A-F]+)$/) {
+    if ($1 == 2) {
+      $cycles = hex($3);
+      print STDERR "triggered, ",hex($4)," samples to come.\n";
+    } else {
+      $state = $1;
+    }
+  } elsif ($line =~ /^SCOPE=([0-9A-F]{2})((?: [0-9A-F]{4})+)$/) {
+    $lost += (hex($1)-$seq) & 0xff;
+    $seq = (hex($1)+1) & 0xff;
+    push @samples, map { hex } split ' ', $2;
+  }
+}
+$sock->send(".unregister");
+$sock->send("!O");
+
+warn "timed out.\n" unless defined $state;
+warn "the device's ring ran full, the recording ends early. Try a higher --baudrate.\n"
+  if ($state // 0) == 4;
+warn "$lost frames got lost on the way, the conversion numbers after that are off.\n"
+  if $lost;
+
+print "sample,conversion,time_us,value\n";
+my $conversion = -1;
+for my $i (0..$#samples) {
+  my $sample = $samples[$i];
+  $conversion += ($sample >> 10)+1;
+  my $us = $cycles ? sprintf("%.1f",$conversion*$cycles*1e6/$f_cpu) : "";
+  print join(",",$i,$conversion,$us,$sample & 0x3ff),"\n";
+}
@@ -16,6 +16,26 @@
 //#define DEBUG_DISPLAY
 #define DEBUG_MOTOR_SENSE
 //#define DEBUG_INTERRUPTS
+// run non-realtime event handlers from the main loop, see events.h.
+#define EVENTS_DEFERRED
+// keep statistics about the event queue, see events.h and !E.
+#define EVENTS_STATS
+// count the commands and their cycles, see commands[] and !Q.
+#define COMMAND_STATS
+// 9 instead of 16 bytes of RAM per event, see events.h and the handler
+// table above main().
+//#define EVENTS_COMPACT
+// binary frames with CRC as protocol version 4, see usart.h and !0.
+#define USART_FRAMES
+// several locks on one serial line, see usart.h and !A.
+#define USART_BUS
+// sleep in power-down mode while nothing is going on, see tickless.h and !W.
+// Every wakeup loses the characters that come in during it, so the host
+// must start each command with a line feed, as lockserver.pl does.
+//#define TICKLESS
+// deep sleep only up to this baud rate, where the wakeup takes about one
+// character.
+#define TICKLESS_MAX_BAUD 9600
 #define ENABLE_EASTEREGGS
 //#define ENABLE_COPYRIGHTED_EASTEREGGS
 
@@ -32,7 +52,9 @@
 #include <math.h>
 
 #include <timers.h>
-#define EVENT_QUEUE_SIZE 8
+#define EVENT_QUEUE_SIZE 16
+// for the door lock, motor fail and motor stop events.
+#define EVENT_QUEUE_RESERVED 3
 #include <events.c.h>
 
 
@@ -54,6 +76,11 @@ eepromfs_index_t eep_index;
 //#define eep_segment_low 0
 //#define eep_segment_high 1
 
+#ifdef USART_BUS
+#include "eeprom.h"
+#define eep_bus_address 2
+#endif
+
 #define ledpin 5
 #define baudrate 9600
 //#define baudrate 57600
@@ -72,15 +99,28 @@ eepromfs_index_t eep_index;
 #define ATTR_ALWAYS_INLINE __attribute__((always_inline))
 
 #define outbuf_size 80
+#include <numconv.h>
 #include <usart.h>
 
-//#define ADCW_READ_COUNT (1 << 6)
-#define ADCW_READ_COUNT (1 << 5)
+#define ADCW_READ_SHIFT 5
+// 2 kHz instead of the 9.6 kHz of free running.
+#define ADCW_SAMPLE_PERIOD usec2ticks(500,TIMER_DIV)
+// or convert in ADC noise reduction sleep whenever there's nothing to do.
+//#define ADCW_SLEEP
+// raw conversions of one channel on request, see scope_stream().
+#define ADCW_SCOPE
+#if defined(ADCW_SCOPE) && !defined(USART_FRAMES)
+#error "ADCW_SCOPE needs USART_FRAMES"
+#endif
 
 #include <adc.h>
 #include <adc_watch.h>
+#ifdef TICKLESS
+#include <tickless.h>
+#endif
 //#include "spi.h"
 #include "prng.h"
+#include <led_blink.h>
 
 #ifdef DEBUG_DISPLAY
 #include <pcd8544_display.h>
@@ -142,82 +182,6 @@ cable
 void process_char(char c);
 void process_pinpad_char(char c);
 
-static char hexchar(uint8_t i) {
-  return i < 10 ? '0'+i : i < 16 ? 'A'-10+i : 'X';
-}
-
-void buftohex(const uint8_t* src, char* dest, int count) {
-  for (int i = 0; i < count; i++) {
-    uint8_t val = src[i];
-    dest[2*i] = hexchar(val >> 4);
-    dest[2*i+1] = hexchar(val & 15);
-  }
-  dest[2*count] = 0;
-}
-
-void inttohex(uint32_t value, char* dest, int count) {
-  for (int i = 0; i < count; i++) {
-    uint8_t val = (value & 0xf);
-    value >>= 4;
-    dest[count-1-i] = hexchar(val);
-  }
-  dest[count] = 0;
-}
-
-uint32_t hex2int(const char* s) {
-  uint32_t res = 0;
-  for (int i = 0; s[i] != 0 && i < 20; i++) {
-    char c = s[i];
-    char v = c-'0';
-    if (v > 9) v = c-'A'+10;
-    if (v > 15) v = c-'a'+10;
-    if (v > 15 || v < 0) v = 0;
-    res <<= 4;
-    res |= v;
-  }
-  return res;
-}
-
-bool snprintl(char* s, int len, int32_t value) {
-  bool positive = value >= 0;
-  bool ok = 1;
-  uint32_t val;
-/*  if (!positive) {
-    val = -value;
-  }*/
-  if (positive) {
-    val = value;
-  } else {
-    val = (uint32_t)(-value);
-  }
-  int i = 0;
-  while (i < len && val != 0) {
-    char v0 = val % 10;
-    val /= 10;
-    s[len-1-i] = '0'+v0;
-    i++;
-  }
-  if (i == 0) {
-    s[len-1] = '0';
-    i++;
-  }
-  if (!positive) {
-    if (i == len-1) {
-      i--;
-      ok = 0;
-    }
-    s[len-1-i] = '-';
-  }
-  if (val != 0) {
-    ok = 0;
-  }
-  while (i < len) {
-    s[len-1-i] = ' ';
-    i++;
-  }
-  return ok;
-}
-
 // --- power management ---
 
 void poweroff() {
@@ -262,18 +226,6 @@ void save_state() {
 void load_state() {
 }
 
-// The LED is sadly placed on SCK, so we don't use it right now.
-void led_blink_event(void* param) {
-  LEDs_ToggleLEDs(LEDS_LED1);
-
-  int16_t i = (int16_t)param;
-
-  if (i > 0) {
-    i--;
-    enqueue_event_rel(msec2ticks(250,TIMER_DIV),&led_blink_event,(void*)i);
-  }
-}
-
 /*
 //void EVENT_beep_done() {
 void EVENT_melody_done() {
@@ -353,18 +305,32 @@ int pinpad_inbuf_len = 0;
 
 #define pinpad_timeout sec2ticks(10,TIMER_DIV)
 bool pinpad_sleeping = false;
+event_handle_t pinpad_sleep_handle = EVENT_HANDLE_NONE;
+
+// AWAKE=$awake\n
+void print_awake(uint8_t awake) {
+#ifdef USART_FRAMES
+  if (usart_framing) {
+    usart_frame(USART_PRIO_STATE,'A',&awake,1);
+    return;
+  }
+#endif
+  if (awake)
+    usart_line(USART_PRIO_STATE,"AWAKE=1\n");
+  else
+    usart_line(USART_PRIO_STATE,"AWAKE=0\n");
+}
 
 void pinpad_sleep_event(void* param) {
   pinpad_sleeping = true;
   pinpad_sleep();
   pinpad_inbuf_len = 0;
   do_pinpad_feedback(0);
-  usart_msg("AWAKE=0\n");
+  print_awake(0);
 }
 
 void pinpad_be_used() {
-  dequeue_events(&pinpad_sleep_event);
-  enqueue_event_rel(pinpad_timeout,&pinpad_sleep_event,(void*)0);
+  requeue_event_rel(&pinpad_sleep_handle,pinpad_timeout,&pinpad_sleep_event,(void*)0);
 }
 
 void print_door_feedback(uint8_t mode, uint8_t success) {
@@ -380,12 +346,25 @@ void print_door_feedback(uint8_t mode, uint8_t success) {
   msg[8] = success?'1':'0';
   usart_write(msg,10);
   */
-  usart_msg("DOOR=");
-  usart_writechar(door_is_locked()?'1':'0');
-  usart_writechar(door_is_closed()?'1':'0');
-  usart_writechar('0'+mode);
-  usart_writechar('0'+success);
-  usart_writechar('\n');
+#ifdef USART_FRAMES
+  if (usart_framing) {
+    // the same as bits: locked, closed, 2 of mode, 2 of success.
+    uint8_t state = (door_is_locked()?1:0) | (door_is_closed()?2:0) | mode << 2 | success << 4;
+    usart_frame(USART_PRIO_STATE,'D',&state,1);
+    return;
+  }
+#endif
+  char msg[5];
+  msg[0] = door_is_locked()?'1':'0';
+  msg[1] = door_is_closed()?'1':'0';
+  msg[2] = '0'+mode;
+  msg[3] = '0'+success;
+  msg[4] = '\n';
+  if (usart_msg_begin(USART_PRIO_STATE,10)) {
+    usart_msg("DOOR=");
+    usart_write(msg,5);
+    usart_msg_end();
+  }
 }
 
 #define DOOR_REPORT_DELAY msec2ticks(200,TIMER_DIV)
@@ -394,13 +373,19 @@ void report_state_event(void* param) {
   print_door_feedback(door_mode, 2);
 }
 
+event_handle_t report_state_handle = EVENT_HANDLE_NONE;
+
+// (re)starts the delay for reporting the door state.
+void schedule_state_report() {
+  requeue_event_rel(&report_state_handle,DOOR_REPORT_DELAY,&report_state_event,NULL);
+}
+
 uint8_t recent_pins[3] = {0,0,0};
 //int32_t last_keypress_time = 0;
 
 void EVENT_Interrupt(uint8_t port, uint8_t pins) {
   // fill the entropy into the random buffer:
-  uint32_t time = get_time();
-  prng_write_byte(time & 0xff);
+  prng_write_byte(get_time_entropy());
 
   uint8_t changedpins = pins ^ recent_pins[port];
 
@@ -412,7 +397,7 @@ void EVENT_Interrupt(uint8_t port, uint8_t pins) {
       pinpad_unsleep();
       pinpad_be_used();
       do_pinpad_feedback(5);
-      usart_msg("AWAKE=1\n");
+      print_awake(1);
     }
     if (changedpins & door_imask) {
       if (changedpins & (1 << DOOR_SENSOR_PIN))
@@ -420,8 +405,7 @@ void EVENT_Interrupt(uint8_t port, uint8_t pins) {
       if (changedpins & (1 << DOOR_BOLTSENSOR_PIN))
         door_boltsensor_changed();
       //print_door_feedback(0,success);
-      dequeue_events(&report_state_event);
-      enqueue_event_rel(DOOR_REPORT_DELAY,&report_state_event,NULL);
+      schedule_state_report();
     }
   }
 /*
@@ -435,11 +419,12 @@ void EVENT_Interrupt(uint8_t port, uint8_t pins) {
 #ifdef DEBUG_INTERRUPTS
   char msg[10] = "r0=......\n";
   msg[1] = '0'+port;
-  inttohex(pins,&msg[3],2);
+  fmt_hex(pins,&msg[3],2);
   msg[5] = '\n';
   msg[6] = 0;
-  if (usart_writable_space() > 7) {
+  if (usart_msg_begin(USART_PRIO_DEBUG,6)) {
     usart_write(msg,6);
+    usart_msg_end();
   }
 #endif
 }
@@ -483,158 +468,829 @@ void buttons_init() {
   recent_pins[2] = PIND;
 }
 
+/*
+  Sequence tags: every reply to a command line "!#<tag> <command>" starts
+  with "#<tag> ", e.g. "!#12 D1" gets "#12 OK.". The tag is up to 4 hex
+  digits. A tagged command always gets a reply, "OK." if it has none
+  else and "ERR" if it is unknown. Reports that come later, like DOOR=
+  after !#12 d, aren't tagged.
+*/
+char reply_tag[6];
+uint8_t reply_tag_len = 0;
+bool replied = false;
+
+// starts a reply of len characters to the current command, see
+// usart_msg_begin().
+bool reply_begin(uint8_t len) {
+  replied = true;
+  if (!usart_msg_begin(USART_PRIO_REPLY,reply_tag_len+len))
+    return false;
+  usart_write(reply_tag,reply_tag_len);
+  return true;
+}
+
+void reply_line_P(const char* s, uint8_t len) {
+  if (reply_begin(len)) {
+    usart_write_P(s,len);
+    usart_msg_end();
+  }
+}
+#define reply_line(msg) reply_line_P(PSTR(msg),sizeof(msg)-1)
+
 const char ok_msg[] PROGMEM = "OK.\n";
-#define usart_ok() usart_write_P(ok_msg,sizeof(ok_msg)-1)
+void usart_ok() {
+#ifdef USART_FRAMES
+  if (usart_framing) {
+    // with the tag as payload.
+    replied = true;
+    usart_frame(USART_PRIO_REPLY,'K',reply_tag,reply_tag_len);
+    return;
+  }
+#endif
+  reply_line_P(ok_msg,sizeof(ok_msg)-1);
+}
+
+// takes the tag from "!#<tag> <command>" at s, and returns the rest as
+// "!<command>", or NULL if there is no valid tag.
+char* reply_tag_take(char* s) {
+  uint8_t n = 0;
+  for (char c = s[2]; n < 4 && ((c >= '0' && c <= '9') || (c >= 'A' && c <= 'F') ||
+                                (c >= 'a' && c <= 'f')); c = s[2+n])
+    n++;
+  if (n == 0 || s[2+n] != ' ')
+    return NULL;
+  reply_tag[0] = '#';
+  memcpy(&reply_tag[1],&s[2],n);
+  reply_tag[n+1] = ' ';
+  reply_tag_len = n+2;
+  s += n+2;
+  s[0] = '!';
+  return s;
+}
+
+/*
+  Baud rate negotiation: !B<baud> answers BAUD=<baud>, or BAUD=00000000 if
+  the rate can't be made, still at the old rate, and then switches. Unless
+  the challenge !C<token> comes in at the new rate within
+  baud_trial_timeout, it goes back to the old rate by itself.
+*/
+#define baud_trial_timeout msec2ticks(1000,TIMER_DIV)
+uint8_t baud_fallback_ubrr;
+event_handle_t baud_trial_handle = EVENT_HANDLE_NONE;
+
+void baud_revert_event(void* param) {
+  usart_init_ubrr(baud_fallback_ubrr);
+}
+
+void baud_negotiate(uint32_t baud) {
+  int16_t ubrr = usart_baud_ubrr(baud);
+#ifdef USART_BUS
+  // the whole bus has to agree on one rate.
+  if (usart_bus_address != 0)
+    ubrr = -1;
+#endif
+  char msg[9];
+  fmt_hex(ubrr < 0 ? 0 : baud,msg,8);
+  msg[8] = '\n';
+  if (reply_begin(5+9)) {
+    usart_msg("BAUD=");
+    usart_write(msg,9);
+    usart_msg_end();
+  }
+  if (ubrr < 0)
+    return;
+  // let the answer go out at the old rate. A few ms at most.
+  while (!usart_idle());
+  // a second !B during the trial still falls back to the last good rate.
+  if (!event_pending(baud_trial_handle))
+    baud_fallback_ubrr = UBRR0;
+  usart_init_ubrr(ubrr);
+  requeue_event_rel(&baud_trial_handle,baud_trial_timeout,&baud_revert_event,NULL);
+}
+
+#ifdef USART_BUS
+#ifndef USART_BUS_ADDRESS
+#define USART_BUS_ADDRESS 0
+#endif
+// the address of this lock on a shared line, 0 for point to point. !A
+// overrides the one in the config.
+uint8_t bus_address_load() {
+  uint32_t address = USART_BUS_ADDRESS;
+  eepromfs_get(NULL,eep_bus_address,&address);
+  return address < 0xff ? address : USART_BUS_ADDRESS;
+}
+#endif
 
 #define pinpad_debug_interval msec2ticks(100,TIMER_DIV)
+event_handle_t pinpad_debug_handle = EVENT_HANDLE_NONE;
 void pinpad_debug_event(void* param) {
   int16_t value = adcw_state.values[PINPAD_PIN];
   char msg[5];
-  snprintl(msg,4,value);
+  fmt_dec(msg,4,value);
   msg[4] = 0;
 #ifdef DEBUG_DISPLAY
   display_text(0,24,&testfont,msg);
 #else
-  usart_writechar('P');
-  usart_write(msg,4);
-  usart_writechar('\n');
+  if (usart_msg_begin(USART_PRIO_DEBUG,6)) {
+    usart_writechar('P');
+    usart_write(msg,4);
+    usart_writechar('\n');
+    usart_msg_end();
+  }
+#endif
+}
+
+#ifdef EVENTS_STATS
+// buckets per LATE= line, so that a line fits into outbuf next to the
+// headroom of the higher priority and the frame overhead.
+#define event_stats_late_buckets 6
+#define event_stats_late_lines \
+  ((EVENTS_STATS_BUCKETS+event_stats_late_buckets-1)/event_stats_late_buckets)
+// LATE=, the handler, the first bucket and the buckets.
+#define event_stats_line_len (5+4+3+5*event_stats_late_buckets+1)
+// param flag for clearing the statistics after the last line.
+#define event_stats_clear 0x100
+// param counts the tries of a line that doesn't fit in units of this.
+#define event_stats_retry 0x1000
+#define event_stats_max_retries 15
+/*
+  prints one line of the event statistics per call, as they don't fit into
+  the output buffer at once:
+    EVENTS=$max_count $dropped $past $isr_max\n
+  and then for every handler seen, event_stats_late_buckets at a time
+    LATE=$handler $first_bucket $bucket...\n
+  A line that doesn't fit is tried again every 10 ms, and dropped after
+  event_stats_max_retries tries.
+  param is the line number, plus event_stats_clear and the tries.
+*/
+void event_stats_event(void* param) {
+  uint16_t flags = (uint16_t)param;
+  uint8_t line = flags;
+  // the line after the name, formatted before the message.
+  char msg[event_stats_line_len-5];
+  bool sent = true;
+  if (line == 0) {
+    fmt_hex(events_stats.max_count,msg,2);
+    uint16_t counters[3] = {
+      events_stats.dropped, events_stats.past, events_stats.isr_max
+    };
+    for (uint8_t i = 0; i < 3; i++) {
+      msg[2+5*i] = ' ';
+      fmt_hex(counters[i],&msg[3+5*i],4);
+    }
+    msg[17] = '\n';
+    sent = usart_msg_begin(USART_PRIO_REPLY,7+18);
+    if (sent) {
+      usart_msg("EVENTS=");
+      usart_write(msg,18);
+      usart_msg_end();
+    }
+  } else {
+    events_stats_handler_t *s = &events_stats.handlers[(line-1)/event_stats_late_lines];
+    uint8_t first = (line-1)%event_stats_late_lines*event_stats_late_buckets;
+    bool used = s->handler != NULL;
+    for (uint8_t i = 0; i < EVENTS_STATS_BUCKETS; i++)
+      used |= s->lateness[i] != 0;
+    fmt_hex((uint16_t)s->handler,msg,4);
+    msg[4] = ' ';
+    fmt_hex(first,&msg[5],2);
+    uint8_t len = 7;
+    for (uint8_t i = first; i < EVENTS_STATS_BUCKETS && i < first+event_stats_late_buckets; i++) {
+      msg[len] = ' ';
+      fmt_hex(s->lateness[i],&msg[len+1],4);
+      len += 5;
+    }
+    msg[len++] = '\n';
+    if (used) {
+      sent = usart_msg_begin(USART_PRIO_REPLY,5+len);
+      if (sent) {
+        usart_msg("LATE=");
+        usart_write(msg,len);
+        usart_msg_end();
+      }
+    }
+  }
+  if (!sent && flags < event_stats_max_retries*event_stats_retry) {
+    enqueue_event_rel(msec2ticks(10,TIMER_DIV),&event_stats_event,(void*)(flags+event_stats_retry));
+    return;
+  }
+  flags &= event_stats_retry-1;
+  if (line < EVENTS_STATS_HANDLERS*event_stats_late_lines)
+    enqueue_event_rel(1,&event_stats_event,(void*)(flags+1));
+  else if (flags & event_stats_clear)
+    events_stats_clear();
+}
 #endif
-  enqueue_event_rel(pinpad_debug_interval,&pinpad_debug_event,NULL);
+
+/*
+  Telemetry: !S<mask><period> pushes a snapshot of the metrics in <mask>
+  (4 hex digits) every <period> ms and answers with the first one right
+  away. !S alone stops it. The snapshot is
+    TELE=$mask $field...\n
+  with the fields of the bits in <mask>, in their order, or in binary mode
+  a frame 'Y' with the mask and the fields, little endian.
+*/
+#define TELEMETRY_DOOR 0x01   // $locked | $closed<<1 | $mode<<2, 1 byte.
+#define TELEMETRY_UPTIME 0x02 // as for !T, 6 bytes.
+#define TELEMETRY_QUEUES 0x04 // events queued, RX lost, TX dropped: 1, 2, 2 bytes.
+#define TELEMETRY_ADC(chan) (0x100 << (chan)) // adcw_state.values[chan], 2 bytes.
+#define telemetry_size_max (1+6+5+8*2)
+#define telemetry_min_period 10
+// about 134 s, enqueue_periodic() takes less than EVENTS_MAX_DELAY ticks.
+#define telemetry_max_period (EVENTS_MAX_DELAY/msec2ticks(1,TIMER_DIV))
+uint16_t telemetry_mask = 0;
+event_handle_t telemetry_handle = EVENT_HANDLE_NONE;
+
+// appends a field of size bytes to the snapshot in telemetry_event().
+#define telemetry_put(value,size) \
+  do { memcpy(&data[len],(value),(size)); sizes[n++] = (size); len += (size); } while (0)
+
+// sends a snapshot, as the reply to !S or with param != NULL as the
+// periodic one.
+void telemetry_event(void* param) {
+  uint16_t mask = telemetry_mask;
+  uint8_t data[2+telemetry_size_max];
+  // mask, door, uptime, 3 of the queues and 8 channels.
+  uint8_t sizes[14];
+  uint8_t n = 0, len = 0;
+  telemetry_put(&mask,2);
+  if (mask & TELEMETRY_DOOR) {
+    uint8_t state = (door_is_locked()?1:0) | (door_is_closed()?2:0) | door_mode << 2;
+    telemetry_put(&state,1);
+  }
+  if (mask & TELEMETRY_UPTIME) {
+    uint64_t time = get_time64();
+    telemetry_put(&time,6);
+  }
+  if (mask & TELEMETRY_QUEUES) {
+    uint8_t queued = event_count;
+    usart_rx_stats_t stats;
+    usart_rx_stats_get(&stats,false);
+    uint16_t lost = stats.overrun+stats.frame_error+stats.ring_full+stats.bad_frame;
+    uint16_t dropped[USART_PRIOS];
+    usart_tx_dropped_get(dropped,false);
+    for (uint8_t i = 1; i < USART_PRIOS; i++)
+      dropped[0] += dropped[i];
+    telemetry_put(&queued,1);
+    telemetry_put(&lost,2);
+    telemetry_put(&dropped[0],2);
+  }
+  for (uint8_t chan = 0; chan < 8; chan++) {
+    if (mask & TELEMETRY_ADC(chan))
+      telemetry_put(&adcw_state.values[chan],2);
+  }
+#ifdef USART_FRAMES
+  if (usart_framing && (param != NULL || reply_tag_len == 0)) {
+    replied |= param == NULL;
+    usart_frame(param != NULL ? USART_PRIO_DEBUG : USART_PRIO_REPLY,'Y',data,len);
+    return;
+  }
+#endif
+  // per byte 2 digits, per field a space or the line feed. Formatted
+  // before the message, which keeps the interrupts off.
+  char text[2*sizeof(data)+sizeof(sizes)+1];
+  uint8_t text_len = 0;
+  uint8_t *field = data;
+  for (uint8_t i = 0; i < n; i++) {
+    // most significant byte first.
+    for (uint8_t k = sizes[i]; k-- > 0; text_len += 2)
+      fmt_hex(field[k],&text[text_len],2);
+    text[text_len++] = i+1 < n ? ' ' : '\n';
+    field += sizes[i];
+  }
+  if (param != NULL ? !usart_msg_begin(USART_PRIO_DEBUG,5+text_len) : !reply_begin(5+text_len))
+    return;
+  usart_msg("TELE=");
+  usart_write(text,text_len);
+  usart_msg_end();
+}
+
+void telemetry_subscribe(uint16_t mask, uint32_t period) {
+  stop_periodic(&telemetry_handle);
+  telemetry_mask = mask;
+  if (mask == 0 || period == 0)
+    return;
+  if (period < telemetry_min_period)
+    period = telemetry_min_period;
+  if (period > telemetry_max_period)
+    period = telemetry_max_period;
+  telemetry_event(NULL);
+  telemetry_handle = enqueue_periodic(period*msec2ticks(1,TIMER_DIV),&telemetry_event,(void*)1);
+}
+
+#ifdef ADCW_SCOPE
+/*
+  The scope of adc_scope.h goes out in binary frames, little endian:
+    'o': state, channel, CPU cycles per conversion (4 bytes, 0 if they
+         don't come at a fixed rate) and a count (2 bytes). Sent when the
+         recording starts (ADC_SCOPE_RUNNING, with the samples to come) and
+         when it's over (ADC_SCOPE_DONE or ADC_SCOPE_OVERRUN, with the
+         samples recorded).
+    'O': a sequence number, then up to scope_frame_samples samples of 2
+         bytes, see adc_scope.h.
+  Nothing is dropped: a frame waits until it fits, and the ring runs full
+  instead. Debug priority leaves the line to everything else, so a high
+  baud rate helps.
+*/
+#define scope_frame_samples 8
+uint8_t scope_reported = ADC_SCOPE_OFF;
+uint8_t scope_seq;
+
+static bool scope_report(uint8_t state) {
+#ifdef ADCW_SLEEP
+  uint32_t cycles = 0;
+#else
+  // 13 ADC clocks at ADC_DIV_128 when free running.
+  uint32_t cycles = adcw_state.period != 0 ?
+      (uint32_t)adcw_state.period*TIMER_DIV : 13*128;
+#endif
+  uint16_t count = state == ADC_SCOPE_RUNNING ? adc_scope.left : adc_scope.count;
+  uint8_t head[2] = {state,adc_scope.channel};
+  if (!usart_frame_begin(USART_PRIO_DEBUG,'o',8))
+    return false;
+  usart_write((const char*)head,2);
+  usart_write((const char*)&cycles,4);
+  usart_write((const char*)&count,2);
+  usart_msg_end();
+  scope_reported = state;
+  return true;
+}
+
+// sends what the scope has recorded. To be called from the main loop.
+void scope_stream() {
+  uint8_t state = adc_scope.state;
+  if (state == ADC_SCOPE_OFF || state == ADC_SCOPE_ARMED)
+    return;
+  if (!usart_framing) {
+    adc_scope_arm(0,0);
+    return;
+  }
+  if (scope_reported != ADC_SCOPE_RUNNING && !scope_report(ADC_SCOPE_RUNNING))
+    return;
+  uint8_t n;
+  while ((n = adc_scope_available()) != 0 &&
+         (n >= scope_frame_samples || state != ADC_SCOPE_RUNNING)) {
+    if (n > scope_frame_samples)
+      n = scope_frame_samples;
+    // an ISR may fill outbuf up to the moment the frame begins, and the
+    // samples mustn't leave the ring before there's room for them.
+    if (!usart_frame_begin(USART_PRIO_DEBUG,'O',1+2*n))
+      return;
+    uint16_t samples[scope_frame_samples];
+    adc_scope_take(samples,n);
+    usart_writechar(scope_seq++);
+    usart_write((const char*)samples,2*n);
+    usart_msg_end();
+  }
+  if (state != ADC_SCOPE_RUNNING && adc_scope_available() == 0 &&
+      scope_report(state))
+    adc_scope.state = ADC_SCOPE_OFF;
+}
+
+/*
+  records <param> from the second digit on (hex) samples of ADC channel
+  <param 1> from the next start of the motor on. Without <param>, stops.
+  Binary frames only.
+*/
+void command_scope(uint32_t arg, char* param, uint8_t len) {
+  uint32_t channel = 0, count = 0;
+  if (!usart_framing || (len != 0 && (len < 2 ||
+      !parse_hex(param,1,&channel) || channel > 7 ||
+      !parse_hex(&param[1],len-1,&count) || count > 0xffff))) {
+    reply_line("ERR\n");
+    return;
+  }
+  adc_scope_arm(channel,count);
+  scope_reported = ADC_SCOPE_OFF;
+  scope_seq = 0;
+  usart_ok();
+}
+#endif
+
+/*
+  The commands: !<letter><param>, optionally tagged, see reply_tag_take().
+  Each one is a handler in the table commands[], which gets <param> and its
+  length, and with COMMAND_HEX the value of <param> as a hex number in arg,
+  0 if it's empty. A <param> that isn't a hex number gets ERR instead.
+  With COMMAND_OK, OK. is sent after the handler.
+*/
+typedef void (*command_fun_t)(uint32_t arg, char* param, uint8_t len);
+typedef struct {
+  char letter;
+  uint8_t flags;
+  command_fun_t handler;
+} command_t;
+#define COMMAND_HEX 1
+#define COMMAND_OK 2
+
+// our protocol version. May also be used as a generic ping.
+void command_version(uint32_t version, char* param, uint8_t len) {
+#ifdef USART_FRAMES
+  // !04 switches to binary frames, !03 back to text lines. The answer to
+  // both is still a text line.
+  if (version == 3)
+    usart_framing = false;
+  if (version == 4 || usart_framing) {
+    reply_line("VERSION 4\n");
+    usart_framing = true;
+    return;
+  }
+#endif
+  reply_line("VERSION 3\n");
+}
+
+#ifdef USART_BUS
+// set the bus address to <param> from the next reset on. 0 is point to
+// point, ff goes back to USART_BUS_ADDRESS.
+void command_bus_address(uint32_t address, char* param, uint8_t len) {
+  eepromfs_put(NULL,eep_bus_address,&address);
+}
+#endif
+
+// start/stop adnauseam playing.
+void command_adnauseam(uint32_t do_play, char* param, uint8_t len) {
+  if (do_play) {
+    adnauseam_play(korobeiniki_progression);
+  } else {
+    adnauseam_stop();
+  }
+}
+
+// set a new baud rate. The user will have to adapt to get the OK. See !B
+// for the safe way.
+void command_baud(uint32_t baud, char* param, uint8_t len) {
+  usart_init_baud(baud);
+}
+
+// negotiate the baud rate <param>, see baud_negotiate().
+void command_baud_negotiate(uint32_t baud, char* param, uint8_t len) {
+  baud_negotiate(baud);
+}
+
+// answer the challenge <param> with ECHO=<param>. Keeps the baud rate set
+// by !B.
+void command_challenge(uint32_t arg, char* param, uint8_t len) {
+  event_cancel(baud_trial_handle);
+  baud_trial_handle = EVENT_HANDLE_NONE;
+  if (reply_begin(5+len+1)) {
+    usart_msg("ECHO=");
+    usart_write(param,len);
+    usart_writechar('\n');
+    usart_msg_end();
+  }
+}
+
+// open/close the door.
+void command_door(uint32_t open, char* param, uint8_t len) {
+  if (open)
+    door_unlock();
+  else
+    door_lock();
+}
+
+#ifdef EVENTS_STATS
+// print event statistics. Reset them afterwards if <param> is 1.
+void command_event_stats(uint32_t arg, char* param, uint8_t len) {
+  uint16_t clear = arg == 1 ? event_stats_clear : 0;
+  enqueue_event_rel(1,&event_stats_event,(void*)clear);
+}
+#endif
+
+// get current door state.
+void command_door_state(uint32_t arg, char* param, uint8_t len) {
+  schedule_state_report();
+}
+
+// blink the LED <param> times.
+void command_blink(uint32_t count, char* param, uint8_t len) {
+  led_blink(count);
+}
+
+// stop blinking the LED.
+// turn it on (param=1) or off (param=0) or leave it as it is (param=2)
+void command_blink_stop(uint32_t stay, char* param, uint8_t len) {
+  stop_periodic(&led_blink_handle);
+  if (stay == 0) {
+    LEDs_TurnOffLEDs(LEDS_LED1);
+  } else if (stay == 1) {
+    LEDs_TurnOnLEDs(LEDS_LED1);
+  }
+}
+
+// read adc_watch channel <param>.
+void command_adc(uint32_t num, char* param, uint8_t len) {
+  uint32_t value;
+  value = adcw_state.values[num % 8];
+  char msg[10];
+  fmt_hex(value,msg,9);
+  if (reply_begin(2+len+11)) {
+    usart_msg("!G");
+    usart_write(param,len);
+    usart_writechar(' ');
+    usart_write(msg,9);
+    usart_writechar('\n');
+    usart_msg_end();
+  }
+}
+
+// play the korobeiniki main theme once.
+void command_korobeiniki(uint32_t arg, char* param, uint8_t len) {
+  melody_play(&korobeiniki_a);
+}
+
+// currently a no-op.
+void command_load(uint32_t arg, char* param, uint8_t len) {
+  load_state();
+}
+
+// play musical feedback sound <param>.
+void command_feedback(uint32_t i, char* param, uint8_t len) {
+  do_pinpad_feedback(i);
+}
+
+// debug the pinpad by printing out adc readings.
+void command_pinpad_debug(uint32_t arg, char* param, uint8_t len) {
+  if (!event_pending(pinpad_debug_handle))
+    pinpad_debug_handle = enqueue_periodic(pinpad_debug_interval,&pinpad_debug_event,NULL);
+}
+
+// currently a no-op.
+void command_save(uint32_t arg, char* param, uint8_t len) {
+  save_state();
+}
+
+// subscribe to the telemetry <mask> (4 digits) every <period> ms, see
+// telemetry_subscribe().
+void command_telemetry(uint32_t arg, char* param, uint8_t len) {
+  uint32_t mask = 0, period = 0;
+  if (len != 0 && (len <= 4 || !parse_hex(param,4,&mask) ||
+                   !parse_hex(&param[4],len-4,&period))) {
+    reply_line("ERR\n");
+    return;
+  }
+  telemetry_subscribe(mask,period);
+}
+
+// beep with frequency <param> for half a second.
+void command_beep(uint32_t freq, char* param, uint8_t len) {
+  beep(freq,500);
+}
+
+// Get (up-)time. Use to verify that a reset has been done.
+// 48 bits, so it doesn't wrap after 4.5 minutes.
+void command_time(uint32_t arg, char* param, uint8_t len) {
+  uint64_t time = get_time64();
+#ifdef USART_FRAMES
+  if (usart_framing && reply_tag_len == 0) {
+    // little endian, like the AVR.
+    usart_frame(USART_PRIO_REPLY,'T',&time,6);
+    return;
+  }
+#endif
+  char msg[13];
+  fmt_hex(time >> 32,msg,4);
+  fmt_hex(time,&msg[4],8);
+  msg[12] = '\n';
+  if (reply_begin(18)) {
+    usart_msg("TIME=");
+    usart_write(msg,13);
+    usart_msg_end();
+  }
+}
+
+// get the counters of lost serial input (hardware overruns, frame errors,
+// ring buffer overflows and broken binary frames) and of dropped output
+// messages (debug, replies and state). Reset them if <param> is 1.
+void command_usart_stats(uint32_t arg, char* param, uint8_t len) {
+  bool clear = arg == 1;
+  usart_rx_stats_t stats;
+  usart_rx_stats_get(&stats,clear);
+  uint16_t counters[4+USART_PRIOS] = {
+    stats.overrun, stats.frame_error, stats.ring_full, stats.bad_frame
+  };
+  usart_tx_dropped_get(&counters[4],clear);
+  // RXLOST=$overrun $frame_error $ring_full $bad_frame\n
+  // TXDROP=$debug $reply $state\n
+  char msg[7*5];
+  for (uint8_t i = 0; i < 7; i++) {
+    fmt_hex(counters[i],&msg[5*i],4);
+    msg[5*i+4] = i == 3 || i == 6 ? '\n' : ' ';
+  }
+  if (reply_begin(2*7+7*5)) {
+    usart_msg("RXLOST=");
+    usart_write(msg,4*5);
+    usart_msg("TXDROP=");
+    usart_write(&msg[4*5],3*5);
+    usart_msg_end();
+  }
+}
+
+#ifdef TICKLESS
+// get deep sleep statistics: number of sleeps, how many of them were ended
+// early by another interrupt, and the time slept in ms.
+void command_sleep_stats(uint32_t arg, char* param, uint8_t len) {
+  uint32_t counters[3] = {
+    tickless_stats.sleeps, tickless_stats.early, tickless_stats.slept_ms
+  };
+  // SLEEP=$sleeps $early $slept_ms\n
+  char msg[3*9+1];
+  for (uint8_t i = 0; i < 3; i++) {
+    fmt_hex(counters[i],&msg[9*i],8);
+    msg[9*i+8] = i == 2 ? '\n' : ' ';
+  }
+  if (reply_begin(6+3*9)) {
+    usart_msg("SLEEP=");
+    usart_write(msg,3*9);
+    usart_msg_end();
+  }
+}
+#endif
+
+#ifdef COMMAND_STATS
+void command_stats(uint32_t arg, char* param, uint8_t len);
+#endif
+
+// power down.
+void command_poweroff(uint32_t arg, char* param, uint8_t len) {
+  poweroff();
+}
+
+const command_t commands[] PROGMEM = {
+  {'0', COMMAND_HEX, &command_version},
+#ifdef USART_BUS
+  {'A', COMMAND_HEX|COMMAND_OK, &command_bus_address},
+#endif
+  {'a', COMMAND_HEX, &command_adnauseam},
+  {'b', COMMAND_HEX|COMMAND_OK, &command_baud},
+  {'B', COMMAND_HEX, &command_baud_negotiate},
+  {'C', 0, &command_challenge},
+  {'D', COMMAND_HEX|COMMAND_OK, &command_door},
+#ifdef EVENTS_STATS
+  {'E', COMMAND_HEX, &command_event_stats},
+#endif
+  {'d', 0, &command_door_state},
+  {'f', COMMAND_HEX, &command_blink},
+  {'F', COMMAND_HEX, &command_blink_stop},
+  {'G', COMMAND_HEX, &command_adc},
+  {'k', 0, &command_korobeiniki},
+  {'l', COMMAND_OK, &command_load},
+  {'m', COMMAND_HEX, &command_feedback},
+#ifdef ADCW_SCOPE
+  {'O', 0, &command_scope},
+#endif
+  {'P', COMMAND_OK, &command_pinpad_debug},
+#ifdef COMMAND_STATS
+  {'Q', COMMAND_HEX, &command_stats},
+#endif
+  {'s', COMMAND_OK, &command_save},
+  {'S', 0, &command_telemetry},
+  {'t', COMMAND_HEX, &command_beep},
+  {'T', 0, &command_time},
+  {'U', COMMAND_HEX, &command_usart_stats},
+#ifdef TICKLESS
+  {'W', 0, &command_sleep_stats},
+#endif
+  {'z', 0, &command_poweroff},
+};
+#define commands_count (sizeof(commands)/sizeof(commands[0]))
+
+#ifdef COMMAND_STATS
+/*
+  Per command: how often it ran and the most CPU cycles it took, up to
+  0xffff, with the reply written to the TX queue but not sent.
+*/
+typedef struct {
+  uint16_t count;
+  uint16_t max_cycles;
+} command_stats_t;
+command_stats_t command_stats_table[commands_count];
+
+// param flag for clearing the statistics after the last line.
+#define command_stats_clear 0x100
+/*
+  prints one line per call for every command that ran:
+    CMD=$letter $count $max_cycles\n
+  param is the index into commands[], plus command_stats_clear.
+*/
+void command_stats_event(void* param) {
+  uint16_t clear = (uint16_t)param & command_stats_clear;
+  uint8_t i = (uint16_t)param;
+  command_stats_t *stats = &command_stats_table[i];
+  if (stats->count != 0) {
+    char msg[12+1];
+    msg[0] = pgm_read_byte(&commands[i].letter);
+    msg[1] = ' ';
+    fmt_hex(stats->count,&msg[2],4);
+    msg[6] = ' ';
+    fmt_hex(stats->max_cycles,&msg[7],4);
+    msg[11] = '\n';
+    if (usart_msg_begin(USART_PRIO_REPLY,16)) {
+      usart_msg("CMD=");
+      usart_write(msg,12);
+      usart_msg_end();
+    } else {
+      // waits for the room instead of dropping the line.
+      enqueue_event_rel(msec2ticks(10,TIMER_DIV),&command_stats_event,param);
+      return;
+    }
+  }
+  if (i+1 < commands_count)
+    enqueue_event_rel(1,&command_stats_event,(void*)(clear | (i+1)));
+  else if (clear)
+    memset(command_stats_table,0,sizeof(command_stats_table));
+}
+
+// print the command statistics. Reset them afterwards if <param> is 1.
+void command_stats(uint32_t arg, char* param, uint8_t len) {
+  uint16_t clear = arg == 1 ? command_stats_clear : 0;
+  enqueue_event_rel(1,&command_stats_event,(void*)clear);
+}
+#endif
+
+// runs the command with the given letter, returns false if there is none.
+bool command_run(char letter, char* param, uint8_t len) {
+  // few enough for a linear search.
+  for (uint8_t i = 0; i < commands_count; i++) {
+    if (pgm_read_byte(&commands[i].letter) != letter)
+      continue;
+    uint8_t flags = pgm_read_byte(&commands[i].flags);
+    command_fun_t handler = (command_fun_t)pgm_read_ptr(&commands[i].handler);
+    uint32_t arg = 0;
+    if ((flags & COMMAND_HEX) && len != 0 && !parse_hex(param,len,&arg)) {
+      reply_line("ERR\n");
+      return true;
+    }
+#ifdef COMMAND_STATS
+    uint32_t start = get_time();
+#endif
+    handler(arg,param,len);
+    if (flags & COMMAND_OK)
+      usart_ok();
+#ifdef COMMAND_STATS
+    uint32_t cycles = (get_time()-start)*TIMER_DIV;
+    command_stats_t *stats = &command_stats_table[i];
+    stats->count++;
+    if (cycles > stats->max_cycles)
+      stats->max_cycles = cycles > 0xffff ? 0xffff : cycles;
+#endif
+    return true;
+  }
+  return false;
 }
 
 void process_line() {
   char *s = inbuf;
-  if (inbuf_len == 0)
+  int len = inbuf_len;
+  if (len == 0)
     return;
   if (s[0] != '!') {
-    // int len = inbuf_len;
     // we don't have any use for non-command data, so we just remind the user
     // to disable the tty's useless echo feature.
-    usart_msg("!ECHO OFF\n");
-  } else if (inbuf_len >= 2) {
-    char cmd = s[1];
-    char *param = &s[2];
-    switch (cmd) {
-      case '0': {
-          // our protocol version. May also be used as a generic ping.
-          usart_msg("VERSION 3\n");
-        }
-        break;
-      case 'a': {
-          // start/stop adnauseam playing.
-          uint32_t do_play = hex2int(param);
-          if (do_play) {
-            adnauseam_play(korobeiniki_progression);
-          } else {
-            adnauseam_stop();
-          }
-        }
-        break;
-      case 'b': {
-          // set a new baud rate. The user will have to adapt to get the OK.
-          uint32_t baud = hex2int(param);
-          usart_init_baud(baud);
-          usart_ok();
-        }
-        break;
-      case 'D': {
-          // open/close the door.
-          uint32_t open = hex2int(param);
-          if (open)
-            door_unlock();
-          else
-            door_lock();
-          usart_ok();
-        }
-        break;
-      case 'd': {
-        // get current door state.
-        dequeue_events(&report_state_event);
-        enqueue_event_rel(DOOR_REPORT_DELAY,&report_state_event,NULL);
-      }
-      case 'f': {
-          // blink the LED <param> times.
-          LEDs_TurnOffLEDs(LEDS_LED1);
-          uint16_t count = hex2int(param)*2-1;
-          enqueue_event_rel(1,&led_blink_event,(void*)count);
-        }
-        break;
-      case 'F': {
-          // stop blinking the LED.
-          // turn it on (param=1) or off (param=0) or leave it as it is (param=2)
-          uint16_t stay = hex2int(param);
-          dequeue_events(&led_blink_event);
-          if (stay == 0) {
-            LEDs_TurnOffLEDs(LEDS_LED1);
-          } else if (stay == 1) {
-            LEDs_TurnOnLEDs(LEDS_LED1);
-          }
-        }
-        break;
-      case 'G': {
-          // read adc_watch channel <param>.
-          uint8_t num = hex2int(param);
-          usart_write(inbuf,inbuf_len);
-          uint32_t value;
-          value = adcw_state.values[num % 8];
-          char msg[10];
-          inttohex(value,msg,9);
-          usart_writechar(' ');
-          usart_write(msg,9);
-          usart_writechar('\n');
-        }
-        break;
-      case 'k':
-        // play the korobeiniki main theme once.
-        melody_play(&korobeiniki_a);
-        break;
-      case 'l':
-        // currently a no-op.
-        load_state();
-        usart_ok();
-        break;
-      case 'm': {
-          // play musical feedback sound <param>.
-          uint32_t i = hex2int(param);
-          do_pinpad_feedback(i);
-        }
-        break;
-      case 'P': {
-          // debug the pinpad by printing out adc readings.
-          enqueue_event_rel(pinpad_debug_interval,&pinpad_debug_event,NULL);
-          usart_ok();
-        }
-        break;
-      case 's':
-        // currently a no-op.
-        save_state();
-        usart_ok();
-        break;
-      case 't': {
-          // beep with frequency <param> for half a second.
-          uint16_t freq = hex2int(param);
-          beep(freq,500);
-        }
-        break;
-      case 'T': {
-          // Get (up-)time. Use to verify that a reset has been done.
-          uint32_t time = get_time();
-          usart_msg("TIME=");
-          char msg[9];
-          inttohex(time,msg,8);
-          usart_write(msg,8);
-          usart_writechar('\n');
-        }
-        break;
-      case 'z':
-        // power down.
-        poweroff();
-        break;
+    usart_line(USART_PRIO_REPLY,"!ECHO OFF\n");
+  } else if (len >= 2 && s[1] == '#' && (s = reply_tag_take(inbuf)) == NULL) {
+    usart_line(USART_PRIO_REPLY,"ERR\n");
+  } else {
+    len -= s-inbuf;
+    if (len < 2 || !command_run(s[1],&s[2],len-2)) {
+      if (reply_tag_len != 0)
+        reply_line("ERR\n");
     }
+    if (reply_tag_len != 0 && !replied)
+      usart_ok();
   }
+  reply_tag_len = 0;
+  replied = false;
+}
+
+#ifdef USART_FRAMES
+// in binary mode, the input is a sequence of frames, each ended by a 0.
+// A frame of type 'c' holds a command line without its line feed.
+void process_frame_char(char c) {
+  if (c == 0) {
+    if (inbuf_len < inbuf_size) {
+      uint8_t len = usart_frame_decode(inbuf,inbuf_len);
+      if (len != 0 && inbuf[0] == 'c') {
+        inbuf_len = len-1;
+        memmove(inbuf,&inbuf[1],inbuf_len);
+        inbuf[inbuf_len] = 0;
+        process_line();
+      }
+    }
+    inbuf_len = 0;
+  } else if (inbuf_len < inbuf_size) {
+    inbuf[inbuf_len] = c;
+    inbuf_len++;
+  } // else ignore more characters and in the end the whole frame.
 }
+#endif
 
 void process_char(char c) {
+#ifdef USART_FRAMES
+  if (usart_framing) {
+    process_frame_char(c);
+    return;
+  }
+#endif
   if (c == 10 || c == 13) {
     if (inbuf_len < inbuf_size) {
       inbuf[inbuf_len] = 0;
@@ -698,9 +1354,18 @@ void process_pinpad_line() {
   display_clear();
   display_text(0,8,&testfont,s);
 #endif
-  usart_msg("PIN=");
-  usart_write(s,pinpad_inbuf_len);
-  usart_msg("\n");
+#ifdef USART_FRAMES
+  if (usart_framing) {
+    usart_frame(USART_PRIO_STATE,'P',s,pinpad_inbuf_len);
+    return;
+  }
+#endif
+  if (usart_msg_begin(USART_PRIO_STATE,pinpad_inbuf_len+5)) {
+    usart_msg("PIN=");
+    usart_write(s,pinpad_inbuf_len);
+    usart_msg("\n");
+    usart_msg_end();
+  }
 }
 
 // TODO: beep accordingly
@@ -732,16 +1397,17 @@ void process_pinpad_char(char c) {
   } // else ignore more characters and in the end the whole line.
 }
 
+// called from the main loop by usart_rx_dispatch().
 void EVENT_USART_Read(char c) {
   // fill the entropy into the random buffer:
-  prng_write_byte(get_time() & 0xff);
+  prng_write_byte(get_time_entropy());
 
   process_char(c);
 }
 
 void EVENT_pinpad_keypressed(char c) {
   // fill the entropy into the random buffer:
-  prng_write_byte(get_time() & 0xff);
+  prng_write_byte(get_time_entropy());
 
   pinpad_be_used();
   if (c != 0)
@@ -755,11 +1421,20 @@ void EVENT_adc_watch(uint8_t channel, int16_t value) {
   } else if (channel == DOOR_MOTOR_SENSE_PIN) {
     door_on_motor_sense_read(value);
 #ifdef DEBUG_MOTOR_SENSE
+#ifdef USART_FRAMES
+    if (usart_framing) {
+      usart_frame(USART_PRIO_DEBUG,'S',&value,2);
+      return;
+    }
+#endif
     char s[5];
-    snprintl(s,4,value);
+    fmt_dec(s,4,value);
     s[4] = '\n';
-    usart_msg("SENSE=");
-    usart_write(s,5);
+    if (usart_msg_begin(USART_PRIO_DEBUG,11)) {
+      usart_msg("SENSE=");
+      usart_write(s,5);
+      usart_msg_end();
+    }
 #endif
   } else {
     adc_watch_set_range(channel,value-2,value+2);
@@ -776,9 +1451,18 @@ void EVENT_door_motor_failing(uint8_t symptom) {
   //char msg[] = "MFAIL=0\n";
   //msg[6] = '0'+symptom;
   //usart_write(msg,8);
-  usart_msg("MFAIL=");
-  usart_writechar('0'+symptom);
-  usart_writechar('\n');
+#ifdef USART_FRAMES
+  if (usart_framing) {
+    usart_frame(USART_PRIO_STATE,'M',&symptom,1);
+    return;
+  }
+#endif
+  char msg[2] = {(char)('0'+symptom), '\n'};
+  if (usart_msg_begin(USART_PRIO_STATE,8)) {
+    usart_msg("MFAIL=");
+    usart_write(msg,2);
+    usart_msg_end();
+  }
 }
 
 void EVENT_door_locked(bool success) {
@@ -792,8 +1476,11 @@ void EVENT_door_unlocked(bool success) {
 }
 
 void EVENT_door_mode_changed(uint8_t old_mode) {
-  dequeue_events(&report_state_event);
-  enqueue_event_rel(DOOR_REPORT_DELAY,&report_state_event,NULL);
+#ifdef ADCW_SCOPE
+  if (old_mode == DOOR_MODE_IDLE && door_mode != DOOR_MODE_IDLE)
+    adc_scope_trigger();
+#endif
+  schedule_state_report();
 }
 
 
@@ -821,7 +1508,13 @@ void startup() {
 
   // setup event processing
   events_start(TIMER_SCALE);
+#ifdef TICKLESS
+  tickless_calibrate();
+#endif
 
+#ifdef USART_BUS
+  usart_bus_address = bus_address_load();
+#endif
   usart_init();
   buttons_init();
   door_init();
@@ -844,6 +1537,51 @@ void startup() {
   load_state();
 }
 
+#ifdef TICKLESS
+// deep sleep stops the ADC, the USART and the motor.
+bool may_sleep_deep() {
+  // double speed, see usart_init_ubrr().
+  return UBRR0 >= (uint8_t)(F_CPU/8/TICKLESS_MAX_BAUD-1) &&
+         pinpad_sleeping && door_mode == DOOR_MODE_IDLE &&
+         (adcw_state.state == ADCW_STATE_IDLE ||
+          adcw_state.state == ADCW_STATE_STOPPED) &&
+         usart_idle();
+}
+#endif
+
+#ifdef ADCW_SLEEP
+// ADC noise reduction sleep stops the I/O clock, and with it the USART
+// and the PWM of a stepper motor.
+bool may_sleep_adc() {
+#ifdef MOTOR_IS_STEPPER
+  if (door_mode != DOOR_MODE_IDLE)
+    return false;
+#endif
+  return usart_idle();
+}
+#endif
+
+#ifdef EVENTS_COMPACT
+// every handler that goes into the event queue.
+const event_handler_fun_t events_handlers[] PROGMEM = {
+  EVENTS_BUILTIN_HANDLERS
+  &led_blink_event, &pinpad_sleep_event, &pinpad_debug_event,
+  &report_state_event, &baud_revert_event, &telemetry_event,
+#ifdef EVENTS_STATS
+  &event_stats_event,
+#endif
+#ifdef COMMAND_STATS
+  &command_stats_event,
+#endif
+  &beep_event, &beep_done_event,
+  &door_lock_event, &door_maybe_motorfail_event, &motor_stop_event,
+#ifdef MOTOR_IS_SERVO
+  &servo_ontimer, &servo_pulse_end,
+#endif
+  NULL
+};
+#endif
+
 int main() {
 
   startup();
@@ -858,12 +1596,38 @@ int main() {
    // _ADC, _PWR_DOWN, _PWR_SAVE, _STANDBY, _EXT_STANDBY
    // PWR_SAVE leaves Timer2 active, PWR_DOWN is rather off.
   while(true) {
-    // let the ISRs handle the events.
-    sleep_mode();
-      /* or:
-           sleep_enable(); sei(); sleep_cpu(); sleep_disable();
-         for avoiding race conditions we don't have.
-      */
+    // the commands received by the USART.
+    usart_rx_dispatch();
+#ifdef ADCW_SCOPE
+    scope_stream();
+#endif
+#ifdef EVENTS_DEFERRED
+    events_dispatch();
+#endif
+    // an ISR may have changed things after we looked. sei() takes effect
+    // only after sleep_cpu(), so no interrupt can slip in between.
+    cli();
+#ifdef EVENTS_DEFERRED
+    if (!events_ready() && !usart_rx_pending())
+#else
+    if (!usart_rx_pending())
+#endif
+    {
+#ifdef ADCW_SLEEP
+      if (!adc_watch_sleep(may_sleep_adc()))
+#endif
+#ifdef TICKLESS
+      if (!may_sleep_deep() || !tickless_sleep())
+#endif
+      {
+        // let the ISRs handle the events.
+        sleep_enable();
+        sei();
+        sleep_cpu();
+        sleep_disable();
+      }
+    }
+    sei();
   }
   return 0;
 }
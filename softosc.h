@@ -36,6 +36,7 @@
 // TODO: maybe change from array-of-channels model to pointer-to-context model?
 struct {
   uint32_t delay, count;
+  event_handle_t handle;
   int8_t pin;
 } softosc_channels[SOFTOSC_CHANNELS];
 
@@ -67,8 +68,8 @@ static void softosc_event(void* param) {
       c--;
       softosc_channels[chan].count = c;
     }
-    enqueue_event_rel(softosc_channels[chan].delay,&softosc_event,param);
   } else {
+    stop_periodic(&softosc_channels[chan].handle);
     DDR(pin>>3) &= ~(1 << (pin & 7));
     PORT(pin>>3) |= 1 << (pin & 7);
     EVENT_softosc_done(chan);
@@ -82,7 +83,9 @@ static void hw_softosc(uint8_t chan, uint32_t delay, uint32_t count) {
   int8_t pin = softosc_channels[chan].pin;
   PORT(pin>>3) &= ~(1 << (pin & 7));
   DDR(pin>>3) |= 1 << (pin & 7);
-  enqueue_event_rel(1,&softosc_event,(void*)(int16_t)chan); //(void*)count);
+  stop_periodic(&softosc_channels[chan].handle);
+  softosc_channels[chan].handle =
+    enqueue_periodic_flags(delay,&softosc_event,(void*)(int16_t)chan,EVENT_FLAG_ISR);
 }
 
 static void hw_softosc_forever(uint8_t chan, uint32_t delay) {
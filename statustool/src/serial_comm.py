@@ -28,7 +28,9 @@ class SerialComm:
     def send_command(self, command):
         try:
             if self.ser and self.ser.is_open:
-                self.ser.write(command.encode('utf-8'))
+                # the lock may be in deep sleep (TICKLESS), where it loses
+                # what wakes it up. It ignores an empty line.
+                self.ser.write(("\n" + command).encode('utf-8'))
             else:
                 raise ConnectionError("Serial port is not connected")
         except Exception as e:
@@ -0,0 +1,118 @@
+#include <cstdint>
+#include <vector>
+#include <avr/io.h>
+#include <avr/interrupt.h>
+namespace adc_scope_test
+{
+#include "adc_scope.h"
+}
+#include "gtest/gtest.h"
+namespace adc_scope_test
+{
+
+std::vector<uint16_t> take_all()
+{
+  std::vector<uint16_t> res;
+  uint16_t buf[5];
+  uint8_t n;
+  while ((n = adc_scope_take(buf,5)) != 0)
+    res.insert(res.end(),buf,buf+n);
+  return res;
+}
+
+class adcScope : public ::testing::Test {
+protected:
+  void SetUp() override {
+    adc_scope_arm(0,0);
+    take_all();
+  }
+};
+
+TEST_F(adcScope, recordsOnlyAfterTheTrigger)
+{
+  adc_scope_conversion(3,100);
+  EXPECT_EQ(0,adc_scope_available());
+  adc_scope_arm(3,4);
+  adc_scope_conversion(3,101);
+  EXPECT_EQ(ADC_SCOPE_ARMED,adc_scope.state);
+  EXPECT_EQ(0,adc_scope_available());
+  adc_scope_trigger();
+  EXPECT_EQ(ADC_SCOPE_RUNNING,adc_scope.state);
+  for (uint16_t v = 0; v < 6; v++)
+    adc_scope_conversion(3,1020+v);
+  EXPECT_EQ(ADC_SCOPE_DONE,adc_scope.state);
+  EXPECT_EQ(4,adc_scope.count);
+  EXPECT_EQ((std::vector<uint16_t>{1020,1021,1022,1023}),take_all());
+  // another trigger doesn't start it again.
+  adc_scope_trigger();
+  EXPECT_EQ(ADC_SCOPE_DONE,adc_scope.state);
+}
+
+TEST_F(adcScope, countsTheConversionsInBetween)
+{
+  adc_scope_arm(5,3);
+  adc_scope_trigger();
+  adc_scope_conversion(5,1);
+  adc_scope_conversion(2,7);
+  adc_scope_conversion(0xff,0);
+  adc_scope_conversion(5,2);
+  for (int i = 0; i < 100; i++)
+    adc_scope_conversion(1,7);
+  adc_scope_conversion(5,3);
+  std::vector<uint16_t> samples = take_all();
+  ASSERT_EQ(3u,samples.size());
+  EXPECT_EQ(0,ADC_SCOPE_SKIPPED(samples[0]));
+  EXPECT_EQ(1,ADC_SCOPE_VALUE(samples[0]));
+  EXPECT_EQ(2,ADC_SCOPE_SKIPPED(samples[1]));
+  EXPECT_EQ(2,ADC_SCOPE_VALUE(samples[1]));
+  // saturates.
+  EXPECT_EQ(63,ADC_SCOPE_SKIPPED(samples[2]));
+  EXPECT_EQ(3,ADC_SCOPE_VALUE(samples[2]));
+}
+
+TEST_F(adcScope, stopsWhenTheRingIsFull)
+{
+  adc_scope_arm(0,1000);
+  adc_scope_trigger();
+  for (uint16_t v = 0; v < ADC_SCOPE_SIZE+3; v++)
+    adc_scope_conversion(0,v);
+  EXPECT_EQ(ADC_SCOPE_OVERRUN,adc_scope.state);
+  EXPECT_EQ(ADC_SCOPE_SIZE,adc_scope.count);
+  // what came before the overrun is complete.
+  std::vector<uint16_t> samples = take_all();
+  ASSERT_EQ((size_t)ADC_SCOPE_SIZE,samples.size());
+  for (uint16_t v = 0; v < ADC_SCOPE_SIZE; v++)
+    EXPECT_EQ(v,samples[v]);
+  adc_scope_conversion(0,1);
+  EXPECT_EQ(0,adc_scope_available());
+}
+
+TEST_F(adcScope, keepsUpWhenTakenInTime)
+{
+  adc_scope_arm(0,1000);
+  adc_scope_trigger();
+  uint16_t expected = 0;
+  for (uint16_t v = 0; v < 1000; v++) {
+    adc_scope_conversion(0,v & 0x3ff);
+    if (adc_scope_available() >= 8) {
+      for (uint16_t s : take_all())
+        ASSERT_EQ(expected++,s);
+    }
+  }
+  for (uint16_t s : take_all())
+    ASSERT_EQ(expected++,s);
+  EXPECT_EQ(1000,expected);
+  EXPECT_EQ(ADC_SCOPE_DONE,adc_scope.state);
+}
+
+TEST_F(adcScope, armingAgainDropsTheRest)
+{
+  adc_scope_arm(0,10);
+  adc_scope_trigger();
+  adc_scope_conversion(0,1);
+  adc_scope_arm(0,0);
+  EXPECT_EQ(ADC_SCOPE_OFF,adc_scope.state);
+  EXPECT_EQ(0,adc_scope_available());
+}
+
+}
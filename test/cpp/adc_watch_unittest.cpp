@@ -0,0 +1,220 @@
+#include <cstdint>
+#include <cstring>
+#include <vector>
+#include <avr/io.h>
+#include <avr/interrupt.h>
+namespace adcw
+{
+#include "adc_watch.h"
+}
+#include "gtest/gtest.h"
+namespace adcw
+{
+
+struct reading {
+  uint8_t channel;
+  int16_t value;
+};
+std::vector<reading> events;
+
+void EVENT_adc_watch(uint8_t channel, int16_t value)
+{
+  events.push_back({channel,value});
+}
+
+// the input of each channel, and the number of conversions on it.
+int16_t input[8];
+unsigned conversions[8];
+// the mux of the running conversion, latched when it started.
+uint8_t running_mux;
+
+// finishes a conversion. In free running mode the next one starts with the
+// ADMUX of now, then the ISR sees the result. A triggered one starts with
+// the ADMUX of now, when Timer 1 reaches OCR1B.
+void convert()
+{
+  if ((ADCSRB & 7) == ADC_TRIGGER_TIMER1_COMPB) {
+    TCNT1 = OCR1B;
+    running_mux = ADMUX;
+  } else if (ADCSRA & (1 << ADSC)) {
+    running_mux = ADMUX;
+    ADCSRA &= ~(1 << ADSC);
+  }
+  uint8_t chan = running_mux & 7;
+  ADC = input[chan];
+  conversions[chan]++;
+  running_mux = ADMUX;
+  if ((ADCSRA & (1 << ADIE)) && (ADCSRA & (1 << ADATE)))
+    ADC_vect();
+}
+
+// converts until there are count more readings.
+void run_readings(size_t count)
+{
+  size_t end = events.size()+count;
+  for (int k = 0; k < 100000 && events.size() < end; k++)
+    convert();
+  ASSERT_EQ(end,events.size());
+}
+
+class adc_watch : public ::testing::Test
+{
+protected:
+  void SetUp() override
+  {
+    ADMUX = ADCSRA = ADCSRB = 0;
+    TCNT1 = OCR1B = 0;
+    events.clear();
+    memset(input,0,sizeof(input));
+    memset(conversions,0,sizeof(conversions));
+    adc_watch_init(0);
+    // report every reading.
+    for (uint8_t c = 0; c < 8; c++)
+      adc_watch_set_range(c,32767,-1);
+  }
+};
+
+TEST_F(adc_watch, readingsAreTheMeanOfTheirChannel)
+{
+  input[0] = 300;
+  input[7] = 900;
+  adc_watch_set_oversampling(0,0);
+  adc_watch_set_oversampling(7,3);
+  adc_watch_set_filter(0,0);
+  adc_watch_set_filter(7,0);
+  adc_watch_set_mask(0x81);
+  adc_watch_start();
+  run_readings(20);
+  for (const reading& r : events)
+    EXPECT_EQ(input[r.channel],r.value) << (int)r.channel;
+  // one conversion is dropped after each switch.
+  EXPECT_EQ(10u*2,conversions[0]);
+  EXPECT_EQ(10u*9,conversions[7]);
+}
+
+TEST_F(adc_watch, weightsGiveReadingsInARow)
+{
+  input[0] = 300;
+  input[7] = 900;
+  adc_watch_set_oversampling(0,2);
+  adc_watch_set_oversampling(7,2);
+  adc_watch_set_weight(7,4);
+  adc_watch_set_mask(0x81);
+  adc_watch_start();
+  run_readings(50);
+  for (size_t k = 0; k < events.size(); k++) {
+    EXPECT_EQ(k % 5 == 0 ? 0 : 7,events[k].channel) << k;
+    EXPECT_EQ(input[events[k].channel],events[k].value) << k;
+  }
+  // only a switch drops a conversion.
+  EXPECT_EQ(10u*5,conversions[0]);
+  EXPECT_EQ(10u*(1+4*4),conversions[7]);
+  // back to taking turns.
+  adc_watch_set_weight(7,1);
+  run_readings(10);
+  for (size_t k = 50; k < events.size(); k++)
+    EXPECT_NE(events[k-1].channel,events[k].channel) << k;
+}
+
+TEST_F(adc_watch, triggeredReadingsKeepTheirChannels)
+{
+  input[0] = 300;
+  input[5] = 600;
+  input[7] = 900;
+  adc_watch_set_oversampling(0,0);
+  adc_watch_set_oversampling(7,2);
+  adc_watch_set_weight(7,3);
+  adc_watch_set_mask(0xa1);
+  adc_watch_set_period(1000);
+  TCNT1 = 0xfe00;
+  adc_watch_start();
+  EXPECT_EQ(ADC_TRIGGER_TIMER1_COMPB,ADCSRB);
+  EXPECT_FALSE(ADCSRA & (1 << ADSC));
+  EXPECT_EQ((uint16_t)(0xfe00+1000),OCR1B);
+  run_readings(50);
+  for (const reading& r : events)
+    EXPECT_EQ(input[r.channel],r.value) << (int)r.channel;
+  // 0, 5 and three times 7 with 4 conversions each.
+  EXPECT_EQ(10u*2,conversions[0]);
+  EXPECT_EQ(10u*(1+3*4),conversions[7]);
+  // all on time.
+  unsigned total = 0;
+  for (unsigned c : conversions)
+    total += c;
+  EXPECT_EQ((uint16_t)(0xfe00+1000*(total+1)),OCR1B);
+}
+
+TEST_F(adc_watch, lateTriggersStartFromNow)
+{
+  adc_watch_set_mask(1);
+  adc_watch_set_period(1000);
+  adc_watch_start();
+  convert();
+  EXPECT_EQ(2000,OCR1B);
+  // a late ISR keeps the phase,
+  TCNT1 = 2500;
+  ADC_vect();
+  EXPECT_EQ(3000,OCR1B);
+  // unless it is so late that it missed the next compare match.
+  TIFR1 = 0;
+  TCNT1 = 4100;
+  ADC_vect();
+  EXPECT_EQ(5100,OCR1B);
+  EXPECT_EQ(1 << OCF1B,TIFR1);
+  // back to free running.
+  adc_watch_set_period(0);
+  EXPECT_EQ(ADC_TRIGGER_FREE_RUNNING,ADCSRB);
+  EXPECT_TRUE(ADCSRA & (1 << ADSC));
+}
+
+TEST_F(adc_watch, oversamplingKeepsFractions)
+{
+  adc_watch_set_oversampling(2,ADCW_READ_SHIFT_MAX);
+  adc_watch_set_filter(2,0);
+  adc_watch_set_mask(1 << 2);
+  adc_watch_start();
+  // alternating 500 and 501 averages to 500.5, rounded up.
+  for (int k = 0; k < 40*33; k++) {
+    input[2] = 500+(conversions[2] & 1);
+    convert();
+  }
+  ASSERT_FALSE(events.empty());
+  EXPECT_EQ(501,events.back().value);
+  EXPECT_EQ(500 << ADCW_FRAC_BITS | 1 << (ADCW_FRAC_BITS-1),adcw_state.filtered[2]);
+}
+
+TEST_F(adc_watch, filterFollowsByItsShift)
+{
+  input[3] = 400;
+  adc_watch_set_oversampling(3,2);
+  adc_watch_set_filter(3,2);
+  adc_watch_set_mask(1 << 3);
+  adc_watch_start();
+  // the first reading is taken as it is.
+  run_readings(1);
+  EXPECT_EQ(400,events.back().value);
+  input[3] = 800;
+  double expected = 400;
+  for (int k = 0; k < 30; k++) {
+    run_readings(1);
+    expected += (800-expected)/4;
+    EXPECT_NEAR(expected,events.back().value,1) << k;
+  }
+}
+
+TEST_F(adc_watch, addedChannelsStartAfresh)
+{
+  input[1] = 1000;
+  adc_watch_set_filter(1,4);
+  adc_watch_set_mask(1 << 1);
+  adc_watch_start();
+  run_readings(3);
+  EXPECT_EQ(1000,events.back().value);
+  adc_watch_set_mask(0);
+  input[1] = 100;
+  adc_watch_set_mask(1 << 1);
+  run_readings(1);
+  EXPECT_EQ(100,events.back().value);
+}
+
+}
@@ -0,0 +1,195 @@
+/*
+  Host benchmark for the events.c.h queue operations.
+  Build once per EVENT_QUEUE_SIZE (see "make bench"). For every queue fill
+  level it measures how long enqueue_event_abs(), dequeue_events(),
+  event_cancel(), event_reschedule() and one dispatch by TIMER1_COMPA_vect keep the interrupts disabled, in host cycles.
+  Each state is measured several times and the fastest run is kept, so
+  noise from the host does not show up as a worst case. The report is the
+  worst case of those over all fill levels.
+  The last number is the worst-case latency a USART RX interrupt would see
+  when four chatty handlers are due at once: the longest interrupts-off
+  window of the compare ISR plus, with EVENTS_DEFERRED, events_dispatch().
+  With EVENTS_COMPACT the events are all near ones, within a 16 bit key.
+*/
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <avr/io.h>
+#include <avr/interrupt.h>
+#include <util/atomic.h>
+#include "timers.h"
+#include "events.c.h"
+
+static void nop_event(void* param)
+{
+}
+
+static void victim_event(void* param)
+{
+}
+
+// stands in for the handlers that format a message: a 32-bit division and
+// 20 characters written one by one, each in its own atomic block like
+// usart_writechar() does.
+static volatile char chatty_out[20];
+static void chatty_event(void* param)
+{
+  volatile uint32_t divisor = 1000+(uintptr_t)param;
+  uint32_t x = 0x12345678u/divisor;
+  for (int i = 0; i < 20; i++) {
+    ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+      chatty_out[i] = '0'+((x >> i) & 7);
+    }
+  }
+}
+
+#ifdef EVENTS_COMPACT
+const event_handler_fun_t events_handlers[] PROGMEM = {
+  EVENTS_BUILTIN_HANDLERS &nop_event, &victim_event, &chatty_event, NULL
+};
+static const uint32_t fill_range = 60000;
+#else
+static const uint32_t fill_range = 1000000;
+#endif
+
+static const int repeats = 200;
+
+static event_slot_t saved_slots[EVENT_QUEUE_SIZE];
+static uint8_t saved_heap[EVENT_QUEUE_SIZE];
+static uint8_t saved_count;
+#ifdef EVENTS_DEFERRED
+static uint8_t saved_ready_count;
+#endif
+#ifdef EVENTS_COMPACT
+static event_long_t saved_long[EVENTS_LONG_SIZE];
+static uint32_t saved_epoch;
+#endif
+static event_handle_t victim;
+
+static void save_queue()
+{
+  memcpy(saved_slots,event_slots,sizeof(event_slots));
+  memcpy(saved_heap,event_heap,sizeof(event_heap));
+  saved_count = event_count;
+#ifdef EVENTS_DEFERRED
+  saved_ready_count = event_ready_count;
+#endif
+#ifdef EVENTS_COMPACT
+  memcpy(saved_long,event_long,sizeof(event_long));
+  saved_epoch = event_epoch;
+#endif
+}
+
+static void restore_queue()
+{
+  memcpy(event_slots,saved_slots,sizeof(event_slots));
+  memcpy(event_heap,saved_heap,sizeof(event_heap));
+  event_count = saved_count;
+#ifdef EVENTS_DEFERRED
+  event_ready_count = saved_ready_count;
+#endif
+#ifdef EVENTS_COMPACT
+  memcpy(event_long,saved_long,sizeof(event_long));
+  event_epoch = saved_epoch;
+#endif
+}
+
+// fill the queue with n events at random times after now (0).
+static void fill_queue(uint8_t n)
+{
+  events_clear();
+  for (uint8_t i = 0; i < n; i++) {
+    event_handle_t h = enqueue_event_abs(1000+rand()%fill_range,(i == n/2)?&victim_event:&nop_event,NULL);
+    if (i == n/2)
+      victim = h;
+  }
+}
+
+template<typename F>
+static uint64_t measure(F op)
+{
+  uint64_t best = UINT64_MAX;
+  for (int r = 0; r < repeats; r++) {
+    restore_queue();
+    op();
+    if (fake_irq_off_last < best)
+      best = fake_irq_off_last;
+  }
+  return best;
+}
+
+int main()
+{
+  srand(1);
+  TCNT1 = 0;
+  event_time_high = 0;
+  sei();
+  uint64_t worst_enqueue = 0, worst_dequeue = 0, worst_cancel = 0;
+  uint64_t worst_reschedule = 0, worst_dispatch = 0;
+  for (uint8_t n = 0; n < EVENT_QUEUE_SIZE; n++) {
+    fill_queue(n);
+    save_queue();
+    // the new event becomes the first: the longest path through the queue.
+    uint64_t t = measure([]{ enqueue_event_abs(500,&nop_event,NULL); });
+    if (t > worst_enqueue) worst_enqueue = t;
+    if (n == 0)
+      continue;
+    t = measure([]{ dequeue_events(&victim_event); });
+    if (t > worst_dequeue) worst_dequeue = t;
+    t = measure([]{ event_cancel(victim); });
+    if (t > worst_cancel) worst_cancel = t;
+    // moving it to the front also updates the hardware timer.
+    t = measure([]{ event_reschedule(victim,500); });
+    if (t > worst_reschedule) worst_reschedule = t;
+    t = measure([]{
+      // exactly the first event is due.
+      uint32_t due = events_slot_time(event_heap[0]);
+      event_time_high = due >> 16;
+      TCNT1 = due & 0xffff;
+      TIFR1 = 0;
+      cli();
+      TIMER1_COMPA_vect();
+      sei();
+    });
+    if (t > worst_dispatch) worst_dispatch = t;
+  }
+
+  uint64_t worst_latency = UINT64_MAX;
+  for (int r = 0; r < repeats; r++) {
+    events_clear();
+    TCNT1 = 0;
+    event_time_high = 0;
+    for (uintptr_t i = 0; i < 4 && i < EVENT_QUEUE_SIZE; i++)
+      enqueue_event_abs(1000+i,&chatty_event,(void*)i);
+    TCNT1 = 2000;
+    TIFR1 = 0;
+    fake_irq_off_max = 0;
+    cli();
+    TIMER1_COMPA_vect();
+    sei();
+#ifdef EVENTS_DEFERRED
+    events_dispatch();
+#endif
+    if (fake_irq_off_max < worst_latency)
+      worst_latency = fake_irq_off_max;
+  }
+#ifdef EVENTS_DEFERRED
+  const char *mode = "deferred";
+#else
+  const char *mode = "isr";
+#endif
+#ifdef EVENTS_COMPACT
+  const char *layout = "compact";
+#else
+  const char *layout = "";
+#endif
+  printf("EVENT_QUEUE_SIZE=%3d %-8s %-7s worst interrupts-off host cycles:"
+         "  enqueue %6lu  dequeue %6lu  cancel %6lu  reschedule %6lu"
+         "  dispatch %6lu  rx latency %6lu\n",
+         EVENT_QUEUE_SIZE,mode,layout,(unsigned long)worst_enqueue,
+         (unsigned long)worst_dequeue,(unsigned long)worst_cancel,
+         (unsigned long)worst_reschedule,(unsigned long)worst_dispatch,
+         (unsigned long)worst_latency);
+  return 0;
+}
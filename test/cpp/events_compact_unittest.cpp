@@ -0,0 +1,171 @@
+#include <cstdint>
+#include <cstdlib>
+#include <vector>
+#include <avr/io.h>
+#include <avr/interrupt.h>
+#include <util/atomic.h>
+#include "timers.h"
+// the configuration of main.c with compact slots.
+namespace compact
+{
+#define EVENT_QUEUE_SIZE 16
+#define EVENT_QUEUE_RESERVED 3
+#define EVENTS_DEFERRED
+#define EVENTS_COMPACT
+#define EVENTS_LONG_SIZE 8
+#include "events.c.h"
+}
+#include "gtest/gtest.h"
+namespace compact
+{
+
+std::vector<uintptr_t> fired;
+std::vector<uint32_t> fired_at;
+uint32_t now;
+
+// moves the clock forward to t.
+void set_time(uint32_t t)
+{
+  if (t < now)
+    event_time_top++;
+  now = t;
+  event_time_high = t >> 16;
+  TCNT1 = t & 0xffff;
+  TIFR1 = 0;
+}
+
+void record_event(void* param)
+{
+  fired.push_back((uintptr_t)param);
+  fired_at.push_back(now);
+}
+
+void unlisted_event(void* param)
+{
+}
+
+const event_handler_fun_t events_handlers[] PROGMEM = {
+  EVENTS_BUILTIN_HANDLERS &record_event, NULL
+};
+
+// runs the timer interrupt and the deferred handlers at time t.
+void run_at(uint32_t t)
+{
+  set_time(t);
+  cli();
+  TIMER1_COMPA_vect();
+  sei();
+  events_dispatch();
+}
+
+// runs the queue until there is nothing left before end, always at the
+// time the timer would fire next.
+void run_until(uint32_t end)
+{
+  uint32_t next;
+  while (events_next_time(&next) && gteq_mod32(end,next))
+    run_at(next);
+  set_time(end);
+}
+
+class events_compact : public ::testing::Test
+{
+protected:
+  void SetUp() override
+  {
+    events_clear();
+    fired.clear();
+    fired_at.clear();
+    now = 0;
+    event_time_top = 0;
+    set_time(0);
+    sei();
+  }
+};
+
+TEST_F(events_compact, farEventsFireOnTime)
+{
+  // around the 32 bit wrap, to check the keys don't care.
+  uint32_t start = 0xfffe0000u;
+  set_time(start);
+  const uint32_t delays[] = {100,70000,0xffff,0x10000,3000000,40000,200000,5};
+  for (uintptr_t i = 0; i < 8; i++)
+    EXPECT_TRUE(enqueue_event_abs(start+delays[i],&record_event,(void*)i));
+  EXPECT_EQ(0xffff,event_slots[event_handle_slot(
+      enqueue_event_abs(start+0x20000,&record_event,(void*)8))].time);
+  run_until(start+4000000);
+  std::vector<uintptr_t> expected{7,0,5,2,3,1,8,6,4};
+  EXPECT_EQ(expected,fired);
+  for (size_t k = 0; k < fired.size(); k++) {
+    uint32_t due = fired[k] == 8 ? 0x20000 : delays[fired[k]];
+    EXPECT_EQ(start+due,fired_at[k]) << "event " << fired[k];
+  }
+  // all long records are back.
+  for (uint8_t k = 0; k < EVENTS_LONG_SIZE; k++)
+    EXPECT_EQ(EVENT_HEAP_IX_NONE,event_long[k].slot);
+}
+
+TEST_F(events_compact, longRecordsRunOut)
+{
+  for (uint8_t k = 0; k < EVENTS_LONG_SIZE; k++)
+    EXPECT_TRUE(enqueue_event_abs(100000+k,&record_event,NULL));
+  EXPECT_FALSE(enqueue_event_abs(100000,&record_event,NULL));
+  EXPECT_FALSE(enqueue_periodic(1000,&record_event,NULL));
+  // near events don't need one.
+  event_handle_t h = enqueue_event_abs(1000,&record_event,NULL);
+  EXPECT_TRUE(h);
+  EXPECT_FALSE(event_reschedule(h,200000));
+  EXPECT_TRUE(event_reschedule(h,2000));
+  // the far events get near and give their records back.
+  run_at(50000);
+  EXPECT_EQ(1u,fired.size());
+  EXPECT_TRUE(enqueue_event_abs(200000,&record_event,NULL));
+  EXPECT_TRUE(enqueue_event_abs(300000,&record_event,NULL));
+}
+
+TEST_F(events_compact, longPeriodKeepsItsPhase)
+{
+  // a servo frame: 20 ms at 16 MHz.
+  const uint32_t period = 320000;
+  event_handle_t h = enqueue_periodic(period,&record_event,NULL);
+  EXPECT_TRUE(h);
+  for (uint32_t k = 1; k <= 50; k++) {
+    uint32_t next;
+    while (events_next_time(&next) && next != k*period)
+      run_at(next);
+    // late by up to 1000 ticks.
+    run_at(k*period+rand()%1000);
+  }
+  EXPECT_EQ(50u,fired.size());
+  EXPECT_TRUE(event_pending(h));
+  EXPECT_TRUE(stop_periodic(&h));
+  for (uint8_t k = 0; k < EVENTS_LONG_SIZE; k++)
+    EXPECT_EQ(EVENT_HEAP_IX_NONE,event_long[k].slot);
+}
+
+TEST_F(events_compact, handlersMustBeInTheTable)
+{
+  EXPECT_FALSE(enqueue_event_abs(100,&unlisted_event,NULL));
+  event_handle_t h = EVENT_HANDLE_NONE;
+  EXPECT_FALSE(requeue_event_rel(&h,100,&unlisted_event,NULL));
+  EXPECT_TRUE(requeue_event_rel(&h,100,&record_event,NULL));
+  EXPECT_FALSE(requeue_event_rel(&h,100,&unlisted_event,NULL));
+  EXPECT_FALSE(dequeue_events(&unlisted_event));
+  EXPECT_TRUE(dequeue_events(&record_event));
+  EXPECT_FALSE(event_pending(h));
+}
+
+TEST_F(events_compact, timeoutsHopThroughTheFarBucket)
+{
+  event_timeout_t t;
+  EXPECT_TRUE(event_timeout_start(&t,5ull*EVENT_TIMEOUT_HOP+123,&record_event,(void*)7));
+  for (uint32_t k = 1; k <= 5; k++)
+    run_until(k*0x40000000u);
+  run_until(0x40000000u+122);
+  EXPECT_TRUE(fired.empty());
+  run_until(0x40000000u+123);
+  std::vector<uintptr_t> expected{7};
+  EXPECT_EQ(expected,fired);
+}
+
+}
@@ -0,0 +1,227 @@
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <vector>
+#include <avr/io.h>
+#include <avr/interrupt.h>
+#include <util/atomic.h>
+#include "timers.h"
+// events.c.h defines its globals and functions in the header, which
+// events_unittest.cpp already does without the optional features.
+namespace deferred
+{
+#define EVENT_QUEUE_SIZE 8
+#define EVENTS_DEFERRED
+#define EVENTS_STATS
+#define EVENTS_STATS_HANDLERS 3
+#include "events.c.h"
+}
+#include "gtest/gtest.h"
+namespace deferred
+{
+
+std::vector<uintptr_t> fired;
+std::vector<bool> fired_in_isr;
+
+void record_event(void* param)
+{
+  fired.push_back((uintptr_t)param);
+  fired_in_isr.push_back(!(SREG & (1 << SREG_I)));
+}
+
+void set_time(uint32_t t)
+{
+  event_time_high = t >> 16;
+  TCNT1 = t & 0xffff;
+  TIFR1 = 0;
+}
+
+void run_isr_at(uint32_t t)
+{
+  set_time(t);
+  cli();
+  TIMER1_COMPA_vect();
+  sei();
+}
+
+class events_deferred : public ::testing::Test
+{
+protected:
+  void SetUp() override
+  {
+    events_clear();
+    events_stats_clear();
+    fired.clear();
+    fired_in_isr.clear();
+    set_time(0);
+    sei();
+  }
+};
+
+void other_event(void* param)
+{
+}
+
+void third_event(void* param)
+{
+}
+
+TEST_F(events_deferred, onlyIsrEventsRunInTheIsr)
+{
+  enqueue_event_abs(100,&record_event,(void*)1);
+  enqueue_event_abs_flags(200,&record_event,(void*)2,EVENT_FLAG_ISR);
+  enqueue_event_abs(300,&record_event,(void*)3);
+  enqueue_event_abs(400,&record_event,(void*)4);
+  run_isr_at(300);
+  std::vector<uintptr_t> expected{2};
+  EXPECT_EQ(expected,fired);
+  EXPECT_TRUE(events_ready());
+  EXPECT_EQ(400u,OCR1A);
+  EXPECT_TRUE(events_dispatch());
+  EXPECT_FALSE(events_ready());
+  expected = {2,1,3};
+  EXPECT_EQ(expected,fired);
+  std::vector<bool> in_isr{true,false,false};
+  EXPECT_EQ(in_isr,fired_in_isr);
+  EXPECT_FALSE(events_dispatch());
+}
+
+TEST_F(events_deferred, readyEventsCanBeCancelled)
+{
+  event_handle_t a = enqueue_event_abs(100,&record_event,(void*)1);
+  event_handle_t b = enqueue_event_abs(150,&record_event,(void*)2);
+  run_isr_at(200);
+  EXPECT_TRUE(event_pending(a));
+  EXPECT_TRUE(event_cancel(a));
+  EXPECT_FALSE(event_pending(a));
+  // moves it back into the queue.
+  EXPECT_TRUE(event_reschedule(b,500));
+  EXPECT_FALSE(events_dispatch());
+  EXPECT_EQ(500u,OCR1A);
+  run_isr_at(500);
+  events_dispatch();
+  std::vector<uintptr_t> expected{2};
+  EXPECT_EQ(expected,fired);
+  EXPECT_FALSE(event_pending(b));
+}
+
+TEST_F(events_deferred, readySlotsAreNotReused)
+{
+  for (unsigned int i = 0; i < EVENT_QUEUE_SIZE; i++) {
+    EXPECT_TRUE(enqueue_event_abs(100+i,&record_event,(void*)(uintptr_t)i));
+  }
+  run_isr_at(100+EVENT_QUEUE_SIZE/2);
+  EXPECT_FALSE(enqueue_event_abs(1000,&record_event,NULL));
+  EXPECT_TRUE(dequeue_events(&record_event));
+  EXPECT_EQ(0,event_count);
+  EXPECT_FALSE(events_ready());
+  for (unsigned int i = 0; i < EVENT_QUEUE_SIZE; i++) {
+    EXPECT_TRUE(enqueue_event_abs(2000+i,&record_event,(void*)(uintptr_t)i));
+  }
+  run_isr_at(3000);
+  events_dispatch();
+  EXPECT_EQ((size_t)EVENT_QUEUE_SIZE,fired.size());
+}
+
+TEST_F(events_deferred, randomOperationsKeepHandlesValid)
+{
+  srand(3);
+  event_handle_t h[EVENT_QUEUE_SIZE];
+  for (unsigned int round = 0; round < 200; round++) {
+    events_clear();
+    fired.clear();
+    fired_in_isr.clear();
+    set_time(0);
+    for (unsigned int i = 0; i < EVENT_QUEUE_SIZE; i++) {
+      h[i] = enqueue_event_abs_flags(100+rand()%1000,&record_event,
+                                     (void*)(uintptr_t)i,(rand()&1)?EVENT_FLAG_ISR:0);
+    }
+    run_isr_at(500);
+    std::vector<bool> gone(EVENT_QUEUE_SIZE);
+    for (uintptr_t i : fired)
+      gone[i] = true;
+    for (unsigned int k = 0; k < EVENT_QUEUE_SIZE; k++) {
+      unsigned int i = rand()%EVENT_QUEUE_SIZE;
+      if (rand()&1) {
+        EXPECT_EQ(!gone[i],event_cancel(h[i]));
+        gone[i] = true;
+      } else {
+        EXPECT_EQ(!gone[i],event_reschedule(h[i],100+rand()%1000));
+      }
+    }
+    run_isr_at(2000);
+    events_dispatch();
+    EXPECT_FALSE(events_ready());
+    EXPECT_EQ(0,event_count);
+    std::vector<unsigned int> runs(EVENT_QUEUE_SIZE);
+    for (uintptr_t i : fired)
+      runs[i]++;
+    for (unsigned int i = 0; i < EVENT_QUEUE_SIZE; i++) {
+      EXPECT_LE(runs[i],1u);
+      EXPECT_FALSE(event_pending(h[i]));
+    }
+  }
+}
+
+TEST_F(events_deferred, statsCountLatenessPerHandler)
+{
+  enqueue_event_abs_flags(100,&record_event,NULL,EVENT_FLAG_ISR);
+  enqueue_event_abs_flags(100,&other_event,NULL,EVENT_FLAG_ISR);
+  enqueue_event_abs(100,&third_event,NULL);
+  enqueue_event_abs(100,&record_event,NULL);
+  EXPECT_EQ(4,events_stats.max_count);
+  // 100 ticks late: bucket 3 for shift 4 (64..127).
+  run_isr_at(200);
+  EXPECT_EQ(record_event,events_stats.handlers[0].handler);
+  EXPECT_EQ(1,events_stats.handlers[0].lateness[3]);
+  EXPECT_EQ(other_event,events_stats.handlers[1].handler);
+  EXPECT_EQ(1,events_stats.handlers[1].lateness[3]);
+  // deferred ones count when they run, with all of the delay.
+  set_time(0x10000);
+  events_dispatch();
+  // third_event is one too many and lands in the last entry.
+  EXPECT_EQ(NULL,events_stats.handlers[2].handler);
+  EXPECT_EQ(1,events_stats.handlers[2].lateness[EVENTS_STATS_BUCKETS-1]);
+  EXPECT_EQ(1,events_stats.handlers[0].lateness[EVENTS_STATS_BUCKETS-1]);
+  EXPECT_EQ(4,events_stats.max_count);
+}
+
+TEST_F(events_deferred, statsCountDropsAndLateTimers)
+{
+  for (unsigned int i = 0; i < EVENT_QUEUE_SIZE+2; i++)
+    enqueue_event_abs(1000,&record_event,NULL);
+  EXPECT_EQ(2,events_stats.dropped);
+  EXPECT_EQ(EVENT_QUEUE_SIZE,events_stats.max_count);
+  EXPECT_EQ(0,events_stats.past);
+  events_clear();
+  set_time(5000);
+  enqueue_event_abs(4000,&record_event,NULL);
+  EXPECT_EQ(1,events_stats.past);
+  run_isr_at(5100);
+  EXPECT_EQ(1,events_stats.past);
+}
+
+TEST_F(events_deferred, periodicReturnsToTheHeapWhenDispatched)
+{
+  event_handle_t h = enqueue_periodic(1000,&record_event,(void*)1);
+  run_isr_at(1200);
+  EXPECT_TRUE(events_ready());
+  EXPECT_EQ(0,event_count);
+  EXPECT_TRUE(event_pending(h));
+  set_time(1700);
+  EXPECT_TRUE(events_dispatch());
+  std::vector<uintptr_t> expected{1};
+  EXPECT_EQ(expected,fired);
+  EXPECT_FALSE(events_ready());
+  // due one period after its last time, not after the dispatch.
+  uint32_t next;
+  EXPECT_TRUE(events_next_time(&next));
+  EXPECT_EQ(2000u,next);
+  EXPECT_EQ(2000u,OCR1A);
+  run_isr_at(2000);
+  EXPECT_TRUE(stop_periodic(&h));
+  EXPECT_FALSE(events_ready());
+  EXPECT_FALSE(events_dispatch());
+}
+
+}
@@ -0,0 +1,179 @@
+#include <cstdint>
+#include <cstdlib>
+#include <vector>
+#include <avr/io.h>
+#include <avr/interrupt.h>
+#include <util/atomic.h>
+#include "timers.h"
+// the configuration of main.c: deferred dispatch and slots reserved for
+// the door events.
+namespace priority
+{
+#define EVENT_QUEUE_SIZE 16
+#define EVENT_QUEUE_RESERVED 3
+#define EVENTS_DEFERRED
+#include "events.c.h"
+}
+#include "gtest/gtest.h"
+namespace priority
+{
+
+std::vector<uintptr_t> fired;
+
+void record_event(void* param)
+{
+  fired.push_back((uintptr_t)param);
+}
+
+void set_time(uint32_t t)
+{
+  event_time_high = t >> 16;
+  TCNT1 = t & 0xffff;
+  TIFR1 = 0;
+}
+
+void run_isr_at(uint32_t t)
+{
+  set_time(t);
+  cli();
+  TIMER1_COMPA_vect();
+  sei();
+}
+
+class events_priority : public ::testing::Test
+{
+protected:
+  void SetUp() override
+  {
+    events_clear();
+    fired.clear();
+    set_time(0);
+    sei();
+  }
+};
+
+TEST_F(events_priority, reservedSlotsAreLeftForHighPriority)
+{
+  unsigned int low = 0;
+  while (enqueue_event_abs(1000,&record_event,NULL))
+    low++;
+  EXPECT_EQ(EVENT_QUEUE_SIZE-EVENT_QUEUE_RESERVED,low);
+  for (unsigned int i = 0; i < EVENT_QUEUE_RESERVED; i++) {
+    EXPECT_TRUE(enqueue_event_abs_flags(2000,&record_event,NULL,EVENT_FLAG_HIGH));
+  }
+  EXPECT_FALSE(enqueue_event_abs_flags(2000,&record_event,NULL,EVENT_FLAG_HIGH));
+  EXPECT_EQ(EVENT_QUEUE_RESERVED,event_high_count);
+  // high priority events can also take the unreserved slots.
+  events_clear();
+  EXPECT_EQ(0,event_high_count);
+  for (unsigned int i = 0; i < EVENT_QUEUE_SIZE; i++) {
+    EXPECT_TRUE(enqueue_event_abs_flags(2000,&record_event,NULL,EVENT_FLAG_HIGH));
+  }
+  EXPECT_FALSE(enqueue_event_abs(1000,&record_event,NULL));
+}
+
+TEST_F(events_priority, highPriorityRunsFirstWhenDue)
+{
+  enqueue_event_abs_flags(100,&record_event,(void*)1,EVENT_FLAG_ISR);
+  enqueue_event_abs_flags(110,&record_event,(void*)2,EVENT_FLAG_ISR);
+  enqueue_event_abs_flags(120,&record_event,(void*)3,EVENT_FLAG_ISR|EVENT_FLAG_HIGH);
+  enqueue_event_abs_flags(130,&record_event,(void*)4,EVENT_FLAG_ISR);
+  enqueue_event_abs_flags(200,&record_event,(void*)5,EVENT_FLAG_ISR|EVENT_FLAG_HIGH);
+  enqueue_event_abs(105,&record_event,(void*)6);
+  enqueue_event_abs_flags(115,&record_event,(void*)7,EVENT_FLAG_HIGH);
+  run_isr_at(150);
+  std::vector<uintptr_t> expected{3,1,2,4};
+  EXPECT_EQ(expected,fired);
+  EXPECT_TRUE(events_dispatch());
+  expected = {3,1,2,4,7,6};
+  EXPECT_EQ(expected,fired);
+  EXPECT_EQ(1,event_high_count);
+  run_isr_at(200);
+  EXPECT_EQ(0,event_high_count);
+}
+
+TEST_F(events_priority, requeueMovesBetweenClasses)
+{
+  event_handle_t h = EVENT_HANDLE_NONE;
+  EXPECT_TRUE(requeue_event_rel_flags(&h,100,&record_event,NULL,EVENT_FLAG_HIGH));
+  EXPECT_EQ(1,event_high_count);
+  EXPECT_TRUE(requeue_event_rel(&h,100,&record_event,NULL));
+  EXPECT_EQ(0,event_high_count);
+  EXPECT_TRUE(requeue_event_rel_flags(&h,100,&record_event,NULL,EVENT_FLAG_HIGH));
+  EXPECT_TRUE(event_cancel(h));
+  EXPECT_EQ(0,event_high_count);
+}
+
+/*
+  Stress test: the melody, the display and a flood of deferred events keep
+  the queue full, while door-like events are armed and re-armed all the
+  time. Every door event must get a slot and run no later than the
+  interrupt latency, and before any due low priority handler.
+*/
+const uint32_t max_latency = 300;
+event_handle_t motor_handle, beep_handle, osc_handle, segment_handle;
+uint32_t motor_due;
+unsigned int motor_runs, motor_misses, low_runs;
+bool low_ran_in_this_isr;
+
+void motor_event(void* param)
+{
+  motor_runs++;
+  uint32_t late = get_time()-motor_due;
+  if (late > max_latency || low_ran_in_this_isr)
+    motor_misses++;
+}
+
+void music_event(void* param)
+{
+  low_runs++;
+  low_ran_in_this_isr = true;
+}
+
+void flood_event(void* param)
+{
+  low_runs++;
+}
+
+TEST_F(events_priority, motorEventsNeverMissUnderLoad)
+{
+  srand(5);
+  motor_handle = EVENT_HANDLE_NONE;
+  motor_runs = motor_misses = low_runs = 0;
+  beep_handle = enqueue_periodic_flags(1136,&music_event,NULL,EVENT_FLAG_ISR);
+  osc_handle = enqueue_periodic_flags(757,&music_event,NULL,EVENT_FLAG_ISR);
+  segment_handle = enqueue_periodic_flags(16000,&music_event,NULL,EVENT_FLAG_ISR);
+  unsigned int armed = 0, dropped = 0;
+  uint32_t now = 0;
+  for (unsigned int step = 0; step < 200000; step++) {
+    // keep the queue full of low priority events.
+    while (enqueue_event_abs(now+100+rand()%50000,&flood_event,NULL)) {
+    }
+    dropped++;
+    if (rand()%8 == 0) {
+      uint32_t delay = 50+rand()%20000;
+      bool was_pending = event_pending(motor_handle);
+      ASSERT_TRUE(requeue_event_rel_flags(&motor_handle,delay,&motor_event,NULL,
+                                          EVENT_FLAG_ISR|EVENT_FLAG_HIGH));
+      motor_due = now+delay;
+      if (!was_pending)
+        armed++;
+    }
+    uint32_t next;
+    ASSERT_TRUE(events_next_time(&next));
+    if (gteq_mod32(now,next))
+      next = now;
+    now = next+rand()%(max_latency+1);
+    low_ran_in_this_isr = false;
+    run_isr_at(now);
+    events_dispatch();
+  }
+  EXPECT_GT(armed,1000u);
+  EXPECT_GE(motor_runs+1,armed);
+  EXPECT_LE(motor_runs,armed);
+  EXPECT_EQ(0u,motor_misses);
+  EXPECT_GT(low_runs,100000u);
+  EXPECT_GT(dropped,100000u);
+}
+
+}
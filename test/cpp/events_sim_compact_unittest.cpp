@@ -0,0 +1,7 @@
+// events_sim_unittest.cpp with the compact slots of EVENTS_COMPACT, with
+// enough long records for all the far events the random run makes.
+#define EVENTS_SIM sim_compact
+#define EVENTS_SIM_TEST events_sim_compact
+#define EVENTS_COMPACT
+#define EVENTS_LONG_SIZE 15
+#include "events_sim_unittest.cpp"
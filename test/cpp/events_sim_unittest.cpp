@@ -0,0 +1,363 @@
+/*
+  Runs events.c.h against the virtual-time model of Timer 1 in
+  fakeheader/fake_timer1.h: the compare interrupt fires by itself when the
+  simulated timer gets to OCR1A, and the timer runs on while the code does.
+  With prescaler 1, a tick is a cycle.
+  events_sim_compact_unittest.cpp runs the same tests with EVENTS_COMPACT.
+*/
+#ifndef EVENTS_SIM
+#define EVENTS_SIM sim
+#define EVENTS_SIM_TEST events_sim
+#endif
+#define FAKE_TIMER1_SIM
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <map>
+#include <vector>
+#include <avr/io.h>
+#include <avr/interrupt.h>
+#include <util/atomic.h>
+#include "timers.h"
+namespace EVENTS_SIM
+{
+#define EVENT_QUEUE_SIZE 16
+#include "events.c.h"
+}
+#include "gtest/gtest.h"
+namespace EVENTS_SIM
+{
+
+// the time the firmware should see, tracked apart from its own clock.
+uint32_t time_offset;
+
+uint32_t true_time()
+{
+  return time_offset+(uint32_t)fake_timer1.cycles;
+}
+
+// events_before() without its simulated cost.
+bool sim_before(uint32_t x, uint32_t y)
+{
+  return (int32_t)(x-y) < 0;
+}
+
+class EVENTS_SIM_TEST : public ::testing::Test
+{
+protected:
+  void SetUp() override
+  {
+    fake_timer1.reset();
+    fake_timer1.compa_vect = &TIMER1_COMPA_vect;
+    fake_irq_hook = &fake_timer1_irq;
+    cli();
+    events_start(TIMER_SCALE_1);
+    event_time_top = 0;
+    sei();
+  }
+  void TearDown() override
+  {
+    fake_irq_hook = nullptr;
+    cli();
+    events_stop();
+    sei();
+  }
+
+  // starts the clock at t.
+  void set_time(uint32_t t)
+  {
+    cli();
+    fake_timer1.tcnt = t & 0xffff;
+    fake_timer1.tifr = 0;
+    event_time_high = t >> 16;
+    time_offset = t-(uint32_t)fake_timer1.cycles;
+    sei();
+  }
+};
+
+TEST_F(EVENTS_SIM_TEST, timerModelCountsLikeTheHardware)
+{
+  cli();
+  fake_timer1.tcnt = 0xfff0;
+  fake_timer1.ocra = 0xfff8;
+  fake_timer1.tifr = 0;
+  // the flag is set at the timer clock after TCNT1 matched.
+  EXPECT_EQ(9u,fake_timer1.cycles_to_compare());
+  fake_timer1.work(8);
+  EXPECT_EQ(0,fake_timer1.tifr);
+  fake_timer1.work(1);
+  EXPECT_EQ(0xfff9,fake_timer1.tcnt);
+  EXPECT_EQ(1 << OCF1A,fake_timer1.tifr);
+  fake_timer1.work(6);
+  EXPECT_EQ(1 << OCF1A,fake_timer1.tifr);
+  fake_timer1.work(1);
+  EXPECT_EQ(0,fake_timer1.tcnt);
+  EXPECT_EQ((1 << OCF1A)|(1 << TOV1),fake_timer1.tifr);
+  // writing a one clears a flag, reading takes a cycle.
+  uint64_t start = fake_timer1.cycles;
+  TIFR1 = 1 << TOV1;
+  EXPECT_EQ(1 << OCF1A,TIFR1);
+  EXPECT_EQ(start+2,fake_timer1.cycles);
+  // no match right after writing the compare value to TCNT1.
+  fake_timer1.tifr = 0;
+  fake_timer1.ocra = 0x100;
+  TCNT1 = 0x100;
+  EXPECT_EQ(0x104,fake_timer1.tcnt);
+  EXPECT_EQ(0,fake_timer1.tifr);
+  fake_timer1.work(0x10000);
+  EXPECT_EQ(1 << OCF1A,fake_timer1.tifr & (1 << OCF1A));
+  // the prescaler.
+  fake_timer1.tccrb = TIMER_SCALE_DIV_8;
+  fake_timer1.tcnt = 0;
+  fake_timer1.phase = 0;
+  fake_timer1.work(8*100+7);
+  EXPECT_EQ(100,fake_timer1.tcnt);
+  fake_timer1.tccrb = TIMER_SCALE_STOPPED;
+  fake_timer1.work(1000);
+  EXPECT_EQ(100,fake_timer1.tcnt);
+  sei();
+}
+
+TEST_F(EVENTS_SIM_TEST, getTimeSurvivesTheOverflowRace)
+{
+  // get_time() must return a time between the start and the end of its
+  // call, wherever the overflow falls.
+  for (uint16_t k = 0; k < 80; k++) {
+    for (int pending = 0; pending < 2; pending++) {
+      cli();
+      event_time_high = 0x1234;
+      fake_timer1.tcnt = pending ? k : 0xffff-k;
+      fake_timer1.tifr = pending ? 1 << TOV1 : 0;
+      uint32_t h = pending ? 0x1235 : 0x1234;
+      time_offset = (h << 16 | fake_timer1.tcnt)-(uint32_t)fake_timer1.cycles;
+      uint32_t t0 = true_time();
+      uint32_t t = get_time_sync();
+      uint32_t after = true_time();
+      sei();
+      EXPECT_FALSE(sim_before(t,t0)) << "k=" << k << " pending=" << pending;
+      EXPECT_FALSE(sim_before(after,t)) << "k=" << k << " pending=" << pending;
+    }
+  }
+}
+
+/*
+  The randomized run: a model of which events should be pending, checked
+  by the handlers as the simulated compare interrupt calls them.
+*/
+struct sim_event {
+  uint32_t due;
+  uint32_t ready; // the later of due and the time it was enqueued.
+  event_handle_t handle;
+  bool other;
+};
+std::map<uintptr_t,sim_event> pending;
+uintptr_t next_id;
+const uint32_t max_lateness = 5000;
+
+struct sim_report {
+  uint64_t fired, order_violations, early, missed, phantom, max_late;
+  uint64_t late_buckets[8]; // < 2^(6+i) cycles, the last for the rest.
+} report;
+
+struct op_cost {
+  const char *name;
+  uint64_t count, total, max;
+  void add(uint64_t c) {
+    count++;
+    total += c;
+    if (c > max)
+      max = c;
+  }
+};
+
+void sim_handler(void* param);
+void sim_other_handler(void* param);
+
+// enqueues a new event at time due. The model comes first, as the event
+// may fire before enqueue_event_abs() returns.
+void sim_enqueue(uint32_t due, bool other)
+{
+  uintptr_t id = next_id++;
+  uint32_t now = true_time();
+  // one enqueued in the past is due right away.
+  pending[id] = sim_event{due,sim_before(due,now) ? now : due,EVENT_HANDLE_NONE,other};
+  event_handle_t h = enqueue_event_abs(due,other ? &sim_other_handler : &sim_handler,(void*)id);
+  auto it = pending.find(id);
+  if (it == pending.end())
+    return;
+  if (h == EVENT_HANDLE_NONE)
+    pending.erase(it);
+  else
+    it->second.handle = h;
+}
+
+void sim_handler(void* param)
+{
+  uint32_t now = true_time();
+  auto it = pending.find((uintptr_t)param);
+  if (it == pending.end()) {
+    report.phantom++;
+    return;
+  }
+  uint32_t due = it->second.due, ready = it->second.ready;
+  pending.erase(it);
+  report.fired++;
+  if (sim_before(now,due))
+    report.early++;
+  for (auto& p : pending) {
+    // those on their way into or out of the queue don't count.
+    if (p.second.handle != EVENT_HANDLE_NONE &&
+        sim_before(p.second.due,due) && !sim_before(now,p.second.due)) {
+      report.order_violations++;
+      break;
+    }
+  }
+  uint32_t late = now-ready;
+  if (!sim_before(now,ready)) {
+    if (late > report.max_late)
+      report.max_late = late;
+    if (late > max_lateness)
+      report.missed++;
+    uint8_t b = 0;
+    for (late >>= 6; late != 0 && b < 7; late >>= 1)
+      b++;
+    report.late_buckets[b]++;
+  }
+  // some handlers schedule the next event themselves.
+  if (rand()%4 == 0)
+    sim_enqueue(now+rand()%50000,false);
+  fake_timer1.work(20);
+}
+
+void sim_other_handler(void* param)
+{
+  sim_handler(param);
+}
+
+#ifdef EVENTS_COMPACT
+const event_handler_fun_t events_handlers[] PROGMEM = {
+  EVENTS_BUILTIN_HANDLERS &sim_handler, &sim_other_handler, NULL
+};
+#endif
+
+// a random event in the model, or pending.end().
+std::map<uintptr_t,sim_event>::iterator random_pending()
+{
+  if (pending.empty())
+    return pending.end();
+  auto it = pending.lower_bound(next_id-rand()%(next_id+1));
+  return it == pending.end() ? pending.begin() : it;
+}
+
+TEST_F(EVENTS_SIM_TEST, randomOperationsAcrossWraparound)
+{
+  srand(9);
+  pending.clear();
+  next_id = 0;
+  report = sim_report();
+  op_cost costs[] = {{"enqueue"},{"cancel"},{"reschedule"},{"dequeue"},{"get_time"}};
+  const unsigned long operations = 2000000;
+  uint32_t start = 0xfff00000u;
+  set_time(start);
+  uint64_t last_time64 = get_time64();
+  unsigned int wraps = 0;
+  uint32_t last = start;
+  for (unsigned long n = 0; n < operations; n++) {
+    int op = rand()%100;
+    uint64_t c0 = fake_timer1.cycles, i0 = fake_timer1.isr_cycles;
+    int kind = -1;
+    if (op < 30) {
+      kind = 0;
+      uint32_t now = true_time();
+      int r = rand()%10;
+      uint32_t due = r < 7 ? now+rand()%100000 : r < 9 ? now+rand()%200 : now-rand()%100;
+      sim_enqueue(due,rand()%8 == 0);
+    } else if (op < 40) {
+      auto it = random_pending();
+      if (it != pending.end()) {
+        kind = 1;
+        uintptr_t id = it->first;
+        event_handle_t h = it->second.handle;
+        it->second.handle = EVENT_HANDLE_NONE;
+        bool res = event_cancel(h);
+        // the event may have fired in between.
+        it = pending.find(id);
+        if (it != pending.end()) {
+          EXPECT_TRUE(res);
+          pending.erase(it);
+        }
+      }
+    } else if (op < 50) {
+      auto it = random_pending();
+      if (it != pending.end()) {
+        kind = 2;
+        // may fire right away, with the new time.
+        it->second.due = it->second.ready = true_time()+rand()%100000;
+        EXPECT_TRUE(event_reschedule(it->second.handle,it->second.due));
+      }
+    } else if (op < 51) {
+      kind = 3;
+      for (auto& p : pending) {
+        if (p.second.other)
+          p.second.handle = EVENT_HANDLE_NONE;
+      }
+      dequeue_events(&sim_other_handler);
+      for (auto it = pending.begin(); it != pending.end();) {
+        if (it->second.other)
+          it = pending.erase(it);
+        else
+          ++it;
+      }
+    } else if (op < 56) {
+      kind = 4;
+      uint32_t t0 = true_time();
+      uint32_t t = get_time();
+      uint32_t after = true_time();
+      EXPECT_FALSE(sim_before(t,t0));
+      EXPECT_FALSE(sim_before(after,t));
+      uint64_t t64 = get_time64();
+      EXPECT_GE(t64,last_time64);
+      last_time64 = t64;
+    } else {
+      fake_timer1.run(rand()%3000);
+    }
+    if (kind >= 0)
+      costs[kind].add((fake_timer1.cycles-c0)-(fake_timer1.isr_cycles-i0));
+    uint32_t now = true_time();
+    if (now < last)
+      wraps++;
+    last = now;
+  }
+  // let everything left fire.
+  fake_timer1.run(200000);
+  report.missed += pending.size();
+
+  printf("simulated %lu operations in %.3g cycles, %u wraps of the 32 bit clock\n",
+         operations,(double)fake_timer1.cycles,wraps);
+  printf("fired %llu, order violations %llu, early %llu, missed %llu, phantom %llu,"
+         " max lateness %llu cycles\n",
+         (unsigned long long)report.fired,(unsigned long long)report.order_violations,
+         (unsigned long long)report.early,(unsigned long long)report.missed,
+         (unsigned long long)report.phantom,(unsigned long long)report.max_late);
+  printf("lateness <64..<8192 cycles, more:");
+  for (uint64_t b : report.late_buckets)
+    printf(" %llu",(unsigned long long)b);
+  printf("\n%-12s %9s %8s %8s  (simulated cycles)\n","operation","count","mean","max");
+  for (op_cost& c : costs) {
+    printf("%-12s %9llu %8.1f %8llu\n",c.name,(unsigned long long)c.count,
+           c.count ? (double)c.total/c.count : 0.0,(unsigned long long)c.max);
+  }
+  printf("%-12s %9llu %8.1f %8llu\n","compare isr",(unsigned long long)fake_timer1.isr_count,
+         (double)fake_timer1.isr_cycles/fake_timer1.isr_count,
+         (unsigned long long)fake_timer1.isr_max);
+
+  EXPECT_GE(wraps,1u);
+  EXPECT_GT(report.fired,400000u);
+  EXPECT_EQ(0u,report.order_violations);
+  EXPECT_EQ(0u,report.early);
+  EXPECT_EQ(0u,report.missed);
+  EXPECT_EQ(0u,report.phantom);
+  EXPECT_EQ(0,event_count);
+}
+
+}
@@ -0,0 +1,387 @@
+#include <cstdint>
+#include <cstdlib>
+#include <vector>
+#include <avr/io.h>
+#include <avr/interrupt.h>
+#include <util/atomic.h>
+#include "timers.h"
+#define EVENT_QUEUE_SIZE 16
+#include "events.c.h"
+// the LED of main.c for led_blink.h.
+unsigned led_toggles;
+bool led_on;
+#define LEDS_LED1 1
+#define LEDs_ToggleLEDs(mask) (led_toggles++, led_on = !led_on)
+#define LEDs_TurnOffLEDs(mask) (led_on = false)
+#define LED_BLINK_PERIOD 1000
+#include "led_blink.h"
+#include "gtest/gtest.h"
+namespace
+{
+
+std::vector<uintptr_t> fired;
+
+void record_event(void* param)
+{
+  fired.push_back((uintptr_t)param);
+}
+
+void other_event(void* param)
+{
+  fired.push_back(1000+(uintptr_t)param);
+}
+
+void set_time(uint32_t t)
+{
+  event_time_high = t >> 16;
+  TCNT1 = t & 0xffff;
+  TIFR1 = 0;
+}
+
+// runs the compare ISR at time t, as the hardware would.
+void run_isr_at(uint32_t t)
+{
+  set_time(t);
+  cli();
+  TIMER1_COMPA_vect();
+  sei();
+}
+
+class events : public ::testing::Test
+{
+protected:
+  void SetUp() override
+  {
+    events_clear();
+    fired.clear();
+    event_time_top = 0;
+    set_time(0);
+    sei();
+  }
+};
+
+TEST_F(events, dispatchesInTimeOrder)
+{
+  srand(1);
+  uint32_t times[EVENT_QUEUE_SIZE];
+  for (unsigned int i = 0; i < EVENT_QUEUE_SIZE; i++) {
+    times[i] = 100+rand()%100000;
+    EXPECT_TRUE(enqueue_event_abs(times[i],&record_event,(void*)(uintptr_t)i));
+  }
+  EXPECT_FALSE(enqueue_event_abs(5,&record_event,NULL));
+  run_isr_at(200000);
+  ASSERT_EQ(EVENT_QUEUE_SIZE,fired.size());
+  for (unsigned int i = 1; i < fired.size(); i++) {
+    EXPECT_LE(times[fired[i-1]],times[fired[i]]);
+  }
+  EXPECT_EQ(0,event_count);
+}
+
+TEST_F(events, onlyDueEventsFire)
+{
+  enqueue_event_abs(300,&record_event,(void*)3);
+  enqueue_event_abs(100,&record_event,(void*)1);
+  enqueue_event_abs(200,&record_event,(void*)2);
+  EXPECT_EQ(100u,OCR1A);
+  run_isr_at(250);
+  ASSERT_EQ(2u,fired.size());
+  EXPECT_EQ(1u,fired[0]);
+  EXPECT_EQ(2u,fired[1]);
+  EXPECT_EQ(300u,OCR1A);
+  run_isr_at(300);
+  ASSERT_EQ(3u,fired.size());
+  EXPECT_EQ(3u,fired[2]);
+}
+
+TEST_F(events, ordersAcrossWraparound)
+{
+  uint32_t start = 0xffff0000u;
+  set_time(start);
+  enqueue_event_rel(0x20000,&record_event,(void*)2);
+  enqueue_event_rel(0x8000,&record_event,(void*)1);
+  enqueue_event_rel(0x30000,&record_event,(void*)3);
+  run_isr_at(start+0x28000);
+  ASSERT_EQ(2u,fired.size());
+  EXPECT_EQ(1u,fired[0]);
+  EXPECT_EQ(2u,fired[1]);
+  run_isr_at(start+0x30000);
+  ASSERT_EQ(3u,fired.size());
+}
+
+TEST_F(events, dequeueKeepsTheRest)
+{
+  for (unsigned int i = 0; i < 10; i++) {
+    enqueue_event_abs(1000-i*10,(i&1)?&other_event:&record_event,
+                      (void*)(uintptr_t)i);
+  }
+  EXPECT_TRUE(dequeue_events(&other_event));
+  EXPECT_FALSE(dequeue_events(&other_event));
+  EXPECT_EQ(5,event_count);
+  EXPECT_EQ(920u,OCR1A);
+  run_isr_at(2000);
+  std::vector<uintptr_t> expected{8,6,4,2,0};
+  EXPECT_EQ(expected,fired);
+}
+
+TEST_F(events, cancelByHandle)
+{
+  event_handle_t h[5];
+  for (unsigned int i = 0; i < 5; i++) {
+    h[i] = enqueue_event_abs(100+i*100,&record_event,(void*)(uintptr_t)i);
+    EXPECT_NE(EVENT_HANDLE_NONE,h[i]);
+  }
+  EXPECT_TRUE(event_cancel(h[2]));
+  EXPECT_FALSE(event_cancel(h[2]));
+  EXPECT_FALSE(event_pending(h[2]));
+  EXPECT_TRUE(event_cancel(h[0]));
+  EXPECT_EQ(200u,OCR1A);
+  EXPECT_EQ(3,event_count);
+  run_isr_at(1000);
+  std::vector<uintptr_t> expected{1,3,4};
+  EXPECT_EQ(expected,fired);
+}
+
+TEST_F(events, rescheduleByHandle)
+{
+  event_handle_t a = enqueue_event_abs(100,&record_event,(void*)1);
+  event_handle_t b = enqueue_event_abs(200,&record_event,(void*)2);
+  EXPECT_TRUE(event_reschedule(a,300));
+  EXPECT_EQ(200u,OCR1A);
+  EXPECT_TRUE(event_reschedule(b,50));
+  EXPECT_EQ(50u,OCR1A);
+  run_isr_at(250);
+  ASSERT_EQ(1u,fired.size());
+  EXPECT_EQ(2u,fired[0]);
+  EXPECT_FALSE(event_pending(b));
+  EXPECT_TRUE(event_pending(a));
+}
+
+TEST_F(events, staleHandleAfterFire)
+{
+  event_handle_t a = enqueue_event_abs(100,&record_event,(void*)1);
+  run_isr_at(100);
+  // the slot is reused by the next event, but the old handle must not match.
+  event_handle_t b = enqueue_event_abs(200,&record_event,(void*)2);
+  EXPECT_EQ(event_handle_slot(a),event_handle_slot(b));
+  EXPECT_NE(a,b);
+  EXPECT_FALSE(event_cancel(a));
+  EXPECT_FALSE(event_reschedule(a,300));
+  EXPECT_TRUE(event_pending(b));
+  EXPECT_FALSE(event_cancel(EVENT_HANDLE_NONE));
+}
+
+TEST_F(events, requeueKeepsOneEvent)
+{
+  event_handle_t h = EVENT_HANDLE_NONE;
+  EXPECT_TRUE(requeue_event_rel(&h,100,&record_event,(void*)1));
+  event_handle_t first = h;
+  EXPECT_TRUE(requeue_event_rel(&h,300,&other_event,(void*)2));
+  EXPECT_EQ(first,h);
+  EXPECT_EQ(1,event_count);
+  EXPECT_EQ(300u,OCR1A);
+  run_isr_at(300);
+  std::vector<uintptr_t> expected{1002};
+  EXPECT_EQ(expected,fired);
+  EXPECT_TRUE(requeue_event_rel(&h,100,&record_event,(void*)3));
+  EXPECT_NE(first,h);
+  EXPECT_TRUE(event_pending(h));
+}
+
+TEST_F(events, randomCancelKeepsOrder)
+{
+  srand(2);
+  event_handle_t h[EVENT_QUEUE_SIZE];
+  uint32_t times[EVENT_QUEUE_SIZE];
+  for (unsigned int round = 0; round < 200; round++) {
+    events_clear();
+    fired.clear();
+    for (unsigned int i = 0; i < EVENT_QUEUE_SIZE; i++) {
+      times[i] = 100+rand()%100000;
+      h[i] = enqueue_event_abs(times[i],&record_event,(void*)(uintptr_t)i);
+    }
+    std::vector<bool> cancelled(EVENT_QUEUE_SIZE);
+    for (unsigned int k = 0; k < EVENT_QUEUE_SIZE/2; k++) {
+      unsigned int i = rand()%EVENT_QUEUE_SIZE;
+      if (rand()&1) {
+        EXPECT_EQ(!cancelled[i],event_cancel(h[i]));
+        cancelled[i] = true;
+      } else if (!cancelled[i]) {
+        times[i] = 100+rand()%100000;
+        EXPECT_TRUE(event_reschedule(h[i],times[i]));
+      }
+    }
+    run_isr_at(200000);
+    unsigned int expected_count = 0;
+    for (unsigned int i = 0; i < EVENT_QUEUE_SIZE; i++)
+      expected_count += !cancelled[i];
+    ASSERT_EQ(expected_count,fired.size());
+    for (unsigned int i = 0; i < fired.size(); i++) {
+      EXPECT_FALSE(cancelled[fired[i]]);
+      if (i > 0) {
+        EXPECT_LE(times[fired[i-1]],times[fired[i]]);
+      }
+    }
+  }
+}
+
+TEST_F(events, advanceTimeCatchesUp)
+{
+  enqueue_event_abs(1000,&record_event,(void*)1);
+  enqueue_event_abs(100000,&record_event,(void*)2);
+  set_time(500);
+  cli();
+  events_advance_time(0x12000);
+  sei();
+  EXPECT_EQ(0x12000u+500,get_time());
+  // the first event is in the past now, so it fires right away.
+  EXPECT_TRUE(gteq_mod16(OCR1A-(uint16_t)get_time(),0));
+  run_isr_at(get_time()+100);
+  std::vector<uintptr_t> expected{1};
+  EXPECT_EQ(expected,fired);
+  uint32_t next;
+  EXPECT_TRUE(events_next_time(&next));
+  EXPECT_EQ(100000u,next);
+}
+
+event_handle_t periodic;
+
+void stop_after_three(void* param)
+{
+  fired.push_back((uintptr_t)param);
+  if (fired.size() == 3)
+    stop_periodic(&periodic);
+}
+
+TEST_F(events, periodicKeepsItsPhase)
+{
+  periodic = enqueue_periodic(1000,&record_event,(void*)1);
+  enqueue_event_abs(1500,&record_event,(void*)2);
+  EXPECT_EQ(1000u,OCR1A);
+  // a late run doesn't move the following ones.
+  run_isr_at(1300);
+  EXPECT_EQ(1500u,OCR1A);
+  run_isr_at(1500);
+  EXPECT_EQ(2000u,OCR1A);
+  run_isr_at(2000);
+  // runs every missed period.
+  run_isr_at(4100);
+  std::vector<uintptr_t> expected{1,2,1,1,1};
+  EXPECT_EQ(expected,fired);
+  EXPECT_EQ(1,event_count);
+  EXPECT_TRUE(event_pending(periodic));
+  EXPECT_EQ(5000u,OCR1A);
+  EXPECT_TRUE(stop_periodic(&periodic));
+  EXPECT_EQ(EVENT_HANDLE_NONE,periodic);
+  EXPECT_EQ(0,event_count);
+}
+
+TEST_F(events, periodicStopsFromItsHandler)
+{
+  periodic = enqueue_periodic(100,&stop_after_three,(void*)1);
+  event_handle_t first = periodic;
+  for (uint32_t t = 100; t <= 1000; t += 100)
+    run_isr_at(t);
+  EXPECT_EQ(3u,fired.size());
+  EXPECT_EQ(EVENT_HANDLE_NONE,periodic);
+  EXPECT_EQ(0,event_count);
+  // the old handle doesn't match the next event in the same slot.
+  event_handle_t h = enqueue_event_abs(2000,&record_event,(void*)2);
+  EXPECT_EQ(event_handle_slot(first),event_handle_slot(h));
+  EXPECT_FALSE(event_cancel(first));
+  EXPECT_TRUE(event_pending(h));
+}
+
+TEST_F(events, blinkTogglesTwicePerBlink)
+{
+  led_blink_handle = EVENT_HANDLE_NONE;
+  led_toggles = 0;
+  led_blink(3);
+  for (uint32_t t = 1000; t <= 10000; t += 1000)
+    run_isr_at(t);
+  EXPECT_EQ(6u,led_toggles);
+  EXPECT_FALSE(led_on);
+  EXPECT_EQ(EVENT_HANDLE_NONE,led_blink_handle);
+  EXPECT_EQ(0,event_count);
+}
+
+// !f0 and !f
+TEST_F(events, blinkZeroTimesStaysOff)
+{
+  led_blink_handle = EVENT_HANDLE_NONE;
+  led_toggles = 0;
+  led_blink(0);
+  EXPECT_EQ(0,event_count);
+  // and stops a running blink.
+  led_blink(2);
+  run_isr_at(1000);
+  EXPECT_TRUE(led_on);
+  led_blink(0);
+  EXPECT_FALSE(led_on);
+  EXPECT_EQ(EVENT_HANDLE_NONE,led_blink_handle);
+  EXPECT_EQ(0,event_count);
+  for (uint32_t t = 2000; t <= 5000; t += 1000)
+    run_isr_at(t);
+  EXPECT_EQ(1u,led_toggles);
+}
+
+TEST_F(events, blinkCountIsClamped)
+{
+  led_blink_handle = EVENT_HANDLE_NONE;
+  led_blink(0x10000);
+  EXPECT_EQ(2*LED_BLINK_MAX-1,led_blink_count);
+  EXPECT_TRUE(stop_periodic(&led_blink_handle));
+}
+
+TEST_F(events, clock64CarriesAcrossWrap)
+{
+  // an overflow pending at the wrap of event_time_high.
+  set_time(0xfffffff0u);
+  TCNT1 = 5;
+  TIFR1 = 1 << TOV1;
+  EXPECT_EQ(0x100000005ull,get_time64());
+  EXPECT_EQ(0x10000u,get_time_coarse());
+  // and when moving the clock forward.
+  set_time(0xffffff00u);
+  cli();
+  events_advance_time(0x200);
+  sei();
+  EXPECT_EQ(0x200000100ull,get_time64());
+}
+
+TEST_F(events, longTimeoutSurvivesWraps)
+{
+  const uint64_t ticks = (5ull << 32)+123;
+  set_time(0x80000000u);
+  uint64_t start = get_time64();
+  event_timeout_t t;
+  t.handle = EVENT_HANDLE_NONE;
+  EXPECT_TRUE(event_timeout_start(&t,ticks,&record_event,(void*)7));
+  unsigned int hops = 0;
+  uint32_t next;
+  while (fired.empty() && events_next_time(&next)) {
+    cli();
+    events_advance_time(next-get_time_sync());
+    TIMER1_COMPA_vect();
+    sei();
+    hops++;
+  }
+  std::vector<uintptr_t> expected{7};
+  EXPECT_EQ(expected,fired);
+  EXPECT_EQ(start+ticks,get_time64());
+  EXPECT_EQ(21u,hops);
+  EXPECT_EQ(0,event_count);
+  EXPECT_FALSE(event_timeout_cancel(&t));
+}
+
+TEST_F(events, longTimeoutCanBeCancelled)
+{
+  event_timeout_t t;
+  t.handle = EVENT_HANDLE_NONE;
+  EXPECT_TRUE(event_timeout_start(&t,1ull << 40,&record_event,(void*)1));
+  EXPECT_TRUE(event_timeout_start(&t,1ull << 33,&record_event,(void*)2));
+  EXPECT_EQ(1,event_count);
+  EXPECT_TRUE(event_timeout_cancel(&t));
+  EXPECT_EQ(0,event_count);
+}
+
+}
@@ -0,0 +1,96 @@
+/*
+  Host benchmark of numconv.h against the snprintl() and hex2int() it
+  replaces, over all int16 values, as the ADC readings are.
+  The host divides by constants with a multiplication anyway, so this shows
+  little of what the AVR gains, and mostly guards against regressions.
+*/
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include "numconv.h"
+
+// the old ones from main.c.
+static bool snprintl(char* s, int len, int32_t value) {
+  bool positive = value >= 0;
+  bool ok = 1;
+  uint32_t val;
+  if (positive) {
+    val = value;
+  } else {
+    val = (uint32_t)(-value);
+  }
+  int i = 0;
+  while (i < len && val != 0) {
+    char v0 = val % 10;
+    val /= 10;
+    s[len-1-i] = '0'+v0;
+    i++;
+  }
+  if (i == 0) {
+    s[len-1] = '0';
+    i++;
+  }
+  if (!positive) {
+    if (i == len-1) {
+      i--;
+      ok = 0;
+    }
+    s[len-1-i] = '-';
+  }
+  if (val != 0) {
+    ok = 0;
+  }
+  while (i < len) {
+    s[len-1-i] = ' ';
+    i++;
+  }
+  return ok;
+}
+
+static uint32_t hex2int(const char* s) {
+  uint32_t res = 0;
+  for (int i = 0; s[i] != 0 && i < 20; i++) {
+    char c = s[i];
+    char v = c-'0';
+    if (v > 9) v = c-'A'+10;
+    if (v > 15) v = c-'a'+10;
+    if (v > 15 || v < 0) v = 0;
+    res <<= 4;
+    res |= v;
+  }
+  return res;
+}
+
+static const int rounds = 100;
+static volatile uint32_t sink;
+
+// runs f over all int16 values rounds times, returns ns per call.
+template<typename F>
+static double measure(F f)
+{
+  auto start = std::chrono::steady_clock::now();
+  for (int r = 0; r < rounds; r++)
+    for (int32_t v = -0x8000; v < 0x8000; v++)
+      f(v);
+  std::chrono::duration<double,std::nano> t = std::chrono::steady_clock::now()-start;
+  return t.count()/rounds/0x10000;
+}
+
+int main()
+{
+  char s[12];
+  printf("snprintl   %6.2f ns\n",measure([&](int32_t v) { snprintl(s,6,v); sink += s[5]; }));
+  printf("fmt_dec    %6.2f ns\n",measure([&](int32_t v) { fmt_dec(s,6,v); sink += s[5]; }));
+  printf("fmt_dec 32 %6.2f ns (values * 65537)\n",
+         measure([&](int32_t v) { fmt_dec(s,11,(int32_t)((uint32_t)v*65537u)); sink += s[10]; }));
+  char hex[0x10000][5];
+  for (int32_t v = 0; v < 0x10000; v++)
+    fmt_hex(v,hex[v],4);
+  printf("hex2int    %6.2f ns\n",measure([&](int32_t v) { sink += hex2int(hex[v & 0xffff]); }));
+  printf("parse_hex  %6.2f ns\n",measure([&](int32_t v) {
+    uint32_t x = 0;
+    parse_hex(hex[v & 0xffff],4,&x);
+    sink += x;
+  }));
+  return 0;
+}
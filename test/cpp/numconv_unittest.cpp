@@ -0,0 +1,137 @@
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <vector>
+#include <cctype>
+namespace numconv
+{
+#include "numconv.h"
+}
+#include "gtest/gtest.h"
+namespace numconv
+{
+
+// values around the powers of 2 and 10 and the ends, plus random ones.
+std::vector<uint32_t> samples()
+{
+  std::vector<uint32_t> res;
+  for (int k = 0; k < 32; k++)
+    for (int d = -2; d <= 2; d++)
+      res.push_back((1u << k)+d);
+  for (uint32_t p = 1; p <= 1000000000u; p *= 10)
+    for (int d = -2; d <= 2; d++)
+      res.push_back(p+d);
+  res.push_back(0xffffffffu);
+  srand(20);
+  for (int k = 0; k < 1000000; k++)
+    res.push_back((uint32_t)rand() << 16 ^ (uint32_t)rand());
+  return res;
+}
+
+std::string dec(int32_t value, uint8_t len)
+{
+  std::string s(len,'?');
+  EXPECT_TRUE(fmt_dec(&s[0],len,value)) << value;
+  return s;
+}
+
+TEST(numconv, div10IsExact)
+{
+  for (uint32_t x = 0; x <= 0xffff; x++)
+    ASSERT_EQ(x/10,numconv_div10_16(x));
+  for (uint32_t x : samples())
+    ASSERT_EQ(x/10,numconv_div10_32(x));
+}
+
+TEST(numconv, fmtDecMatchesPrintf)
+{
+  char expected[16];
+  for (int32_t v = -0x8000; v <= 0xffff; v++) {
+    snprintf(expected,sizeof(expected),"%6ld",(long)v);
+    ASSERT_EQ(expected,dec(v,6));
+  }
+  for (uint32_t x : samples()) {
+    int32_t v = (int32_t)x;
+    snprintf(expected,sizeof(expected),"%11ld",(long)v);
+    ASSERT_EQ(expected,dec(v,11));
+  }
+  EXPECT_EQ("-2147483648",dec(INT32_MIN,11));
+}
+
+TEST(numconv, fmtDecReportsOverflow)
+{
+  char s[5] = "????";
+  EXPECT_TRUE(fmt_dec(s,4,9999));
+  EXPECT_TRUE(fmt_dec(s,4,-999));
+  EXPECT_FALSE(fmt_dec(s,4,10000));
+  EXPECT_EQ("####",std::string(s));
+  EXPECT_FALSE(fmt_dec(s,4,-1000));
+  EXPECT_FALSE(fmt_dec(s,4,INT32_MIN));
+  EXPECT_FALSE(fmt_dec(s,0,0));
+  // only len characters are written.
+  EXPECT_EQ('\0',s[4]);
+}
+
+TEST(numconv, fmtHexMatchesPrintf)
+{
+  char expected[16], s[16];
+  for (uint32_t x : samples()) {
+    for (uint8_t count = 1; count <= 8; x >>= 4, count++) {
+      uint32_t masked = count == 8 ? x : x & ((1u << 4*count)-1);
+      snprintf(expected,sizeof(expected),"%0*lX",count,(unsigned long)masked);
+      fmt_hex(x,s,count);
+      ASSERT_STREQ(expected,s);
+    }
+  }
+}
+
+TEST(numconv, parsersMatchStrtoul)
+{
+  char s[16];
+  uint32_t v;
+  for (uint32_t x : samples()) {
+    const char* formats[] = {"%lX","%lx","%08lX"};
+    for (const char* format : formats) {
+      int len = snprintf(s,sizeof(s),format,(unsigned long)x);
+      ASSERT_TRUE(parse_hex(s,len,&v)) << s;
+      ASSERT_EQ(strtoul(s,NULL,16),v);
+    }
+    int len = snprintf(s,sizeof(s),"%lu",(unsigned long)x);
+    ASSERT_TRUE(parse_dec(s,len,&v)) << s;
+    ASSERT_EQ(strtoul(s,NULL,10),v);
+  }
+  // a length, not a 0 ends the number.
+  EXPECT_TRUE(parse_hex("12ab",2,&v));
+  EXPECT_EQ(0x12u,v);
+}
+
+TEST(numconv, parsersRejectEverythingElse)
+{
+  uint32_t v = 1234;
+  const char* bad_hex[] = {
+    "", " 1", "1 ", "-1", "+1", "0x1", "12g", "G", "@", "`", "1:", "123456789",
+    "100000000"
+  };
+  for (const char* s : bad_hex)
+    EXPECT_FALSE(parse_hex(s,strlen(s),&v)) << s;
+  const char* bad_dec[] = {"", " 1", "-1", "+1", "1a", "4294967296", "9999999999", "1/"};
+  for (const char* s : bad_dec)
+    EXPECT_FALSE(parse_dec(s,strlen(s),&v)) << s;
+  EXPECT_EQ(1234u,v);
+  // every character that isn't a digit.
+  for (int c = 0; c < 256; c++) {
+    char s[1] = {(char)c};
+    bool hex = isxdigit(c), digit = isdigit(c);
+    EXPECT_EQ(hex,parse_hex(s,1,&v)) << c;
+    EXPECT_EQ(digit,parse_dec(s,1,&v)) << c;
+  }
+  // leading zeros don't count.
+  EXPECT_TRUE(parse_hex("000000000FFFFFFFF",17,&v));
+  EXPECT_EQ(0xffffffffu,v);
+  EXPECT_TRUE(parse_dec("004294967295",12,&v));
+  EXPECT_EQ(0xffffffffu,v);
+}
+
+}
@@ -0,0 +1,98 @@
+/*
+  Host benchmark of periodic events against handlers that enqueue
+  themselves again, as segment_ontimer() and friends used to.
+  A 1 ms event runs for 10^6 periods, each time with a random interrupt
+  latency of up to max_latency ticks, next to half a queue of other events.
+  Reports the host cycles the compare ISR takes per period and how far the
+  last period ends from start + 10^6 periods, in ticks.
+*/
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <avr/io.h>
+#include <avr/interrupt.h>
+#include <util/atomic.h>
+#include "timers.h"
+#include "events.c.h"
+
+static const uint32_t period = 16000; // 1 ms at 16 MHz.
+static const uint32_t periods = 1000000;
+static const uint32_t max_latency = 400;
+
+static uint32_t runs;
+
+static void nop_event(void* param)
+{
+}
+
+static void reenqueue_event(void* param)
+{
+  runs++;
+  enqueue_event_rel_flags(period,&reenqueue_event,NULL,EVENT_FLAG_ISR);
+}
+
+static void periodic_event(void* param)
+{
+  runs++;
+}
+
+static event_handle_t others[EVENT_QUEUE_SIZE/2];
+
+// keeps the other events far ahead of the clock, outside of the measurement.
+static void push_others(uint32_t now)
+{
+  for (uint8_t i = 0; i < EVENT_QUEUE_SIZE/2; i++)
+    event_reschedule(others[i],now+0x40000000u+rand()%1000000);
+}
+
+static void run(const char* name, bool use_periodic)
+{
+  srand(1);
+  events_clear();
+  TCNT1 = 0;
+  event_time_high = 0;
+  TIFR1 = 0;
+  for (uint8_t i = 0; i < EVENT_QUEUE_SIZE/2; i++)
+    others[i] = enqueue_event_abs(0,&nop_event,NULL);
+  push_others(0);
+  if (use_periodic)
+    enqueue_periodic_flags(period,&periodic_event,NULL,EVENT_FLAG_ISR);
+  else
+    enqueue_event_rel_flags(period,&reenqueue_event,NULL,EVENT_FLAG_ISR);
+  runs = 0;
+  uint64_t cycles = 0, elapsed = 0;
+  uint32_t now = 0, pushed = 0;
+  while (runs < periods) {
+    uint32_t next;
+    if (!events_next_time(&next))
+      break;
+    uint32_t t = next+rand()%(max_latency+1);
+    elapsed += next-now;
+    now = next;
+    event_time_high = t >> 16;
+    TCNT1 = t & 0xffff;
+    TIFR1 = 0;
+    cli();
+    TIMER1_COMPA_vect();
+    sei();
+    cycles += fake_irq_off_last;
+    if (now-pushed > 0x20000000u) {
+      push_others(now);
+      pushed = now;
+    }
+  }
+  int64_t drift = (int64_t)(elapsed-(uint64_t)periods*period);
+  printf("%-10s %7.1f host cycles per period, drift after %lu periods: %8lld ticks (%.3f ms)\n",
+         name,(double)cycles/periods,(unsigned long)periods,(long long)drift,
+         drift/16000.0); // ticks per ms at 16 MHz.
+}
+
+int main()
+{
+  sei();
+  printf("EVENT_QUEUE_SIZE=%3d, period %lu ticks, latency 0..%lu ticks\n",
+         EVENT_QUEUE_SIZE,(unsigned long)period,(unsigned long)max_latency);
+  run("re-enqueue",false);
+  run("periodic",true);
+  return 0;
+}
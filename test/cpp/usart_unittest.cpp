@@ -0,0 +1,539 @@
+#include <cstdint>
+#include <cstring>
+#include <string>
+#include <avr/io.h>
+#include <avr/interrupt.h>
+#include <util/atomic.h>
+#define F_CPU 16000000L
+namespace usart
+{
+#define usart_rx_size 16
+// as in main.c.
+#define outbuf_size 80
+#define USART_FRAMES
+#define USART_BUS
+#include "usart.h"
+}
+#include "gtest/gtest.h"
+namespace usart
+{
+
+std::string received;
+// received by the ISR while EVENT_USART_Read() runs.
+std::string more_input;
+
+void receive(const std::string& s);
+
+void EVENT_USART_Read(char c)
+{
+  received.push_back(c);
+  std::string s;
+  s.swap(more_input);
+  receive(s);
+}
+
+// the USART receives c, with the error flags in status.
+void receive(char c, uint8_t status = 0)
+{
+  UCSR0A = (1<<RXC0)|status;
+  UDR0 = c;
+  USART_RX_vect();
+}
+
+void receive(const std::string& s)
+{
+  for (char c : s)
+    receive(c);
+}
+
+class usart_rx : public ::testing::Test
+{
+protected:
+  void SetUp() override
+  {
+    usart_rx_head = usart_rx_tail = 0;
+    usart_rx_stats_t stats;
+    usart_rx_stats_get(&stats,true);
+    received.clear();
+    more_input.clear();
+  }
+};
+
+TEST_F(usart_rx, charactersWaitForTheMainLoop)
+{
+  receive("!d\n");
+  EXPECT_TRUE(received.empty());
+  EXPECT_TRUE(usart_rx_pending());
+  usart_rx_dispatch();
+  EXPECT_EQ("!d\n",received);
+  EXPECT_FALSE(usart_rx_pending());
+}
+
+TEST_F(usart_rx, indicesWrapAround)
+{
+  std::string expected;
+  for (int k = 0; k < 100; k++) {
+    std::string s = "!D" + std::to_string(k) + "\n";
+    receive(s);
+    expected += s;
+    usart_rx_dispatch();
+  }
+  EXPECT_EQ(expected,received);
+}
+
+TEST_F(usart_rx, fullRingDropsTheLine)
+{
+  receive("!T\n!f123456789abcdef");
+  usart_rx_dispatch();
+  // the last character that fit is 0, so process_char() drops the line.
+  EXPECT_EQ(std::string("!T\n!f123456789a\0",usart_rx_size),received);
+  usart_rx_stats_t stats;
+  usart_rx_stats_get(&stats,false);
+  EXPECT_EQ(4,stats.ring_full);
+  EXPECT_EQ(0,stats.overrun);
+  EXPECT_EQ(0,stats.frame_error);
+  // there is room again.
+  receive("\n!d\n");
+  usart_rx_dispatch();
+  EXPECT_EQ("\n!d\n",received.substr(usart_rx_size));
+}
+
+TEST_F(usart_rx, errorsAreCountedAndReplaced)
+{
+  receive('!');
+  receive('x',1<<FE0);
+  receive('d',1<<DOR0);
+  receive('\n');
+  usart_rx_dispatch();
+  EXPECT_EQ(std::string("!\0\0\n",4),received);
+  usart_rx_stats_t stats;
+  usart_rx_stats_get(&stats,true);
+  EXPECT_EQ(1,stats.overrun);
+  EXPECT_EQ(1,stats.frame_error);
+  EXPECT_EQ(0,stats.ring_full);
+  usart_rx_stats_get(&stats,false);
+  EXPECT_EQ(0,stats.overrun);
+  EXPECT_EQ(0,stats.frame_error);
+}
+
+TEST_F(usart_rx, charactersArrivingDuringDispatchAreKept)
+{
+  // a command that takes long, while the next one comes in.
+  receive("!D1");
+  more_input = "\n!d\n";
+  usart_rx_dispatch();
+  EXPECT_EQ("!D1\n!d\n",received);
+}
+
+// runs the UDRE interrupt until the TX queue is empty, returns what it sent.
+std::string send_all()
+{
+  std::string res;
+  while (UCSR0B & (1<<UDRIE0)) {
+    UCSR0A = 1<<UDRE0;
+    // on a bus, the interrupt may also find it isn't its turn.
+    uint8_t tail = usart_tx_tail;
+    uint8_t len = usart_tx_queue[tail & (usart_tx_queue_size-1)].len;
+    USART_UDRE_vect();
+    if (tail != usart_tx_tail || len != usart_tx_queue[tail & (usart_tx_queue_size-1)].len)
+      res.push_back(UDR0);
+  }
+  return res;
+}
+
+class usart_tx : public ::testing::Test
+{
+protected:
+  void SetUp() override
+  {
+    usart_tx_head = usart_tx_tail = 0;
+    outbuf_len = outbuf_start = 0;
+    UCSR0B = 0;
+  }
+};
+
+const char door_msg[] PROGMEM = "DOOR=";
+
+TEST_F(usart_tx, flashStringsAreNotCopied)
+{
+  usart_write_P(door_msg,sizeof(door_msg)-1);
+  EXPECT_EQ(0,outbuf_len);
+  for (char c : std::string("1021\n"))
+    usart_writechar(c);
+  usart_msg("OK.\n");
+  // the characters in RAM share one span.
+  EXPECT_EQ(3,(uint8_t)(usart_tx_head-usart_tx_tail));
+  EXPECT_EQ(5,outbuf_len);
+  EXPECT_FALSE(usart_idle());
+  EXPECT_EQ("DOOR=1021\nOK.\n",send_all());
+  EXPECT_EQ(0,outbuf_len);
+}
+
+TEST_F(usart_tx, outbufWrapsAround)
+{
+  std::string expected, sent;
+  for (int k = 0; k < 50; k++) {
+    std::string s = "!" + std::to_string(k*k) + "\n";
+    usart_write(s.data(),s.size());
+    usart_msg("-");
+    expected += s + "-";
+    sent += send_all();
+  }
+  EXPECT_EQ(expected,sent);
+}
+
+// n times "ab".
+std::string ab_times(int n)
+{
+  std::string res;
+  for (int k = 0; k < n; k++)
+    res += "ab";
+  return res;
+}
+
+TEST_F(usart_tx, fullQueueCopiesFlashStrings)
+{
+  for (int k = 0; k < usart_tx_queue_size; k++)
+    usart_msg("ab");
+  EXPECT_EQ(0,usart_writable_space());
+  EXPECT_FALSE(usart_writechar('x'));
+  usart_msg("cd");
+  EXPECT_EQ(ab_times(usart_tx_queue_size),send_all());
+  // with a span in outbuf last, a flash string goes there.
+  for (int k = 0; k < usart_tx_queue_size-1; k++)
+    usart_msg("ab");
+  usart_writechar('x');
+  usart_msg("cd");
+  EXPECT_EQ(3,outbuf_len);
+  EXPECT_EQ(ab_times(usart_tx_queue_size-1)+"xcd",send_all());
+}
+
+TEST_F(usart_tx, writesWhatFits)
+{
+  std::string s(outbuf_size+5,'x');
+  usart_write(s.data(),s.size());
+  EXPECT_EQ(outbuf_size,outbuf_len);
+  EXPECT_EQ(0,usart_writable_space());
+  EXPECT_EQ(std::string(outbuf_size,'x'),send_all());
+  EXPECT_EQ(outbuf_size,usart_writable_space());
+}
+
+TEST(usart_baud,ratesWithinTolerance)
+{
+  EXPECT_EQ(0,usart_baud_ubrr(2000000));
+  EXPECT_EQ(1,usart_baud_ubrr(1000000));
+  EXPECT_EQ(3,usart_baud_ubrr(500000));
+  EXPECT_EQ(16,usart_baud_ubrr(115200));
+  EXPECT_EQ(34,usart_baud_ubrr(57600));
+  EXPECT_EQ(207,usart_baud_ubrr(9600));
+  // 222222 and 250000 instead of 230400, 285714 and 333333 for 300000.
+  EXPECT_EQ(-1,usart_baud_ubrr(230400));
+  EXPECT_EQ(-1,usart_baud_ubrr(300000));
+  EXPECT_EQ(-1,usart_baud_ubrr(4000000));
+  EXPECT_EQ(-1,usart_baud_ubrr(1200));
+  EXPECT_EQ(-1,usart_baud_ubrr(0));
+}
+
+TEST_F(usart_tx, newBaudRateKeepsTheOutput)
+{
+  usart_msg("OK.\n");
+  usart_init_ubrr(1);
+  EXPECT_EQ(1,UBRR0);
+  EXPECT_EQ("OK.\n",send_all());
+  usart_init_ubrr(207);
+  EXPECT_FALSE(UCSR0B & (1<<UDRIE0));
+}
+
+class usart_msg_test : public usart_tx
+{
+protected:
+  void SetUp() override
+  {
+    usart_tx::SetUp();
+    uint16_t dropped[USART_PRIOS];
+    usart_tx_dropped_get(dropped,true);
+    usart_framing = false;
+    sei();
+  }
+};
+
+// the DOOR= line of print_door_feedback().
+bool door_line()
+{
+  if (!usart_msg_begin(USART_PRIO_STATE,10))
+    return false;
+  EXPECT_FALSE(SREG & (1 << SREG_I));
+  usart_msg("DOOR=");
+  usart_write("1021\n",5);
+  usart_msg_end();
+  return true;
+}
+
+TEST_F(usart_msg_test, messagesGoOutWholeOrNotAtAll)
+{
+  std::string s(outbuf_size-8,'x');
+  usart_write(s.data(),s.size());
+  EXPECT_FALSE(door_line());
+  uint16_t dropped[USART_PRIOS];
+  usart_tx_dropped_get(dropped,false);
+  EXPECT_EQ(0,dropped[USART_PRIO_DEBUG]);
+  EXPECT_EQ(0,dropped[USART_PRIO_REPLY]);
+  EXPECT_EQ(1,dropped[USART_PRIO_STATE]);
+  EXPECT_TRUE(SREG & (1 << SREG_I));
+  EXPECT_EQ(s,send_all());
+  EXPECT_TRUE(door_line());
+  EXPECT_TRUE(SREG & (1 << SREG_I));
+  EXPECT_EQ("DOOR=1021\n",send_all());
+}
+
+TEST_F(usart_msg_test, debugOutputIsShedFirst)
+{
+  // SENSE= lines until they stop.
+  int sense = 0;
+  while (usart_msg_begin(USART_PRIO_DEBUG,11)) {
+    usart_msg("SENSE=");
+    usart_write("0123\n",5);
+    usart_msg_end();
+    sense++;
+  }
+  EXPECT_GT(sense,0);
+  // half of the buffer and of the queue are left for the others.
+  EXPECT_TRUE(usart_msg_fits(USART_PRIO_REPLY,outbuf_size/4));
+  int door = 0;
+  while (door_line())
+    door++;
+  EXPECT_GE(door,1);
+  uint16_t dropped[USART_PRIOS];
+  usart_tx_dropped_get(dropped,true);
+  EXPECT_EQ(1,dropped[USART_PRIO_DEBUG]);
+  EXPECT_EQ(1,dropped[USART_PRIO_STATE]);
+  std::string expected;
+  for (int k = 0; k < sense; k++)
+    expected += "SENSE=0123\n";
+  for (int k = 0; k < door; k++)
+    expected += "DOOR=1021\n";
+  EXPECT_EQ(expected,send_all());
+  usart_tx_dropped_get(dropped,false);
+  EXPECT_EQ(0,dropped[USART_PRIO_DEBUG]);
+}
+
+TEST_F(usart_msg_test, lastSpanIsKeptForTheRamParts)
+{
+  for (int k = 0; k < usart_tx_queue_size-1; k++)
+    usart_msg("ab");
+  // "DOOR=" goes into outbuf, so "1021\n" still gets a span.
+  EXPECT_TRUE(door_line());
+  EXPECT_EQ(10,outbuf_len);
+  EXPECT_EQ(ab_times(usart_tx_queue_size-1)+"DOOR=1021\n",send_all());
+}
+
+class usart_frames : public usart_msg_test
+{
+protected:
+  void SetUp() override
+  {
+    usart_msg_test::SetUp();
+    usart_framing = true;
+    usart_rx_stats_t stats;
+    usart_rx_stats_get(&stats,true);
+  }
+  void TearDown() override
+  {
+    usart_framing = false;
+  }
+};
+
+// decodes one sent frame, with the 0 at its end. Returns type and payload
+// or "" if it is broken.
+std::string decode(const std::string& frame)
+{
+  EXPECT_EQ('\0',frame.back());
+  std::string buf = frame.substr(0,frame.size()-1);
+  EXPECT_EQ(std::string::npos,buf.find('\0'));
+  uint8_t len = usart_frame_decode(&buf[0],buf.size());
+  return buf.substr(0,len);
+}
+
+uint8_t crc8(const std::string& s)
+{
+  uint8_t crc = 0;
+  for (char c : s)
+    crc = _crc8_ccitt_update(crc,c);
+  return crc;
+}
+
+TEST_F(usart_frames, zerosAreStuffed)
+{
+  uint8_t awake = 0;
+  usart_frame(USART_PRIO_STATE,'A',&awake,1);
+  std::string data("A\0",2);
+  uint8_t crc = crc8(data);
+  ASSERT_NE(0,crc);
+  std::string expected = std::string("\x02" "A") + '\x02' + (char)crc + '\0';
+  std::string sent = send_all();
+  EXPECT_EQ(expected,sent);
+  EXPECT_EQ(data,decode(sent));
+}
+
+TEST_F(usart_frames, payloadsSurviveTheRoundTrip)
+{
+  const std::string payloads[] = {
+    "", std::string("\0",1), std::string("\0\0\0",3), "\xff\x01",
+    std::string("\x12\0\x34\0",4), std::string(60,'x'), std::string(60,'\0')
+  };
+  for (const std::string& p : payloads) {
+    usart_frame(USART_PRIO_REPLY,'T',p.data(),p.size());
+    std::string sent = send_all();
+    EXPECT_EQ(p.size()+4,sent.size());
+    EXPECT_EQ("T"+p,decode(sent));
+  }
+}
+
+TEST_F(usart_frames, framesWrapAroundOutbuf)
+{
+  for (int k = 0; k < 30; k++) {
+    std::string s(k % 7,'-');
+    usart_write(s.data(),s.size());
+    send_all();
+    int16_t sense = -k*100;
+    usart_frame(USART_PRIO_DEBUG,'S',&sense,2);
+    std::string expected("S",1);
+    expected.append((const char*)&sense,2);
+    EXPECT_EQ(expected,decode(send_all()));
+  }
+}
+
+TEST_F(usart_frames, textLinesAreWrapped)
+{
+  EXPECT_TRUE(door_line());
+  // "DOOR=" is copied, as the frame is encoded in outbuf.
+  EXPECT_EQ(14,outbuf_len);
+  EXPECT_EQ(1,(uint8_t)(usart_tx_head-usart_tx_tail));
+  EXPECT_EQ("tDOOR=1021\n",decode(send_all()));
+  // the overhead counts.
+  std::string s(outbuf_size-13,'x');
+  usart_write(s.data(),s.size());
+  EXPECT_FALSE(door_line());
+  EXPECT_EQ(s,send_all());
+}
+
+TEST_F(usart_msg_test, framesNeedNoFraming)
+{
+  // text lines stay text, but a frame is a frame.
+  usart_frame(USART_PRIO_STATE,'M',"\0\x02",2);
+  EXPECT_EQ(std::string("M\0\x02",3),decode(send_all()));
+  EXPECT_TRUE(door_line());
+  EXPECT_EQ("DOOR=1021\n",send_all());
+}
+
+TEST_F(usart_frames, brokenFramesAreCounted)
+{
+  usart_frame(USART_PRIO_REPLY,'c',"!D1",3);
+  std::string good = send_all();
+  std::string frame = good.substr(0,good.size()-1);
+  std::string bad[] = {
+    frame.substr(0,frame.size()-1), frame.substr(1), frame+'x', "",
+    std::string("\x09" "c!D1",5)
+  };
+  for (std::string b : bad)
+    EXPECT_EQ(0,usart_frame_decode(&b[0],b.size())) << b;
+  for (size_t i = 0; i < frame.size(); i++) {
+    std::string b = frame;
+    b[i] ^= 0x10;
+    EXPECT_EQ(0,usart_frame_decode(&b[0],b.size())) << i;
+  }
+  usart_rx_stats_t stats;
+  usart_rx_stats_get(&stats,true);
+  EXPECT_EQ(5+frame.size(),stats.bad_frame);
+  EXPECT_EQ("c!D1",decode(good));
+}
+
+class usart_bus : public usart_msg_test
+{
+protected:
+  void SetUp() override
+  {
+    usart_msg_test::SetUp();
+    usart_rx_head = usart_rx_tail = 0;
+    usart_bus_address = 5;
+    usart_init_ubrr(1);
+  }
+  void TearDown() override
+  {
+    usart_bus_address = 0;
+    usart_init_ubrr(1);
+  }
+};
+
+// a frame with the 9th bit set.
+void receive_address(uint8_t address)
+{
+  UCSR0B |= 1<<RXB80;
+  receive(address);
+  UCSR0B &= ~(1<<RXB80);
+}
+
+TEST_F(usart_bus, outputWaitsForTheTurn)
+{
+  EXPECT_TRUE(UCSR0A & (1<<MPCM0));
+  EXPECT_FALSE(UCSR0B & (1<<TXEN0));
+  usart_msg("OK.\n");
+  EXPECT_EQ("",send_all());
+  receive_address(3);
+  EXPECT_TRUE(UCSR0A & (1<<MPCM0));
+  receive_address(5);
+  EXPECT_FALSE(UCSR0A & (1<<MPCM0));
+  EXPECT_EQ(USART_BUS_ADDRESSED,usart_bus_state);
+  EXPECT_EQ("",send_all());
+  // the go byte doesn't reach the ring, the data after it does.
+  receive('\0');
+  EXPECT_FALSE(usart_rx_pending());
+  EXPECT_TRUE(UCSR0B & (1<<TXEN0));
+  EXPECT_EQ("OK.\n",send_all());
+  receive('!');
+  EXPECT_TRUE(usart_rx_pending());
+  receive_address(3);
+  EXPECT_TRUE(UCSR0A & (1<<MPCM0));
+  EXPECT_FALSE(UCSR0B & (1<<TXEN0));
+  EXPECT_EQ(USART_BUS_OFF,usart_bus_state);
+}
+
+TEST_F(usart_bus, linesAreFinishedAfterTheTurn)
+{
+  receive_address(5);
+  receive('\0');
+  usart_msg("DOOR=1021\n");
+  usart_msg("OK.\n");
+  for (int k = 0; k < 3; k++) {
+    UCSR0A = 1<<UDRE0;
+    USART_UDRE_vect();
+  }
+  receive_address(7);
+  EXPECT_EQ(USART_BUS_CLOSING,usart_bus_state);
+  EXPECT_TRUE(UCSR0B & (1<<TXEN0));
+  EXPECT_EQ("R=1021\n",send_all());
+  EXPECT_FALSE(UCSR0B & (1<<TXEN0));
+  EXPECT_EQ(USART_BUS_OFF,usart_bus_state);
+  // the next line waits for the next turn.
+  receive_address(5);
+  receive('\0');
+  EXPECT_EQ("OK.\n",send_all());
+}
+
+TEST_F(usart_bus, framesEndWithTheirZero)
+{
+  usart_framing = true;
+  receive_address(5);
+  receive('\0');
+  usart_frame(USART_PRIO_REPLY,'K',"",0);
+  usart_frame(USART_PRIO_REPLY,'K',"",0);
+  UCSR0A = 1<<UDRE0;
+  USART_UDRE_vect();
+  receive_address(7);
+  std::string rest = send_all();
+  EXPECT_EQ(3u,rest.size());
+  EXPECT_EQ('\0',rest.back());
+  EXPECT_EQ(USART_BUS_OFF,usart_bus_state);
+}
+
+}
@@ -0,0 +1,55 @@
+#ifndef __FAKE_INTERRUPT_H_
+#define __FAKE_INTERRUPT_H_ 1
+
+/*
+  Host stand-in for <avr/interrupt.h>. ISRs become plain functions the tests
+  call directly. cli()/sei() only flip SREG_I, but keep track of how long the
+  interrupts stayed disabled, measured in host cycles.
+*/
+
+#include <avr/io.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#else
+#include <chrono>
+#endif
+
+#define ISR_BLOCK
+#define ISR(vector, ...) void vector(void)
+
+static inline uint64_t fake_cycles(void) {
+#if defined(__x86_64__) || defined(__i386__)
+  return __rdtsc();
+#else
+  return std::chrono::steady_clock::now().time_since_epoch().count();
+#endif
+}
+
+// start of the current interrupts-off window, length of the last one and
+// the longest one so far.
+inline uint64_t fake_irq_off_since, fake_irq_off_last, fake_irq_off_max;
+
+// called after every cli()/sei(), e.g. fake_timer1_irq.
+inline void (*fake_irq_hook)(bool enabled) = nullptr;
+
+static inline void fake_irq_set(bool enable) {
+  bool enabled = SREG & (1 << SREG_I);
+  if (enabled && !enable) {
+    fake_irq_off_since = fake_cycles();
+  } else if (!enabled && enable) {
+    fake_irq_off_last = fake_cycles() - fake_irq_off_since;
+    if (fake_irq_off_last > fake_irq_off_max)
+      fake_irq_off_max = fake_irq_off_last;
+  }
+  if (enable)
+    SREG |= 1 << SREG_I;
+  else
+    SREG &= ~(1 << SREG_I);
+  if (fake_irq_hook)
+    fake_irq_hook(enable);
+}
+
+#define cli() fake_irq_set(false)
+#define sei() fake_irq_set(true)
+
+#endif
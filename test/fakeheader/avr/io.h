@@ -0,0 +1,70 @@
+#ifndef __FAKE_IO_H_
+#define __FAKE_IO_H_ 1
+
+/*
+  Host stand-in for <avr/io.h>. The registers used by the code under test are
+  plain variables, so the tests can set and inspect them.
+*/
+
+#include <stdint.h>
+
+inline volatile uint8_t SREG = 0;
+#define SREG_I 7
+
+// Timer 1, or a model of it that runs in virtual time, see fake_timer1.h.
+#ifdef FAKE_TIMER1_SIM
+#include <fake_timer1.h>
+#else
+inline volatile uint8_t TCCR1A, TCCR1B, TIMSK1, TIFR1;
+inline volatile uint16_t TCNT1, OCR1A, OCR1B;
+#endif
+#define CS10 0
+#define WGM10 0
+#define WGM11 1
+#define WGM12 3
+#define WGM13 4
+#define TOV1 0
+#define OCF1A 1
+#define OCF1B 2
+#define TOIE1 0
+#define OCIE1A 1
+#define OCIE1B 2
+
+// USART 0.
+inline volatile uint8_t UDR0, UCSR0A, UCSR0B, UCSR0C;
+inline volatile uint16_t UBRR0;
+#define MPCM0 0
+#define U2X0 1
+#define UPE0 2
+#define DOR0 3
+#define FE0 4
+#define UDRE0 5
+#define TXC0 6
+#define RXC0 7
+#define TXB80 0
+#define RXB80 1
+#define UCSZ02 2
+#define TXEN0 3
+#define RXEN0 4
+#define UDRIE0 5
+#define TXCIE0 6
+#define RXCIE0 7
+#define UCSZ00 1
+#define USBS0 3
+#define UPM00 4
+
+// the ADC.
+inline volatile uint8_t ADMUX, ADCSRA, ADCSRB, DIDR0, PRR;
+inline volatile uint16_t ADC;
+#define MUX0 0
+#define REFS0 6
+#define ADPS0 0
+#define ADIE 3
+#define ADIF 4
+#define ADATE 5
+#define ADSC 6
+#define ADEN 7
+#define ADTS0 0
+#define PRADC 0
+
+#endif
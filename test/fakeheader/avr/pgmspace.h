@@ -2,12 +2,17 @@
 #define __PGMSPACE_H_ 1
 
 #define PROGMEM
-short pgm_read_word(const short* address){
+#define PSTR(s) (s)
+static inline short pgm_read_word(const short* address){
   return *address;
 }
 
-char pgm_read_byte(const char* address){
+static inline char pgm_read_byte(const char* address){
   return *address;
 }
 
-#endif
\ No newline at end of file
+static inline void* pgm_read_ptr(const void* address){
+  return *(void* const*)address;
+}
+
+#endif
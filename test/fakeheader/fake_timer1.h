@@ -0,0 +1,183 @@
+#ifndef __FAKE_TIMER1_H_
+#define __FAKE_TIMER1_H_ 1
+
+/*
+  Virtual-time model of Timer 1, used by <avr/io.h> instead of plain
+  variables when FAKE_TIMER1_SIM is defined.
+  A virtual cycle counter drives TCNT1 through the prescaler of TCCR1B and
+  sets TOV1 and OCF1A like the hardware does in normal mode, including the
+  compare match being blocked for one timer clock after writing TCNT1.
+  TIFR1 is write-one-to-clear. Every register access, cli()/sei() and every
+  EVENTS_SIM_COST() in events.c.h moves the clock forward by an estimate of
+  its AVR cycles, so the timer runs on while the code does, and the races
+  between TCNT1, TOV1 and OCR1A happen as they would on the MCU.
+  When OCF1A is set while the interrupts are enabled, the compare vector is
+  called right away, as from the middle of the interrupted code.
+  Install fake_timer1_irq as fake_irq_hook to get cli()/sei() counted and
+  pending interrupts delivered on sei().
+*/
+
+#include <stdint.h>
+#include <type_traits>
+
+// estimated AVR cycles of the code between the register accesses.
+#define EVENTS_SIM_COST(cycles) fake_timer1.work(cycles)
+
+struct fake_timer1_t {
+  uint64_t cycles = 0;      // virtual cycles since reset.
+  uint64_t isr_cycles = 0;  // of those spent in the compare vector.
+  uint64_t isr_count = 0;
+  uint64_t isr_max = 0;     // longest run of the compare vector.
+  uint32_t phase = 0;       // cycles since the last timer clock.
+  uint16_t tcnt = 0, ocra = 0, ocrb = 0;
+  uint8_t tccra = 0, tccrb = 0, timsk = 0, tifr = 0;
+  bool compare_blocked = false;
+  void (*compa_vect)(void) = nullptr;
+
+  uint32_t divider() const {
+    static const uint32_t divs[8] = {0,1,8,64,256,1024,0,0};
+    return divs[tccrb & 7];
+  }
+
+  // counts n timer clocks. The compare unit sees the values before each
+  // increment.
+  void ticks(uint64_t n) {
+    if (n == 0)
+      return;
+    uint16_t k = ocra-tcnt;
+    if ((n > k) && !(k == 0 && compare_blocked))
+      tifr |= 1 << 1; // OCF1A
+    if (n > 0xffffu-tcnt)
+      tifr |= 1 << 0; // TOV1
+    tcnt += (uint16_t)n;
+    compare_blocked = false;
+  }
+
+  // cycles until the next compare match sets OCF1A, 0 if it never does.
+  uint64_t cycles_to_compare() const {
+    uint32_t div = divider();
+    if (div == 0)
+      return 0;
+    uint64_t n = (uint16_t)(ocra-tcnt)+1;
+    if (n == 1 && compare_blocked)
+      n += 0x10000;
+    return (n-1)*div+(div-phase);
+  }
+
+  // runs the compare vector while it is pending and enabled.
+  void deliver() {
+    while ((SREG & (1 << 7)) && (tifr & timsk & (1 << 1)) && compa_vect) {
+      uint64_t start = cycles;
+      tifr &= ~(1 << 1);
+      SREG &= ~(1 << 7);
+      // vector, jmp and the register pushes of the prologue.
+      work(24);
+      compa_vect();
+      // the pops of the epilogue and reti.
+      work(26);
+      SREG |= 1 << 7;
+      isr_count++;
+      isr_cycles += cycles-start;
+      if (cycles-start > isr_max)
+        isr_max = cycles-start;
+    }
+  }
+
+  // the code runs for c cycles.
+  void work(uint32_t c) {
+    cycles += c;
+    uint32_t div = divider();
+    if (div != 0) {
+      uint64_t total = (uint64_t)phase+c;
+      phase = total % div;
+      ticks(total / div);
+    }
+    deliver();
+  }
+
+  // the main program idles for c cycles, with the interrupts as they are.
+  void run(uint64_t c) {
+    uint64_t end = cycles+c;
+    while (cycles < end) {
+      uint64_t step = end-cycles;
+      uint64_t to_compare = cycles_to_compare();
+      if (to_compare != 0 && to_compare < step)
+        step = to_compare;
+      if (step > 0xffffffffu)
+        step = 0xffffffffu;
+      work((uint32_t)step);
+    }
+  }
+
+  void reset() {
+    *this = fake_timer1_t();
+  }
+};
+
+inline fake_timer1_t fake_timer1;
+
+// to be installed as fake_irq_hook: cli and sei take one cycle each.
+inline void fake_timer1_irq(bool enabled)
+{
+  fake_timer1.work(1);
+}
+
+/*
+  The registers. The access costs are those of in/out for TIFR1, lds/sts
+  for the other 8 bit ones and two of those for the 16 bit ones.
+*/
+enum { FAKE_TCCR1A, FAKE_TCCR1B, FAKE_TIMSK1, FAKE_TIFR1, FAKE_TCNT1,
+       FAKE_OCR1A, FAKE_OCR1B };
+
+template<int R>
+struct fake_timer1_reg {
+  static auto& field() {
+    if constexpr (R == FAKE_TCCR1A) return fake_timer1.tccra;
+    else if constexpr (R == FAKE_TCCR1B) return fake_timer1.tccrb;
+    else if constexpr (R == FAKE_TIMSK1) return fake_timer1.timsk;
+    else if constexpr (R == FAKE_TIFR1) return fake_timer1.tifr;
+    else if constexpr (R == FAKE_TCNT1) return fake_timer1.tcnt;
+    else if constexpr (R == FAKE_OCR1A) return fake_timer1.ocra;
+    else return fake_timer1.ocrb;
+  }
+  typedef std::remove_reference_t<decltype(field())> T;
+  static uint32_t cost() {
+    return R == FAKE_TIFR1 ? 1 : 2*sizeof(T);
+  }
+  operator T() const {
+    T v = field();
+    fake_timer1.work(cost());
+    return v;
+  }
+  fake_timer1_reg& operator=(T v) {
+    if (R == FAKE_TIFR1) {
+      fake_timer1.tifr &= ~v;
+    } else {
+      field() = v;
+      if (R == FAKE_TCNT1)
+        fake_timer1.compare_blocked = true;
+    }
+    fake_timer1.work(cost());
+    return *this;
+  }
+  fake_timer1_reg& operator|=(T v) { return *this = (T)(T(*this) | v); }
+  fake_timer1_reg& operator&=(T v) { return *this = (T)(T(*this) & v); }
+};
+
+// named apart from the plain variables other test files get.
+inline fake_timer1_reg<FAKE_TCCR1A> fake_TCCR1A;
+inline fake_timer1_reg<FAKE_TCCR1B> fake_TCCR1B;
+inline fake_timer1_reg<FAKE_TIMSK1> fake_TIMSK1;
+inline fake_timer1_reg<FAKE_TIFR1> fake_TIFR1;
+inline fake_timer1_reg<FAKE_TCNT1> fake_TCNT1;
+inline fake_timer1_reg<FAKE_OCR1A> fake_OCR1A;
+inline fake_timer1_reg<FAKE_OCR1B> fake_OCR1B;
+#define TCCR1A fake_TCCR1A
+#define TCCR1B fake_TCCR1B
+#define TIMSK1 fake_TIMSK1
+#define TIFR1 fake_TIFR1
+#define TCNT1 fake_TCNT1
+#define OCR1A fake_OCR1A
+#define OCR1B fake_OCR1B
+
+#endif
@@ -0,0 +1,30 @@
+#ifndef __FAKE_ATOMIC_H_
+#define __FAKE_ATOMIC_H_ 1
+
+/*
+  Host stand-in for <util/atomic.h>, built on the fake cli()/sei().
+  Leaving the block by return restores the state just like avr-libc does.
+*/
+
+#include <avr/interrupt.h>
+
+#define ATOMIC_RESTORESTATE true
+#define ATOMIC_FORCEON false
+
+struct fake_atomic_block {
+  uint8_t sreg;
+  bool restore, done;
+  fake_atomic_block(bool restore_state)
+    : sreg(SREG), restore(restore_state), done(false) {
+    fake_irq_set(false);
+  }
+  ~fake_atomic_block() {
+    fake_irq_set(restore ? (sreg >> SREG_I) & 1 : true);
+  }
+};
+
+#define ATOMIC_BLOCK(type) \
+  for (fake_atomic_block __atomic_block(type); !__atomic_block.done; \
+       __atomic_block.done = true)
+
+#endif
@@ -0,0 +1,23 @@
+#ifndef __FAKE_CRC16_H_
+#define __FAKE_CRC16_H_ 1
+
+/*
+  Host stand-in for <util/crc16.h>, with the C equivalent that avr-libc
+  documents for its inline assembly.
+*/
+
+#include <stdint.h>
+
+static inline uint8_t _crc8_ccitt_update(uint8_t inCrc, uint8_t inData)
+{
+  uint8_t data = inCrc ^ inData;
+  for (uint8_t i = 0; i < 8; i++) {
+    if (data & 0x80)
+      data = (data << 1) ^ 0x07;
+    else
+      data <<= 1;
+  }
+  return data;
+}
+
+#endif